@@ -16,13 +16,22 @@
 #include <time.h>
 #include <assert.h>
 #include <stdbool.h>
+#include <stdatomic.h>
 
 // todo: separate lib
 #include "../thread/thread.inc"
 #include "upscale.inc"
 #include "../palette/palette.inc"
 
-#ifdef _WIN32 // always keep the platform include at the bottom of includes (todo: or better: invert control and let platform call this code instead ~WinMain/main)
+#if HEADLESS // no platform: only the simulation runs, without a window or display server (see run_headless)
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+#include <stdlib.h>
+#include <string.h>
+#elif defined(_WIN32) // always keep the platform include at the bottom of includes (todo: or better: invert control and let platform call this code instead ~WinMain/main)
 #include "../windows/win32.inc"
 #else
 #include "../wayland/wayland.inc"
@@ -49,10 +58,108 @@ static inline int nanosleep(const struct timespec *req, struct timespec *rem) {
 #endif
 #define elapsed_us(start) (time_us() - (start))
 
+#pragma region SCENARIO
+// sizes of the loaded game, the map size comes from map.tga and the rest from data/scenario.txt (key = value lines,
+// anything missing keeps its default)
+#define BUCKET_COST 100 // cumulative movement cost covered by one bucket
+struct scenario {
+    u32 players; // players taking part, at most MAX_PLAYERS
+    u32 max_units; // max number of units per player
+    u32 max_stacks; // players * max_units, a stack needs at least one unit
+    u32 move_budget; // movement cost a unit can spend per turn
+    u32 bucket_count; // number of buckets for resolve order, enough to cover move_budget
+};
+struct scenario scenario = {.players = 2, .max_units = 128, .move_budget = 400};
+
+// bump allocator for everything that lives as long as the loaded map, nothing is freed on its own
+#define ARENA_BLOCK (1u << 20)
+struct arena {
+    u8 *block;
+    usize used, size; // of the current block
+    usize total; // bytes taken from the system
+};
+struct arena world_arena;
+
+void *arena_alloc(struct arena *arena, usize bytes) {
+    bytes = (bytes + 15) & ~(usize)15;
+    if (arena->used + bytes > arena->size) { // the rest of the block is wasted, blocks are large compared to what goes in
+        arena->size = bytes > ARENA_BLOCK ? bytes : ARENA_BLOCK;
+        arena->block = calloc(1, arena->size);
+        if (!arena->block) { fprintf(stderr, "OOM: arena\n"); exit(1); }
+        arena->used = 0;
+        arena->total += arena->size;
+    }
+    void *memory = arena->block + arena->used;
+    arena->used += bytes;
+    return memory; // zeroed
+}
+
+// grows a heap array to hold at least count items of size bytes, keeping what is in it
+void *grow_array(void *items, u32 *capacity, u32 count, usize size, const char *what) {
+    if (count <= *capacity) return items;
+    *capacity = count > *capacity * 2 ? count : *capacity * 2;
+    items = realloc(items, (usize)*capacity * size);
+    if (!items) { fprintf(stderr, "OOM: %s\n", what); exit(1); }
+    return items;
+}
+#pragma endregion
+
+#define WHITE 0xFFFFFFFF
+#define RED 0xFFFF0000
+#define GREEN 0xFF00FF00
+#define YELLOW 0xFFFFFF00
+
+struct tga {
+    u32 w, h; // dimensions
+    u32 *pix; // pointer to pixel data
+    const void *map; // handle
+    size_t map_len; // keep track of length for unmapping later
+    u8 *indices, *opaque; // the pixels as rgb332 palette indices, and 0xFF where they aren't transparent (see index_atlas)
+};
+
+#pragma region GRID
+// gameplay state per tile in chunks of CHUNK_SIZE x CHUNK_SIZE tiles, the tga images are only the import format.
+// tile ids are chunk major: the chunk index in the high bits and the position inside the chunk in the low ones, so
+// the tiles of a chunk are contiguous and finding a tile's data is a shift and a mask. the chunk columns are rounded
+// up to a power of two for that, the padding chunks are never allocated
+#define NO_OWNER 0xFF
+#define NO_STACK 0xFFFF
+#define NO_TILE 0xFFFFFFFFu
+#define CHUNK_SHIFT 5
+#define CHUNK_SIZE (1 << CHUNK_SHIFT)
+#define CHUNK_MASK (CHUNK_SIZE - 1)
+#define CHUNK_BITS (2 * CHUNK_SHIFT)
+#define CHUNK_TILES (1 << CHUNK_BITS)
+struct chunk {
+    u8 terrain[CHUNK_TILES]; // enum tiles
+    u8 owner[CHUNK_TILES]; // enum players, NO_OWNER for neutral tiles
+    u16 stack[CHUNK_TILES]; // index into unit_stacks, NO_STACK if there are no units
+    u32 changed; // change_counter at the last occupancy change in the chunk
+};
+struct grid {
+    u32 w, h; // in tiles
+    u32 chunks_w, chunks_h;
+    u32 column_shift; // log2 of chunks_w rounded up to a power of two
+    u32 chunk_count; // chunk indices in use including the padding, tile ids are below chunk_count << CHUNK_BITS
+    struct chunk **chunks; // by chunk index, NULL for padding
+};
+struct grid grid;
+
+static inline u32 tile_at(u32 x, u32 y) {
+    return ((y >> CHUNK_SHIFT) << grid.column_shift | x >> CHUNK_SHIFT) << CHUNK_BITS | (y & CHUNK_MASK) << CHUNK_SHIFT | (x & CHUNK_MASK);
+}
+static inline u32 tile_x(u32 tile) { return ((tile >> CHUNK_BITS) & ((1u << grid.column_shift) - 1)) << CHUNK_SHIFT | (tile & CHUNK_MASK); }
+static inline u32 tile_y(u32 tile) { return (tile >> (CHUNK_BITS + grid.column_shift)) << CHUNK_SHIFT | ((tile >> CHUNK_SHIFT) & CHUNK_MASK); }
+static inline u32 in_chunk(u32 tile) { return tile & (CHUNK_TILES - 1); }
+static inline u32 row_major(u32 tile) { return tile_y(tile) * grid.w + tile_x(tile); } // for orders that mustn't depend on the chunk layout
+static inline bool on_map(u32 x, u32 y) { return x < grid.w && y < grid.h; } // also catches -1 wrapped around
+#define grid_chunk(tile) (grid.chunks[(tile) >> CHUNK_BITS])
+#define grid_terrain(tile) (grid_chunk(tile)->terrain[in_chunk(tile)])
+#define grid_owner(tile) (grid_chunk(tile)->owner[in_chunk(tile)])
+#define grid_stack(tile) (grid_chunk(tile)->stack[in_chunk(tile)])
+#pragma endregion
+
 #pragma region CAMERA
-// todo: this needs to match the data in the tga files, but needs to be in scenario/save data (and also not global in code but passed via eg. a struct)
-#define GRID_W 50
-#define GRID_H 50
 #define TILE_SIZE 64
 #define ATLAS_SIZE 8
 
@@ -64,45 +171,31 @@ struct camera {
     u32 display_w, display_h; // size of the original display (in pixels), to keep track of the size we need to scale to (off by one stride means we cannot just x2)
     u32 zoom;
     u32 need_scaling;
-    u32 update; // the camera has moved this frame
+    u32 update; // everything on screen has to be redrawn: the buffer was resized or the overlay toggled
+    i32 scroll_x, scroll_y; // tiles the camera moved since the last frame
+    u32 show_influence; // overlay the influence zones
+    u8 *restrict indices; // drawn to instead of buffer when the frame buffer is indexed, NULL if it isn't
 };
 
 void move_camera(struct camera *camera, i32 delta_x, i32 delta_y) {
     u32 legal_delta_x = delta_x;
     u32 legal_delta_y = delta_y;
     if (camera->tile_x + delta_x < 0) legal_delta_x -= (camera->tile_x + delta_x);
-    if (camera->end_x + delta_x > (GRID_W - 1)) legal_delta_x -= (camera->end_x + delta_x - (GRID_W - 1));
+    if (camera->end_x + delta_x > (grid.w - 1)) legal_delta_x -= (camera->end_x + delta_x - (grid.w - 1));
     if (camera->tile_y + delta_y < 0) legal_delta_y -= (camera->tile_y + delta_y);
-    if (camera->end_y + delta_y > (GRID_H - 1)) legal_delta_y -= (camera->end_y + delta_y - (GRID_H - 1));
+    if (camera->end_y + delta_y > (grid.h - 1)) legal_delta_y -= (camera->end_y + delta_y - (grid.h - 1));
     camera->tile_x += legal_delta_x;
     camera->end_x += legal_delta_x;
     camera->tile_y += legal_delta_y;
     camera->end_y += legal_delta_y;
-    camera->update = 1;
+    camera->scroll_x += (i32)legal_delta_x;
+    camera->scroll_y += (i32)legal_delta_y;
 }
 
 // todo: pass to callbacks instead of global
 #pragma endregion
 
-// todo: these hardcoded globals need to be configurable in data instead and not global
-#define MAX_UNITS 128 // max number of units per player
-#define BUCKET_COUNT 8 // number of buckets for resolve order
-#define BUCKET_SIZE MAX_UNITS // number of steps per bucket
-
-#define WHITE 0xFFFFFFFF
-#define RED 0xFFFF0000
-#define GREEN 0xFF00FF00
-#define YELLOW 0xFFFFFF00
-
-struct tga {
-    u32 w, h; // dimensions
-    u32 *pix; // pointer to pixel data
-    const void *map; // handle
-    size_t map_len; // keep track of length for unmapping later
-};
-
 #pragma region TILES
-struct tga map;
 enum tiles {
     SEA,
     CITY,
@@ -121,15 +214,17 @@ u32 tile_colors[TILE_COUNT] = {
     [FOREST] = 0xFF21480e
 };
 enum tiles get_tile(u32 x, u32 y) {
-    assert(x >= 0 && x < GRID_W && "x is out of bounds");
-    assert(y >= 0 && y < GRID_H && "y is out of bounds");
-    u32 tile_color = map.pix[y * map.w + x];
+    assert(x >= 0 && x < grid.w && "x is out of bounds");
+    assert(y >= 0 && y < grid.h && "y is out of bounds");
+    return grid_terrain(tile_at(x, y));
+}; 
+enum tiles tile_from_color(u32 tile_color, u32 x, u32 y) {
     for (u32 i = 0; i < TILE_COUNT; i++)
         if (tile_colors[i] == tile_color)
             return i;
     printf("Tile not found for color: 0x%08X, tile: %d, %d\n", tile_color, x, y);
     return -1;
-}; 
+}
 u32 tile_income[TILE_COUNT] = {
     [SEA] = 0,
     [CITY] = 1,
@@ -141,30 +236,59 @@ u32 tile_income[TILE_COUNT] = {
 #pragma endregion
 
 #pragma region PLAYERS
-struct tga players;
 enum players {
     GERMANY,
     SOVIET,
-    PLAYER_COUNT
+    BRITAIN,
+    FRANCE,
+    ITALY,
+    JAPAN,
+    USA,
+    POLAND,
+    ROMANIA,
+    HUNGARY,
+    FINLAND,
+    YUGOSLAVIA,
+    GREECE,
+    TURKEY,
+    SPAIN,
+    SWEDEN,
+    MAX_PLAYERS // players a scenario can have
 };
-u32 player_colors[PLAYER_COUNT] = {
+u32 player_colors[MAX_PLAYERS] = {
     [GERMANY] = 0xFF6a3e0d,
-    [SOVIET] = 0xFF6a0d33
+    [SOVIET] = 0xFF6a0d33,
+    [BRITAIN] = 0xFF8a1c1c,
+    [FRANCE] = 0xFF1c3a8a,
+    [ITALY] = 0xFF2e7a3a,
+    [JAPAN] = 0xFFb0a040,
+    [USA] = 0xFF3a6a9a,
+    [POLAND] = 0xFFa05a7a,
+    [ROMANIA] = 0xFFb07a1c,
+    [HUNGARY] = 0xFF5a7a2e,
+    [FINLAND] = 0xFFd0d0e0,
+    [YUGOSLAVIA] = 0xFF7a3a9a,
+    [GREECE] = 0xFF40a0b0,
+    [TURKEY] = 0xFF9a4a3a,
+    [SPAIN] = 0xFFc0903a,
+    [SWEDEN] = 0xFF2a4a6a
 };
 enum players get_player(u32 x, u32 y) {
-    u32 player_color = players.pix[y * players.w + x];
-    for (u32 i = 0; i < PLAYER_COUNT; i++)
+    u8 owner = grid_owner(tile_at(x, y));
+    return owner == NO_OWNER ? -1 : owner;
+}; 
+enum players player_from_color(u32 player_color) {
+    for (u32 i = 0; i < scenario.players; i++)
         if (player_colors[i] == player_color)
             return i;
-    printf("Player not found\n");
+    if (player_color != 0) printf("Player not found for color: 0x%08X\n", player_color);
     return -1;
-}; 
-u32 player_cities[PLAYER_COUNT] = {0};
-u32 player_money[PLAYER_COUNT] = {0};
+}
+_Atomic u32 player_cities[MAX_PLAYERS] = {0}; // regions resolving in parallel can take cities at the same time
+u32 player_money[MAX_PLAYERS] = {0};
 #pragma endregion
 
 #pragma region UNITS
-struct tga units;
 enum units {
     INFANTRY,
     MOTORIZED,
@@ -176,38 +300,52 @@ u32 unit_colors[UNIT_COUNT] = {
     [MOTORIZED] = 0xFF383838,
     [ARMOR] = 0xFF6f6f6f,
 };
+#define NO_UNIT 0xFFFF
 struct unit {
     u32 x, y; // position on grid
-    u32 type;
+    u32 type; // -1 for a free slot
     u32 id;
+    u16 generation; // bumped every time the slot is freed, so handles to a dead unit stop resolving
+    u16 prev_in_stack, next_in_stack; // intrusive list of the units sharing a tile, NO_UNIT at the ends
+    u16 dense_index; // position in unit_list.dense
 };
 struct unit_list {
-    struct unit units[MAX_UNITS]; // units per player
-    u32 count; // number of units
+    struct unit *units; // scenario.max_units, indexed by unit id, an id stays the same while the unit lives
+    u16 *dense; // ids of the live units packed together, loop over these to skip free slots
+    u16 *free_ids; // freed ids, handed out again before new ones
+    u32 count; // number of ids handed out so far, every id below this is live or free
+    u32 live; // number of live units (length of dense)
+    u32 free_count;
 };
 struct unit_stack {
-    struct unit units[MAX_UNITS]; // stack of units
+    u16 first_unit, last_unit; // ends of the list threaded through the units of player_id
+    u16 next_free; // free list link while the stack is unused
     u32 player_id;
     u32 count; // number of units in stack
     u8 used;
 };
-enum units get_unit(u32 x, u32 y, struct unit_stack unit_stacks[PLAYER_COUNT * MAX_UNITS]) {
-    u32 unit_color = units.pix[y * units.w + x];
-    assert(unit_color & 0xFF000000 && "Unit color must have alpha channel set");
-    u32 stack_id = (unit_color & 0x00FFFFFF) / 0x08; // STACK ID
-    if (stack_id >= PLAYER_COUNT * MAX_UNITS) {
+// generation in the high bits, id in the low bits
+static inline u32 unit_handle(struct unit *unit) { return (u32)unit->generation << 16 | unit->id; }
+struct unit *unit_from_handle(struct unit_list *list, u32 handle) {
+    u32 id = handle & 0xFFFF;
+    if (id >= list->count || list->units[id].type == -1 || list->units[id].generation != handle >> 16) return NULL;
+    return &list->units[id];
+}
+enum units get_unit(u32 x, u32 y, struct unit_stack *unit_stacks, struct unit_list player_units[MAX_PLAYERS]) {
+    u32 stack_id = grid_stack(tile_at(x, y));
+    assert(stack_id != NO_STACK && "No units on this tile");
+    if (stack_id >= scenario.max_stacks) {
         printf("Unit stack ID out of bounds: %X\n", stack_id);
         return -1; // invalid stack id
     }
-    enum units unit_type = unit_stacks[stack_id].units[0].type; // get unit type from stack
+    enum units unit_type = player_units[unit_stacks[stack_id].player_id].units[unit_stacks[stack_id].first_unit].type; // get unit type from stack
     if (unit_type >= UNIT_COUNT) {
         printf("Unit type out of bounds: %d\n", unit_type);
         return -1; // invalid unit type
     }
     return unit_type;
 }
-enum units get_unit_load(u32 x, u32 y) {
-    u32 unit_color = units.pix[y * units.w + x];
+enum units unit_from_color(u32 unit_color, u32 x, u32 y) {
     for (u32 i = 0; i < UNIT_COUNT; i++)
         if (unit_colors[i] == unit_color)
             return i;
@@ -220,6 +358,11 @@ u32 unit_cost[UNIT_COUNT] = {
     [MOTORIZED] = 200,
     [ARMOR] = 400,
 };
+u32 unit_strength[UNIT_COUNT] = {
+    [INFANTRY] = 10,
+    [MOTORIZED] = 12,
+    [ARMOR] = 20
+};
 u32 movement_cost[UNIT_COUNT][TILE_COUNT] = {
     /*               SEA,    CITY,  MNT,  CRO,  PLN,  FST  */
     /*INFANTRY */ -1,  100,     -1,    100,    100,    200,
@@ -256,34 +399,207 @@ pos dir_offsets[] = {
 };
 
 struct path {
-    u8 steps[GRID_H + GRID_W]; // array of steps
-    u8 length; // number of steps
+    u8 *steps; // array of steps, grown to the longest path the unit had so far
+    u32 length; // number of steps
+    u32 capacity;
     // u8 id; // unit id
 };
+
 struct step {
     u8 dir;
-    u16 cost;
-    u16 id; // unit id + player id
+    u16 cost; // cumulative cost of the path up to and including this step, at most move_budget (see load_scenario)
+    u32 id; // STEP_ID(player, unit)
+};
+#define STEP_ID(player, unit) ((u32)(player) << 16 | (u32)(unit))
+static inline u32 step_player(struct step step) { return step.id >> 16; }
+static inline u32 step_unit(struct step step) { return step.id & 0xFFFF; }
+static inline u32 step_bucket(struct step step) { return step.cost / BUCKET_COST < scenario.bucket_count ? step.cost / BUCKET_COST : scenario.bucket_count - 1; }
+
+// the steps of every player for the coming resolve in commit order, grows with the number of orders
+struct resolve_order {
+    struct step *steps;
+    u32 count;
+    u32 capacity;
+    struct step *sorted; // resolve_turn's copy grouped by bucket, same capacity
+    struct claim *claims; // what resolve_turn found out about each sorted step, same capacity
+    u32 *by_region; // sorted steps resolved in parallel, grouped by region, same capacity
+};
+struct claim {
+    u32 from, to; // tiles the step leaves and enters, NO_TILE if the step won't move
+    u32 parent; // union find over the steps of a bucket that share tiles, the root is the group's first step
+    u32 region; // on the root: the region holding every tile of the group, NO_REGION if it has to be resolved serially
+    u32 player;
+    bool done; // resolved in the parallel pass
+};
+
+void push_step(struct resolve_order *order, struct step step) {
+    if (order->count == order->capacity) {
+        order->capacity = order->capacity ? order->capacity * 2 : 1024;
+        order->steps = realloc(order->steps, sizeof(struct step) * order->capacity);
+        order->sorted = realloc(order->sorted, sizeof(struct step) * order->capacity);
+        order->claims = realloc(order->claims, sizeof(struct claim) * order->capacity);
+        order->by_region = realloc(order->by_region, sizeof(u32) * order->capacity);
+        if (!order->steps || !order->sorted || !order->claims || !order->by_region) { fprintf(stderr, "OOM: resolve order\n"); exit(1); }
+    }
+    order->steps[order->count++] = step;
+}
+struct unit player_target[MAX_PLAYERS] = {0}; // random shit temporary
+
+#pragma region SNAPSHOT
+// the simulation publishes what the renderer draws through three buffers: it fills the back one, swaps it
+// into the middle with one atomic exchange, and the renderer swaps the middle out whenever it holds a newer one
+#define NO_UNIT_TYPE 0xFF
+#define SNAPSHOT_FRESH 4u // set on middle while the renderer hasn't taken it yet
+struct unit_view {
+    u16 x, y;
+    u8 type; // NO_UNIT_TYPE for a free id
 };
-struct resolve_bucket {
-    struct step steps[BUCKET_SIZE]; // steps in this bucket
-    u32 count; // number of steps in this bucket
+struct world_snapshot {
+    struct unit_view *units[MAX_PLAYERS]; // indexed by unit id, like player_units
+    u16 *dense[MAX_PLAYERS]; // live unit ids
+    u32 live[MAX_PLAYERS];
+    u8 **tile_unit; // per chunk the unit type drawn on each tile (head of its stack), NO_UNIT_TYPE if empty; NULL until a unit stands in the chunk
+    u8 **zone; // per chunk copy of the influence zones, NULL until the chunk has one
+    u32 *zone_version; // version of each copied zone
+    struct step *steps; // committed steps, grown by the simulation side while it owns the buffer
+    u32 step_count, step_capacity;
+    u32 seq; // journal_seq this buffer is up to date with
 };
+struct snapshots {
+    struct world_snapshot buffers[3];
+    _Atomic u32 middle; // index of the handed over buffer | SNAPSHOT_FRESH
+    u32 back; // simulation side only
+    u32 front; // renderer side only
+};
+
+// every change the renderer can see is logged, so a buffer that is a few publishes behind
+// is brought up to date by replaying the entries since then instead of copying everything
+enum change_kind { CHANGE_UNIT, CHANGE_DENSE, CHANGE_TILE };
+struct change {
+    u8 kind;
+    u8 player;
+    u32 index; // unit id, dense index or tile index
+};
+struct change *journal;
+u32 journal_size; // power of two, scales with the number of units
+_Atomic u32 journal_seq; // number of changes logged so far
+static inline void journal_change(enum change_kind kind, u32 player, u32 index) {
+    journal[atomic_fetch_add(&journal_seq, 1) & (journal_size - 1)] = (struct change){kind, player, index};
+}
+
+static inline void snapshot_tile(struct world_snapshot *s, u32 tile, struct unit_list player_units[MAX_PLAYERS], struct unit_stack *unit_stacks) {
+    u8 **chunk = &s->tile_unit[tile >> CHUNK_BITS];
+    if (!*chunk) {
+        if (grid_stack(tile) == NO_STACK) return; // still empty
+        *chunk = arena_alloc(&world_arena, CHUNK_TILES); // only ever called on the simulation thread
+        memset(*chunk, NO_UNIT_TYPE, CHUNK_TILES);
+    }
+    (*chunk)[in_chunk(tile)] = grid_stack(tile) == NO_STACK ? NO_UNIT_TYPE : get_unit(tile_x(tile), tile_y(tile), unit_stacks, player_units);
+}
+
+static inline void snapshot_unit(struct world_snapshot *s, u32 player, u32 id, struct unit_list player_units[MAX_PLAYERS]) {
+    struct unit *unit = &player_units[player].units[id];
+    s->units[player][id] = (struct unit_view){unit->x, unit->y, unit->type == -1 ? NO_UNIT_TYPE : unit->type};
+}
+
+void snapshot_zones(u8 **zone, u32 *zone_version);
+
+void fill_snapshot(struct world_snapshot *s, bool full, struct unit_list player_units[MAX_PLAYERS], struct unit_stack *unit_stacks, struct resolve_order *resolve_order) {
+    if (full || journal_seq - s->seq > journal_size) { // too far behind, the entries it needs are overwritten
+        for (u32 chunk = 0; chunk < grid.chunk_count; chunk++)
+            if (s->tile_unit[chunk]) memset(s->tile_unit[chunk], NO_UNIT_TYPE, CHUNK_TILES);
+        for (u32 player = 0; player < scenario.players; player++) {
+            for (u32 id = 0; id < scenario.max_units; id++) snapshot_unit(s, player, id, player_units);
+            memcpy(s->dense[player], player_units[player].dense, sizeof(u16) * scenario.max_units);
+            for (u32 live = 0; live < player_units[player].live; live++) { // only the tiles with a stack, through its drawn unit
+                struct unit *unit = &player_units[player].units[player_units[player].dense[live]];
+                if (unit->prev_in_stack == NO_UNIT) snapshot_tile(s, tile_at(unit->x, unit->y), player_units, unit_stacks);
+            }
+        }
+    } else {
+        for (u32 seq = s->seq; seq != journal_seq; seq++) {
+            struct change change = journal[seq & (journal_size - 1)];
+            if (change.kind == CHANGE_UNIT) snapshot_unit(s, change.player, change.index, player_units);
+            else if (change.kind == CHANGE_DENSE) s->dense[change.player][change.index] = player_units[change.player].dense[change.index];
+            else snapshot_tile(s, change.index, player_units, unit_stacks);
+        }
+    }
+    for (u32 player = 0; player < scenario.players; player++) s->live[player] = player_units[player].live;
+    if (s->step_capacity < resolve_order->count) { // orders are rebuilt every turn, copy only the used part
+        s->step_capacity = resolve_order->capacity;
+        s->steps = realloc(s->steps, sizeof(struct step) * s->step_capacity);
+        if (!s->steps) { fprintf(stderr, "OOM: snapshot steps\n"); exit(1); }
+    }
+    if (resolve_order->count > 0) memcpy(s->steps, resolve_order->steps, sizeof(struct step) * resolve_order->count);
+    s->step_count = resolve_order->count;
+    snapshot_zones(s->zone, s->zone_version); // zones are versioned per chunk, not journaled
+    s->seq = journal_seq;
+}
+
+void init_journal(void) {
+    for (journal_size = 4096; journal_size < 4 * scenario.max_stacks; journal_size *= 2);
+    journal = arena_alloc(&world_arena, sizeof(struct change) * journal_size);
+}
+
+void init_snapshots(struct snapshots *snapshots, struct unit_list player_units[MAX_PLAYERS], struct unit_stack *unit_stacks, struct resolve_order *resolve_order) {
+    for (u32 i = 0; i < 3; i++) {
+        struct world_snapshot *s = &snapshots->buffers[i];
+        for (u32 player = 0; player < scenario.players; player++) {
+            s->units[player] = arena_alloc(&world_arena, sizeof(struct unit_view) * scenario.max_units);
+            s->dense[player] = arena_alloc(&world_arena, sizeof(u16) * scenario.max_units);
+        }
+        s->tile_unit = arena_alloc(&world_arena, sizeof(u8 *) * grid.chunk_count);
+        s->zone = arena_alloc(&world_arena, sizeof(u8 *) * grid.chunk_count);
+        s->zone_version = arena_alloc(&world_arena, sizeof(u32) * grid.chunk_count);
+        fill_snapshot(s, true, player_units, unit_stacks, resolve_order);
+    }
+    snapshots->front = 0;
+    atomic_store(&snapshots->middle, 1);
+    snapshots->back = 2;
+}
+
+// simulation thread: never blocks, the renderer only ever holds front
+void publish_snapshot(struct snapshots *snapshots, struct unit_list player_units[MAX_PLAYERS], struct unit_stack *unit_stacks, struct resolve_order *resolve_order) {
+    fill_snapshot(&snapshots->buffers[snapshots->back], false, player_units, unit_stacks, resolve_order);
+    snapshots->back = atomic_exchange(&snapshots->middle, snapshots->back | SNAPSHOT_FRESH) & ~SNAPSHOT_FRESH;
+}
+
+// render thread: latest complete snapshot, stays valid until the next call
+struct world_snapshot *acquire_snapshot(struct snapshots *snapshots) {
+    if (atomic_load(&snapshots->middle) & SNAPSHOT_FRESH)
+        snapshots->front = atomic_exchange(&snapshots->middle, snapshots->front) & ~SNAPSHOT_FRESH;
+    return &snapshots->buffers[snapshots->front];
+}
+#pragma endregion
+
 struct thread_args {
-    struct unit_list player_units[PLAYER_COUNT];
-    struct resolve_bucket resolve_order[BUCKET_COUNT];
-    struct path player_paths[PLAYER_COUNT][MAX_UNITS];
-    struct unit_list *player_units_ptr; // pointer to player units for thread safety
-    struct resolve_bucket *resolve_order_ptr; // pointer to resolve order for thread safety
-    struct path (*player_paths_ptr)[PLAYER_COUNT][MAX_UNITS]; // pointer to player paths for thread safety
+    struct unit_list *player_units; // simulation state, only touched by the script thread once it runs
+    struct resolve_order *resolve_order;
+    struct path **player_paths; // per player, indexed by unit id
     struct unit_stack *unit_stacks; // stacks of units
+    struct snapshots *snapshots; // everything the renderer reads
 };
 
-struct unit player_target[PLAYER_COUNT] = {{0, 0, 0, 0}, {0, 0, 0, 0}}; // random shit temporary
+#pragma region SIM CLOCK
+// the script runs in fixed ticks of TICK_US simulated time; the wall time that passed, times the speed, is owed to the
+// simulation and paid off in whole ticks, so a slow tick is caught up with and the turn cadence doesn't drift
+#define TICK_US 16000
+#define MAX_CATCH_UP_TICKS 8 // owed beyond this after a stall is dropped instead of raced through
+#define SPEED_UNBOUNDED 0
+struct sim_clock {
+    _Atomic u32 speed; // ticks per TICK_US of wall time, SPEED_UNBOUNDED to run them back to back; set from the input
+    _Atomic u32 eager; // start a turn's next phase as soon as the one before is done instead of on its tick
+    u64 owed_us; // simulated time the script is behind, script thread only
+    u64 last_us; // when the script last looked at the clock
+    _Atomic u32 stop; // set when the window closes, the script thread returns after the tick it is in
+};
+struct sim_clock sim_clock = {.speed = 1};
+#pragma endregion
 
 #pragma region INPUT
 #define KEY_COUNT 256
 u32 pressed_keys[KEY_COUNT];
+#if !HEADLESS
 static void key_input_callback(void *ud, u32 key, u32 state) {
     if (state) {
         pressed_keys[key] = 1;
@@ -298,6 +614,7 @@ static void mouse_input_callback(void *ud, i32 x, i32 y, u32 b) {
     printf("button %u\n", b);
     printf("pointer at %d,%d\n", x, y);
 }
+#endif
 
 u32 process_input(struct camera *camera) {
     if (pressed_keys[1]) { // esc
@@ -319,387 +636,1525 @@ u32 process_input(struct camera *camera) {
         move_camera(camera, 5, 0);
         pressed_keys[38] = 0;
     }
+    if (pressed_keys[44]) { // z
+        camera->show_influence = !camera->show_influence;
+        camera->update = 1;
+        pressed_keys[44] = 0;
+    }
+    if (pressed_keys[2]) { // 1
+        atomic_store(&sim_clock.speed, 1);
+        pressed_keys[2] = 0;
+    }
+    if (pressed_keys[3]) { // 2
+        atomic_store(&sim_clock.speed, 4);
+        pressed_keys[3] = 0;
+    }
+    if (pressed_keys[4]) { // 3
+        atomic_store(&sim_clock.speed, SPEED_UNBOUNDED);
+        pressed_keys[4] = 0;
+    }
+    if (pressed_keys[18]) { // e
+        atomic_store(&sim_clock.eager, !atomic_load(&sim_clock.eager));
+        pressed_keys[18] = 0;
+    }
     return 0;
 }
 #pragma endregion
 
-i32 battle(u32 attacker, u32 defender, u32 unit_att, u32 unit_def, struct unit_list player_units[PLAYER_COUNT], struct unit_stack unit_stacks[PLAYER_COUNT * MAX_UNITS]);
+i32 engage(u32 player, u32 unit, u32 tile, struct unit_list player_units[MAX_PLAYERS]);
 
-u8 paths[GRID_W * GRID_H][GRID_H + GRID_W * 2];
-i32 pathing(u32 from_x, u32 from_y, u32 to_x, u32 to_y, u8 *path, u32 *pathlength, u32 unit_type, u32 player, struct unit_stack unit_stacks[PLAYER_COUNT * MAX_UNITS]) { // no cost yet, BITshift versie??
-    if (!path || !pathlength) return -1; // Invalid arguments
-    if (from_x < 0 || from_x >= GRID_W || from_y < 0 || from_y >= GRID_H ||
-        to_x < 0 || to_x >= GRID_W || to_y < 0 || to_y >= GRID_H) {
-        return -1; // Invalid coordinates
-    }
-    u32 paths_count = 1;
-    memset(paths, 0, sizeof(u8) * (GRID_W * GRID_H) * (GRID_H + GRID_W * 2));
-    paths[0][0] = 0; // path length
-    paths[0][1] = 0; // start direction is never used
-    u32 costs[GRID_W * GRID_H] = {0}; // costs of paths
-    costs[0] = 0; // start cost is 0
-    pos visited[GRID_W * GRID_H] = {0}; // visited tiles
-    visited[0] = (pos){from_x, from_y}; // mark starting tile as visiteds
-    for (u32 i = 0; i < paths_count; i++) {
-        //printf("Checking path %d: (%d, %d)\n", i + 1, visited[i].x, visited[i].y);
-        u32 pass = 0;
-        if (paths_count >= GRID_W * GRID_H) {
-            printf("Too many paths, aborting\n");
-            return 0; // ran out of memory
-        }
-        for (u32 dir = UP; dir <= DOWN_RIGHT; dir++){
-            pass = 0; // reset pass for each direction
-            // Generic
-            u32 x = from_x;
-            u32 y = from_y;
-            u32 total_cost = 0;
-            for (i32 step = paths[i][0] - 1; step >= 0; step--) {
-                x += dir_offsets[paths[i][step + 1]].x;
-                y += dir_offsets[paths[i][step + 1]].y;
-                if (movement_cost[unit_type][get_tile(x, y)] >= 10000000) {printf("step: %d", step); break;} // check for impassable tile
-                total_cost += movement_cost[unit_type][get_tile(x, y)];
-            }
-            x += dir_offsets[dir].x;
-            y += dir_offsets[dir].y;
-            //printf("Step %d: (%d, %d) ", dir, x, y);
-            if (x < 0 || x >= GRID_W || y < 0 || y >= GRID_H) continue; // out of bounds
-            u32 terrain = get_tile(x, y);
-            u32 cost = movement_cost[unit_type][terrain];
-            if (cost == -1) {continue;} // check for impassable tile
-            total_cost += cost;
-            // if (units.pix[y * units.w + x] == player_colors[player]) {continue;} // check for player unit
-            if (to_x == x && to_y == y) { // found target
-                paths[paths_count][0] = paths[i][0] + 1; // technicly ruins path order
-                paths[paths_count][1] = dir;
-                costs[paths_count] = total_cost; // set cost of path
-                for (u32 j = 2; j < paths[i][0] + 2; j++) { // copy path from previous tile
-                    paths[paths_count][j] = paths[i][j-1];
-                }
-                *pathlength = paths[paths_count][0]; // set path length
-                memcpy(path, paths[paths_count] + 1, sizeof(u8) * (*pathlength)); // copy path to output
-                // printf("Found path to (%d, %d) with cost %d\n", x, y, total_cost);
-                return 1; // found path
-            }
-            if (units.pix[y * units.w + x] != 0) {
-                u32 stack_id = (units.pix[y * units.w + x] & 0x00FFFFFF) / 8; // STACK ID
-                if (unit_stacks[stack_id].player_id != player) continue; // path around enemy units
-            } // if enemy on path path around
-            for (u32 j = 0; j < paths_count; j++) {
-                if (visited[j].x == x && visited[j].y == y) {
-                    pass = 1;
-                    //printf("Tile (%d, %d) already visited\n", x, y);
-                    break;
-                }
-            }
-            if (pass == 0) {
-                bool found = false;
-                for (u32 tile = i; tile < paths_count; tile++) {
-                    //printf("Checking tile %d: (%d, %d)\n", tile, x, y);
-                    if (paths[tile][0] == 0) continue; // skip empty paths
-                    if (costs[tile] > total_cost) { // higher cost than existing path
-                        found = true;
-                        for (u32 k = paths_count - 1; k >= tile; k--) { // shift paths up AND COSTS
-                            memcpy(paths[k + 1], paths[k], sizeof(u8) * 150);
-                            costs[k + 1] = costs[k];
-                        }
-                        paths[tile][0] = paths[i][0] + 1; // set path length
-                        if (paths[tile][0] == 255) {printf("too long path.");return 0;}
-                        paths[tile][1] = dir; // add tile to path
-                        costs[tile] = total_cost; // set cost of path
-                        for (u32 j = 2; j < paths[i][0] + 2; j++) {
-                            paths[tile][j] = paths[i][j-1];
-                        }
-                        visited[paths_count] = (pos){x, y}; // mark tile as visited
-                        paths_count++;
-                        break;
-                    }
-                }
-                if (!found) {
-                    paths[paths_count][0] = paths[i][0] + 1; // set path length
-                    if (paths[paths_count][0] == 255) {printf("too long path.");return 0;}
-                    paths[paths_count][1] = dir; // add tile to path
-                    costs[paths_count] = total_cost; // set cost of path
-                    for (u32 j = 2; j < paths[i][0] + 2; j++) {
-                        paths[paths_count][j] = paths[i][j-1];
-                    }
-                    visited[paths_count] = (pos){x, y}; // mark tile as visited
-                    paths_count++;
-                    //printf("Path %d: ", paths_count);
-                }
-            }
+#pragma region PATHING
+#define COST_IMPASSABLE 0xFFFF
+u16 terrain_cost[UNIT_COUNT][TILE_COUNT]; // cost to enter a tile of each terrain per unit type (COST_IMPASSABLE if it can't)
+u16 cost_min[UNIT_COUNT]; // cheapest passable terrain on the map per unit type, scales the heuristic
+u32 terrain_present; // bit per enum tiles found on the map
+
+// terrain doesn't change during the game, so the per-unit-type costs are baked once after the map is loaded
+void build_cost_tables(void) {
+    for (u32 type = 0; type < UNIT_COUNT; type++) {
+        cost_min[type] = COST_IMPASSABLE;
+        for (u32 terrain = 0; terrain < TILE_COUNT; terrain++) {
+            u32 cost = movement_cost[type][terrain];
+            terrain_cost[type][terrain] = cost >= COST_IMPASSABLE ? COST_IMPASSABLE : (u16)cost;
+            if ((terrain_present >> terrain & 1) && cost < cost_min[type]) cost_min[type] = (u16)cost;
         }
     }
-    return 0; // no path found
 }
 
-static inline u32 mix_colors(u32 a, u32 b) {
-    return (((a ^ b) & 0xFEFEFEFEU) >> 1U) + (a & b);
+// octile distance; a diagonal step costs the same as a straight one in this game, so it reduces to min_cost * max(dx, dy)
+static inline u32 octile(u32 from_x, u32 from_y, u32 to_x, u32 to_y, u32 min_cost) {
+    u32 dx = from_x > to_x ? from_x - to_x : to_x - from_x;
+    u32 dy = from_y > to_y ? from_y - to_y : to_y - from_y;
+    u32 straight = min_cost, diagonal = min_cost;
+    return dx > dy ? straight * (dx - dy) + diagonal * dy : straight * (dy - dx) + diagonal * dx;
 }
 
-void blit(struct camera camera, struct tga atlas, u32 buffer_x, u32 buffer_y, u32 atlas_x, u32 atlas_y, u32 width, u32 height) {
-    if (buffer_x + width > camera.buffer_w) { width = camera.buffer_w - buffer_x; }
-    if (buffer_y + height > camera.buffer_h) { height = camera.buffer_h - buffer_y; }
+#define HEAP_CLOSED 0xFFFFFFFFu
+#define HEAP_OUTSIDE 0xFFFFFFFEu
+struct search_chunk {
+    u32 g[CHUNK_TILES]; // best known cost from the start tile
+    u32 stamp[CHUNK_TILES]; // generation in which the tile was last touched, so nothing needs clearing between queries
+    u32 heap_index[CHUNK_TILES]; // position of the tile in the heap, HEAP_OUTSIDE before it is opened, HEAP_CLOSED once expanded
+    u8 parent[CHUNK_TILES]; // direction taken to enter the tile
+};
+struct heap_entry {
+    u32 f; // g + heuristic, the heap key, kept next to the tile so sifting never leaves the heap
+    u32 tile;
+};
+struct search {
+    struct search_chunk **chunks; // by chunk index, allocated the first time a search on this thread enters the chunk
+    struct arena arena;
+    struct heap_entry *heap; // open tiles, binary min-heap on f
+    u32 heap_count, heap_capacity;
+    u32 generation;
+    u8 *path; // steps found by the last pathing call, target first
+    u32 path_capacity;
+    u32 *tiles; // repair_path's scratch
+    u32 tiles_capacity;
+};
+#define search_g(s, tile) ((s)->chunks[(tile) >> CHUNK_BITS]->g[in_chunk(tile)])
+#define search_heap_index(s, tile) ((s)->chunks[(tile) >> CHUNK_BITS]->heap_index[in_chunk(tile)])
+#define search_parent(s, tile) ((s)->chunks[(tile) >> CHUNK_BITS]->parent[in_chunk(tile)])
 
-    u32 *restrict buffer_row_pointer = camera.buffer + buffer_y * camera.buffer_w + buffer_x;
-    const u32 *restrict atlas_row_pointer = atlas.pix + atlas_y * atlas.w + atlas_x;
+// true the first time this query sees the tile, which is then ready to be written
+static inline bool search_touch(struct search *s, u32 tile) {
+    struct search_chunk **chunk = &s->chunks[tile >> CHUNK_BITS];
+    if (!*chunk) *chunk = arena_alloc(&s->arena, sizeof(struct search_chunk));
+    if ((*chunk)->stamp[in_chunk(tile)] == s->generation) return false;
+    (*chunk)->stamp[in_chunk(tile)] = s->generation;
+    (*chunk)->heap_index[in_chunk(tile)] = HEAP_OUTSIDE;
+    return true;
+}
+
+// whether the tile was reached by the last query, without allocating anything for it
+static inline bool search_seen(struct search *s, u32 tile) {
+    struct search_chunk *chunk = s->chunks[tile >> CHUNK_BITS];
+    return chunk && chunk->stamp[in_chunk(tile)] == s->generation;
+}
 
-    const u32 buffer_stride_pixels = camera.buffer_w;
-    const u32 atlas_stride_pixels = atlas.w;
-    const usize row_byte_count = (usize) width * sizeof(u32);
+static inline void heap_swap(struct search *s, u32 a, u32 b) {
+    struct heap_entry entry_a = s->heap[a], entry_b = s->heap[b];
+    s->heap[a] = entry_b; search_heap_index(s, entry_b.tile) = a;
+    s->heap[b] = entry_a; search_heap_index(s, entry_a.tile) = b;
+}
 
-    for (u32 y = 0; y < height; ++y) {
-        memcpy(buffer_row_pointer, atlas_row_pointer, row_byte_count);
-        buffer_row_pointer += buffer_stride_pixels;
-        atlas_row_pointer += atlas_stride_pixels;
+static inline void heap_up(struct search *s, u32 i) {
+    while (i > 0) {
+        u32 up = (i - 1) / 2;
+        if (s->heap[up].f <= s->heap[i].f) break;
+        heap_swap(s, up, i);
+        i = up;
     }
 }
 
-void blit_masked(struct camera camera, struct tga atlas, u32 buffer_x, u32 buffer_y, u32 atlas_x, u32 atlas_y, u32 width, u32 height) {
-    if (buffer_x + width > camera.buffer_w) { width = camera.buffer_w - buffer_x; }
-    if (buffer_y + height > camera.buffer_h) { height = camera.buffer_h - buffer_y; }
+static inline void heap_down(struct search *s, u32 i) {
+    for (;;) {
+        u32 left = i * 2 + 1, right = left + 1, best = i;
+        if (left < s->heap_count && s->heap[left].f < s->heap[best].f) best = left;
+        if (right < s->heap_count && s->heap[right].f < s->heap[best].f) best = right;
+        if (best == i) break;
+        heap_swap(s, best, i);
+        i = best;
+    }
+}
 
-    u32 *restrict buffer_location = camera.buffer + buffer_y * camera.buffer_w + buffer_x;
-    const u32 *restrict atlas_location = atlas.pix + atlas_y * atlas.w + atlas_x;
+static inline void heap_push_or_decrease(struct search *s, u32 tile, u32 f) {
+    if (search_heap_index(s, tile) == HEAP_OUTSIDE) { // not open yet, push
+        s->heap = grow_array(s->heap, &s->heap_capacity, s->heap_count + 1, sizeof(struct heap_entry), "search heap");
+        search_heap_index(s, tile) = s->heap_count++;
+    }
+    s->heap[search_heap_index(s, tile)] = (struct heap_entry){f, tile};
+    heap_up(s, search_heap_index(s, tile));
+}
 
-    for (int y = 0; y < (int)height; ++y) {
-        for (int x = 0; x < (int)width; ++x) {
-            u32 source_pixel = atlas_location[x];
-            u32 alpha_bits = source_pixel & 0xFF000000u;
-            u32 all_or_nothing_mask = 0u - (alpha_bits != 0u); // -1 ie. all ones if alpha is not 0, otherwise 0
-            buffer_location[x] = (buffer_location[x] & ~all_or_nothing_mask) | (source_pixel & all_or_nothing_mask);
-        }
-        atlas_location += atlas.w;
-        buffer_location += camera.buffer_w;
+static inline u32 heap_pop(struct search *s) {
+    u32 tile = s->heap[0].tile;
+    s->heap_count--;
+    if (s->heap_count > 0) {
+        s->heap[0] = s->heap[s->heap_count];
+        search_heap_index(s, s->heap[0].tile) = 0;
+        heap_down(s, 0);
     }
+    search_heap_index(s, tile) = HEAP_CLOSED;
+    return tile;
 }
 
-static inline void draw_unit(struct camera camera, struct tga units_atlas, u32 tile_y, u32 tile_x, struct unit_stack *unit_stacks) {
-    const u32 buffer_y = (tile_y - camera.tile_y) * TILE_SIZE;
-    const u32 buffer_x = (tile_x - camera.tile_x) * TILE_SIZE;
-    const enum units unit = get_unit(tile_x, tile_y, unit_stacks);
-    const u32 atlas_x = (unit % ATLAS_SIZE) * TILE_SIZE;
-    const u32 atlas_y = (unit / ATLAS_SIZE) * TILE_SIZE;
-    
-    blit_masked(camera, units_atlas, buffer_x, buffer_y, atlas_x, atlas_y, TILE_SIZE, TILE_SIZE);
+static inline void search_begin(struct search *s) {
+    if (!s->chunks) {
+        s->chunks = calloc(grid.chunk_count, sizeof(struct search_chunk *));
+        if (!s->chunks) { fprintf(stderr, "OOM: search\n"); exit(1); }
+    }
+    if (++s->generation == 0) { // stamps wrapped around, clear them once
+        for (u32 chunk = 0; chunk < grid.chunk_count; chunk++)
+            if (s->chunks[chunk]) memset(s->chunks[chunk]->stamp, 0, sizeof(s->chunks[chunk]->stamp));
+        s->generation = 1;
+    }
+    s->heap_count = 0;
 }
 
-void draw_step(struct camera camera, struct tga directions_atlas, enum directions direction, u32 tile_y, u32 tile_x) {
-    const u32 buffer_y = (tile_y - camera.tile_y) * TILE_SIZE;
-    const u32 buffer_x = (tile_x - camera.tile_x) * TILE_SIZE;
-    const u32 atlas_x = (direction % ATLAS_SIZE) * TILE_SIZE;
-    const u32 atlas_y = (direction / ATLAS_SIZE) * TILE_SIZE;
-    
-    blit_masked(camera, directions_atlas, buffer_x, buffer_y, atlas_x, atlas_y, TILE_SIZE, TILE_SIZE);
+// A* over the 8-connected grid; writes the path target-first into s->path (same order as before), returns 1 if found, 0 if not
+// s is the scratch of the calling thread, nothing else is written so searches on different threads don't interfere
+i32 pathing(struct search *s, u32 from_x, u32 from_y, u32 to_x, u32 to_y, u32 *pathlength, u32 unit_type, u32 player, struct unit_stack *unit_stacks) {
+    if (!pathlength) return -1; // Invalid arguments
+    if (!on_map(from_x, from_y) || !on_map(to_x, to_y)) {
+        return -1; // Invalid coordinates
+    }
+    const u16 *costs = terrain_cost[unit_type];
+    const u32 min_cost = cost_min[unit_type];
+    const u32 start = tile_at(from_x, from_y);
+    const u32 target = tile_at(to_x, to_y);
+    if (costs[grid_terrain(target)] == COST_IMPASSABLE) return 0; // target can never be entered
+
+    search_begin(s);
+    search_touch(s, start);
+    search_g(s, start) = 0;
+    heap_push_or_decrease(s, start, octile(from_x, from_y, to_x, to_y, min_cost));
+
+    while (s->heap_count > 0) {
+        u32 tile = heap_pop(s);
+        if (tile == target) { // walk the parent directions back to the start
+            u32 length = 0, x = to_x, y = to_y;
+            while (tile != start) {
+                u8 dir = search_parent(s, tile);
+                s->path = grow_array(s->path, &s->path_capacity, length + 1, 1, "path");
+                s->path[length++] = dir;
+                x -= dir_offsets[dir].x;
+                y -= dir_offsets[dir].y;
+                tile = tile_at(x, y);
+            }
+            *pathlength = length;
+            return 1; // found path
+        }
+        u32 x = tile_x(tile), y = tile_y(tile), g_tile = search_g(s, tile);
+        for (u32 dir = UP; dir <= DOWN_RIGHT; dir++) {
+            u32 next_x = x + dir_offsets[dir].x;
+            u32 next_y = y + dir_offsets[dir].y;
+            if (!on_map(next_x, next_y)) continue; // out of bounds (wraps around for -1)
+            u32 next = tile_at(next_x, next_y);
+            const struct chunk *chunk = grid_chunk(next);
+            u32 cost = costs[chunk->terrain[in_chunk(next)]];
+            if (cost == COST_IMPASSABLE) continue; // check for impassable tile
+            u32 stack_id = chunk->stack[in_chunk(next)];
+            if (next != target && stack_id != NO_STACK && unit_stacks[stack_id].player_id != player) continue; // path around enemy units
+            u32 g = g_tile + cost;
+            if (!search_touch(s, next) && (search_heap_index(s, next) == HEAP_CLOSED || g >= search_g(s, next))) {
+                continue; // already have a cheaper way in
+            }
+            search_g(s, next) = g;
+            search_parent(s, next) = (u8)dir;
+            heap_push_or_decrease(s, next, g + octile(next_x, next_y, to_x, to_y, min_cost));
+        }
+    }
+    return 0; // no path found
 }
 
-static inline void draw_tile(struct camera camera, struct tga map_atlas, u32 tile_y, u32 tile_x) {
-    const u32 start_y = (tile_y - camera.tile_y) * TILE_SIZE;
-    const u32 start_x = (tile_x - camera.tile_x) * TILE_SIZE;
-    const enum tiles tile = get_tile(tile_x, tile_y);
-    const u32 atlas_start_x = (tile % ATLAS_SIZE) * TILE_SIZE;
-    const u32 atlas_start_y = (tile / ATLAS_SIZE) * TILE_SIZE;
-    
-    blit(camera, map_atlas, start_x, start_y, atlas_start_x, atlas_start_y, TILE_SIZE, TILE_SIZE);
+// flow field mode for the AI: one multi-source Dijkstra per player instead of one A* per unit
+#ifndef AI_FLOW_FIELD
+#define AI_FLOW_FIELD 0
+#endif
+u8 dir_opposite[DIRECTIONS_COUNT] = {
+    [UP] = DOWN, [DOWN] = UP, [LEFT] = RIGHT, [RIGHT] = LEFT,
+    [UP_LEFT] = DOWN_RIGHT, [UP_RIGHT] = DOWN_LEFT, [DOWN_LEFT] = UP_RIGHT, [DOWN_RIGHT] = UP_LEFT
+};
+
+// searches backwards from every target at once: afterwards g is the cost to reach the nearest target
+// and parent is the direction to step in from that tile (only valid where search_seen)
+void seed_flow_field(struct search *s, u32 *targets, u32 target_count) {
+    search_begin(s);
+    for (u32 i = 0; i < target_count; i++) {
+        u32 tile = targets[i];
+        if (!search_touch(s, tile)) continue; // listed twice
+        search_g(s, tile) = 0;
+        heap_push_or_decrease(s, tile, 0);
+    }
 }
 
-void draw_units(struct camera camera, struct tga units_atlas, struct unit_list player_units[PLAYER_COUNT], struct unit_stack *unit_stacks) {
-    for (u32 player = 0; player < PLAYER_COUNT; player++) {
-        if (player_units[player].count == 0) continue; // skip empty players
-        for (u32 unit = 0; unit < player_units[player].count; ++unit) {
-            if (player_units[player].units[unit].type == -1) continue; // skip empty unit slots
-            u32 tile_x = player_units[player].units[unit].x;
-            u32 tile_y = player_units[player].units[unit].y;
-            if (tile_x < camera.tile_x || tile_y < camera.tile_y) continue;
-            if (tile_x > camera.end_x || tile_y > camera.end_y) continue;
-            draw_unit(camera, units_atlas, tile_y, tile_x, unit_stacks);
+// the whole search lives in s, so it can stop at any tile and carry on later; true once the field is complete
+bool expand_flow_field(struct search *s, u32 unit_type, u64 deadline_us) {
+    const u16 *costs = terrain_cost[unit_type];
+    for (u32 popped = 1; s->heap_count > 0; popped++) {
+        if (deadline_us && popped % 256 == 0 && time_us() >= deadline_us) return false;
+        u32 tile = heap_pop(s);
+        u32 x = tile_x(tile), y = tile_y(tile);
+        u32 cost = costs[grid_terrain(tile)]; // cost for a neighbour to step onto this tile
+        if (cost == COST_IMPASSABLE) continue;
+        for (u32 dir = UP; dir <= DOWN_RIGHT; dir++) {
+            u32 next_x = x + dir_offsets[dir].x;
+            u32 next_y = y + dir_offsets[dir].y;
+            if (!on_map(next_x, next_y)) continue; // out of bounds (wraps around for -1)
+            u32 next = tile_at(next_x, next_y);
+            if (costs[grid_terrain(next)] == COST_IMPASSABLE) continue; // nobody stands there
+            u32 g = search_g(s, tile) + cost;
+            if (!search_touch(s, next) && (search_heap_index(s, next) == HEAP_CLOSED || g >= search_g(s, next))) {
+                continue;
+            }
+            search_g(s, next) = g;
+            search_parent(s, next) = dir_opposite[dir]; // step back towards the tile we came from
+            heap_push_or_decrease(s, next, g);
         }
     }
+    return true;
 }
 
-void draw_terrain(struct camera camera, struct tga map_atlas) {
-    // loop over all the visible tiles
-    for (u32 y = camera.tile_y; y <= camera.end_y; ++y) {
-        for (u32 x = camera.tile_x; x <= camera.end_x; ++x) {
-            draw_tile(camera, map_atlas, y, x);
-        }
+void build_flow_field(struct search *s, u32 unit_type, u32 *targets, u32 target_count) {
+    seed_flow_field(s, targets, target_count);
+    expand_flow_field(s, unit_type, 0);
+}
+
+// reads a path off the flow field in walking order, enemy stacks are seeds so every path stops at one
+void flow_path(struct search *s, u32 x, u32 y, struct path *path) {
+    u32 tile = tile_at(x, y);
+    path->length = 0;
+    if (!search_seen(s, tile)) return; // no target reachable
+    while (search_g(s, tile) != 0) {
+        u8 dir = search_parent(s, tile);
+        path->steps = grow_array(path->steps, &path->capacity, path->length + 1, 1, "path");
+        path->steps[path->length++] = dir;
+        x += dir_offsets[dir].x;
+        y += dir_offsets[dir].y;
+        tile = tile_at(x, y);
     }
 }
+#pragma endregion
 
-#define MAX_ARROW_LENGTH 16
-struct unit_path {u8 length; u8 path[MAX_ARROW_LENGTH];};
-struct unit_path unit_paths[PLAYER_COUNT][MAX_UNITS];
+#pragma region PATH CACHE
+// paths are kept across turns and only the stretches that got blocked since they were planned are searched again
+_Atomic u32 change_counter; // only compared against, so the order regions bump it in doesn't matter
+static inline void mark_tile_changed(u32 x, u32 y) { grid_chunk(tile_at(x, y))->changed = atomic_fetch_add(&change_counter, 1) + 1; }
+
+struct path_cache {
+    u32 start_x, start_y; // where the unit stood at the start of steps
+    u32 target_x, target_y; // a different target always means a full search
+    u32 checked_at; // change_counter when the steps were last known to be clear
+    u32 length, capacity;
+    u8 *steps; // walking order
+    u32 handle; // unit the path was planned for, a new unit in the same slot doesn't match
+    u8 valid;
+};
+struct path_cache *path_cache[MAX_PLAYERS]; // per player, indexed by unit id
 
-void draw_steps(struct camera camera, struct tga directions_atlas, struct unit_list player_units[PLAYER_COUNT], struct resolve_bucket resolve_order[BUCKET_COUNT]) {
-    memset(unit_paths, 0, sizeof(unit_paths));
+void init_path_cache(void) {
+    for (u32 player = 0; player < scenario.players; player++)
+        path_cache[player] = arena_alloc(&world_arena, sizeof(struct path_cache) * scenario.max_units);
+}
 
-    for (u32 bucket = 0; bucket < BUCKET_COUNT; bucket++) {
-        if (resolve_order[bucket].count == 0) continue;
-        for (u32 step = 0; step < resolve_order[bucket].count; step++) {
-            enum players player = resolve_order[bucket].steps[step].id >> 8;
-            u32 unit = resolve_order[bucket].steps[step].id & 255u;
-            if (unit >= MAX_UNITS) continue;
-            if (player_units[player].units[unit].type == -1) continue;
-            if (unit_paths[player][unit].length >= MAX_ARROW_LENGTH) continue;
-            unit_paths[player][unit].path[unit_paths[player][unit].length++] = resolve_order[bucket].steps[step].dir & 7u;
-        }
+static inline bool tile_blocked(u32 tile, u32 player, struct unit_stack *unit_stacks) {
+    return grid_stack(tile) != NO_STACK && unit_stacks[grid_stack(tile)].player_id != player; // enemy stack
+}
+
+// drops the steps the unit already walked, then reroutes around every tile that is now blocked in a chunk that
+// changed since the last check by searching from the tile before it to the first clear tile after it; returns 0 if
+// a full search is needed
+i32 repair_path(struct search *s, struct path_cache *cache, u32 from_x, u32 from_y, u32 player, struct unit_stack *unit_stacks) {
+    u32 x = cache->start_x, y = cache->start_y, walked = 0;
+    while ((x != from_x || y != from_y) && walked < cache->length) {
+        x += dir_offsets[cache->steps[walked]].x;
+        y += dir_offsets[cache->steps[walked]].y;
+        walked++;
     }
+    if (x != from_x || y != from_y || walked == cache->length) return 0; // left the path or already at the target
+    cache->length -= walked;
+    memmove(cache->steps, cache->steps + walked, cache->length);
+    cache->start_x = from_x;
+    cache->start_y = from_y;
 
-    for (u32 player = 0; player < PLAYER_COUNT; player++) {
-        for (u32 unit = 0; unit < player_units[player].count; unit++) {
-            if (player_units[player].units[unit].type == -1) continue;
+    u32 scan_from = 1;
+    rescan:
+    s->tiles = grow_array(s->tiles, &s->tiles_capacity, cache->length + 1, sizeof(u32), "repair"); // tiles[m] is where the unit stands after m steps
+    x = from_x, y = from_y;
+    s->tiles[0] = tile_at(x, y);
+    for (u32 m = 0; m < cache->length; m++) {
+        x += dir_offsets[cache->steps[m]].x;
+        y += dir_offsets[cache->steps[m]].y;
+        s->tiles[m + 1] = tile_at(x, y);
+    }
+    u32 *tiles = s->tiles;
+    for (u32 m = scan_from; m < cache->length; m++) { // the last tile is the target itself, moving onto it is the attack
+        if (grid_chunk(tiles[m])->changed <= cache->checked_at || !tile_blocked(tiles[m], player, unit_stacks)) continue;
+        u32 rejoin = m + 1;
+        while (rejoin < cache->length && tile_blocked(tiles[rejoin], player, unit_stacks)) rejoin++;
+        u32 detour_length = 0;
+        if (pathing(s, tile_x(tiles[m - 1]), tile_y(tiles[m - 1]), tile_x(tiles[rejoin]), tile_y(tiles[rejoin]), &detour_length, 1, player, unit_stacks) != 1) return 0; // UNIT_TYPE
+        u32 tail = cache->length - rejoin;
+        cache->steps = grow_array(cache->steps, &cache->capacity, m - 1 + detour_length + tail, 1, "path cache");
+        memmove(cache->steps + m - 1 + detour_length, cache->steps + rejoin, tail);
+        for (u32 k = 0; k < detour_length; k++) cache->steps[m - 1 + k] = s->path[detour_length - 1 - k]; // detour comes target-first
+        cache->length = m - 1 + detour_length + tail;
+        scan_from = m + detour_length; // the detour itself is fresh
+        goto rescan;
+    }
+    cache->checked_at = change_counter;
+    return 1;
+}
 
-            u32 tile_x = player_units[player].units[unit].x;
-            u32 tile_y = player_units[player].units[unit].y;
-            u8 length = unit_paths[player][unit].length;
+// path for a unit towards a target, reusing last turn's path when the target is the same
+i32 plan_path(struct search *s, u32 player, u32 handle, u32 from_x, u32 from_y, u32 to_x, u32 to_y, struct path *out, struct unit_stack *unit_stacks) {
+    struct path_cache *cache = &path_cache[player][handle & 0xFFFF];
+    if (!cache->valid || cache->handle != handle || cache->target_x != to_x || cache->target_y != to_y || !repair_path(s, cache, from_x, from_y, player, unit_stacks)) {
+        u32 path_length = 0;
+        cache->valid = 0;
+        if (pathing(s, from_x, from_y, to_x, to_y, &path_length, 1, player, unit_stacks) != 1) return 0; // UNIT_TYPE
+        cache->steps = grow_array(cache->steps, &cache->capacity, path_length, 1, "path cache");
+        for (u32 step = 0; step < path_length; step++) cache->steps[step] = s->path[path_length - step - 1];
+        cache->start_x = from_x, cache->start_y = from_y;
+        cache->target_x = to_x, cache->target_y = to_y;
+        cache->checked_at = change_counter;
+        cache->length = path_length;
+        cache->handle = handle;
+        cache->valid = 1;
+    }
+    out->steps = grow_array(out->steps, &out->capacity, cache->length, 1, "path");
+    out->length = cache->length;
+    memcpy(out->steps, cache->steps, cache->length);
+    return 1;
+}
+#pragma endregion
 
-            for (u8 step_index = 0; step_index < length; ++step_index) {
-                enum directions current_direction = unit_paths[player][unit].path[step_index];
-                u32 row_index = 0;
+#pragma region SPATIAL INDEX
+// stacks bucketed into cells of CELL_SIZE x CELL_SIZE tiles, kept up to date whenever a stack is created or emptied;
+// queries walk rings of cells outwards so they only look at stacks that can still be closer than what they have
+#define CELL_SHIFT 3
+#define CELL_SIZE (1 << CELL_SHIFT)
+struct spatial {
+    u32 cells_w, cells_h;
+    u16 *head; // first stack in each cell, NO_STACK if none
+    u16 *next, *prev; // cell list links per stack
+    u32 *tile; // where each stack in the index stands
+};
+struct spatial spatial;
 
-                if (step_index + 1 < length) {
-                    enum directions next_direction = unit_paths[player][unit].path[step_index + 1];
+void init_spatial(void) {
+    spatial.cells_w = (grid.w + CELL_SIZE - 1) >> CELL_SHIFT;
+    spatial.cells_h = (grid.h + CELL_SIZE - 1) >> CELL_SHIFT;
+    spatial.head = arena_alloc(&world_arena, sizeof(u16) * spatial.cells_w * spatial.cells_h);
+    spatial.next = arena_alloc(&world_arena, sizeof(u16) * scenario.max_stacks);
+    spatial.prev = arena_alloc(&world_arena, sizeof(u16) * scenario.max_stacks);
+    spatial.tile = arena_alloc(&world_arena, sizeof(u32) * scenario.max_stacks);
+    for (u32 cell = 0; cell < spatial.cells_w * spatial.cells_h; cell++) spatial.head[cell] = NO_STACK;
+}
 
-                    int current_dx = dir_offsets[current_direction].x;
-                    int current_dy = dir_offsets[current_direction].y;
-                    int next_dx = dir_offsets[next_direction].x;
-                    int next_dy = dir_offsets[next_direction].y;
+static inline u32 cell_of(u32 tile) { return (tile_y(tile) >> CELL_SHIFT) * spatial.cells_w + (tile_x(tile) >> CELL_SHIFT); }
 
-                    int dot_product = current_dx * next_dx + current_dy * next_dy;
-                    int cross_product = current_dx * next_dy - current_dy * next_dx;
+// regions are what resolve_turn works on from different threads: the chunks, so no cell list is shared
+#define NO_REGION 0xFFFFFFFFu
+_Static_assert(CHUNK_SHIFT >= CELL_SHIFT, "regions have to consist of whole cells");
+static inline u32 region_of(u32 tile) { return tile >> CHUNK_BITS; }
 
-                    if (dot_product == 1) {
-                        if (cross_product > 0) row_index = 1;
-                        else if (cross_product < 0) row_index = 2;
-                    } else if (dot_product == 0) {
-                        if (cross_product > 0) row_index = 3;
-                        else if (cross_product < 0) row_index = 4;
-                    }
-                }
+void spatial_insert(u32 stack_id, u32 tile) {
+    u32 cell = cell_of(tile);
+    spatial.tile[stack_id] = tile;
+    spatial.prev[stack_id] = NO_STACK;
+    spatial.next[stack_id] = spatial.head[cell];
+    if (spatial.head[cell] != NO_STACK) spatial.prev[spatial.head[cell]] = stack_id;
+    spatial.head[cell] = stack_id;
+}
 
-                pos delta = dir_offsets[current_direction];
-                tile_x += delta.x;
-                tile_y += delta.y;
-                if (!(tile_x < camera.tile_x || tile_y < camera.tile_y || tile_x > camera.end_x || tile_y > camera.end_y)) {
-                    enum directions atlas_index = (enum directions)(current_direction + row_index * ATLAS_SIZE);
-                    draw_step(camera, directions_atlas, atlas_index, tile_y, tile_x);
+void spatial_remove(u32 stack_id) {
+    if (spatial.prev[stack_id] != NO_STACK) spatial.next[spatial.prev[stack_id]] = spatial.next[stack_id];
+    else spatial.head[cell_of(spatial.tile[stack_id])] = spatial.next[stack_id];
+    if (spatial.next[stack_id] != NO_STACK) spatial.prev[spatial.next[stack_id]] = spatial.prev[stack_id];
+}
+
+static inline u32 distance2(u32 x, u32 y, u32 tile) {
+    i32 dx = (i32)tile_x(tile) - (i32)x, dy = (i32)tile_y(tile) - (i32)y;
+    return (u32)(dx * dx + dy * dy);
+}
+
+// up to k stacks of other players than player closer than max_distance2 (squared), nearest first and
+// the lower tile in row-major order first on equal distance; returns how many were found
+u32 spatial_nearest_enemies(u32 x, u32 y, u32 player, u32 k, u32 max_distance2, u16 *out, struct unit_stack *unit_stacks) {
+    u32 found = 0, found_distance2[k];
+    i32 cell_x = x >> CELL_SHIFT, cell_y = y >> CELL_SHIFT;
+    i32 cells_w = spatial.cells_w, cells_h = spatial.cells_h;
+    for (i32 ring = 0; ring < (cells_w > cells_h ? cells_w : cells_h); ring++) {
+        u32 reach = ring == 0 ? 0 : (u32)((ring - 1) * CELL_SIZE + 1); // closest any tile of this ring can be
+        u32 bound = found == k ? found_distance2[k - 1] : max_distance2 - 1;
+        if (reach * reach > bound) break;
+        for (i32 cy = cell_y - ring; cy <= cell_y + ring; cy++) {
+            if (cy < 0 || cy >= cells_h) continue;
+            bool edge_row = cy == cell_y - ring || cy == cell_y + ring;
+            for (i32 cx = cell_x - ring; cx <= cell_x + ring; cx += edge_row ? 1 : 2 * ring) { // only the border of the ring
+                if (cx >= 0 && cx < cells_w) {
+                    for (u32 stack_id = spatial.head[cy * cells_w + cx]; stack_id != NO_STACK; stack_id = spatial.next[stack_id]) {
+                        if (unit_stacks[stack_id].player_id == player) continue;
+                        u32 tile = spatial.tile[stack_id], d2 = distance2(x, y, tile);
+                        if (d2 >= max_distance2) continue;
+                        u32 at = found; // insertion sort into the k best
+                        while (at > 0 && (found_distance2[at - 1] > d2 || (found_distance2[at - 1] == d2 && row_major(spatial.tile[out[at - 1]]) > row_major(tile)))) at--;
+                        if (at >= k) continue;
+                        if (found < k) found++;
+                        for (u32 i = found - 1; i > at; i--) { out[i] = out[i - 1]; found_distance2[i] = found_distance2[i - 1]; }
+                        out[at] = stack_id;
+                        found_distance2[at] = d2;
+                    }
                 }
+                if (ring == 0) break;
             }
         }
     }
+    return found;
 }
 
-
-u32 add_unit_to_player(u32 player, enum units unit, u32 x, u32 y, struct unit_list player_units[PLAYER_COUNT]) {
-    // checks zouden al gedaan moeten zijn
-    for (u32 i = 0; i < player_units[player].count; ++i) { // Reuse empty slot in player_units
-        if (player_units[player].units[i].type == -1) {
-            player_units[player].units[i] = (struct unit){x, y, unit, i};
-            return i; // return id
+// stacks of other players than player (all stacks for NO_OWNER) within radius tiles; returns how many, at most max_count
+u32 spatial_within(u32 x, u32 y, u32 radius, u32 player, u16 *out, u32 max_count, struct unit_stack *unit_stacks) {
+    u32 count = 0;
+    i32 x0 = ((i32)x - (i32)radius) >> CELL_SHIFT, x1 = ((i32)x + (i32)radius) >> CELL_SHIFT;
+    i32 y0 = ((i32)y - (i32)radius) >> CELL_SHIFT, y1 = ((i32)y + (i32)radius) >> CELL_SHIFT;
+    for (i32 cy = y0 < 0 ? 0 : y0; cy <= y1 && cy < (i32)spatial.cells_h; cy++) {
+        for (i32 cx = x0 < 0 ? 0 : x0; cx <= x1 && cx < (i32)spatial.cells_w; cx++) {
+            for (u32 stack_id = spatial.head[cy * spatial.cells_w + cx]; stack_id != NO_STACK; stack_id = spatial.next[stack_id]) {
+                if (unit_stacks[stack_id].player_id == player) continue;
+                if (distance2(x, y, spatial.tile[stack_id]) > radius * radius) continue;
+                if (count == max_count) return count;
+                out[count++] = stack_id;
+            }
         }
     }
-    player_units[player].units[player_units[player].count] = (struct unit){x, y, unit, player_units[player].count};
-    player_units[player].count ++;
-    return player_units[player].count - 1; // return id
+    return count;
 }
 
-i32 add_unit_to_stack(u32 player, enum units unit, u32 x, u32 y, struct unit_stack unit_stacks[PLAYER_COUNT * MAX_UNITS], u32 stack_id, u32 unit_id) {
-    if (unit_stacks[stack_id].count >= MAX_UNITS) {
-        printf("Max units reached for stack %d\n", stack_id);
-        return -1; // Max units reached
-    }
-    if (unit_stacks[stack_id].used == 0) {
-        // Initialize stack if not used
-        units.pix[y * units.w + x] = 0xFF000000 | (stack_id * 8); // add the unit to the map
-        unit_stacks[stack_id].units[0] = (struct unit){x, y, unit, unit_id};
-        unit_stacks[stack_id].player_id = player;
-        unit_stacks[stack_id].used = 1;
-        unit_stacks[stack_id].count = 1;
-        return 0; // Stack initialized and unit added misschiens andere return value
+// first enemy stack next to (x, y) in direction order, NO_STACK if there is none; the grid itself is the finest level of the index
+u32 spatial_adjacent_enemy(u32 x, u32 y, u32 player, struct unit_stack *unit_stacks) {
+    for (u32 dir = UP; dir <= DOWN_RIGHT; dir++) {
+        u32 next_x = x + dir_offsets[dir].x;
+        u32 next_y = y + dir_offsets[dir].y;
+        if (!on_map(next_x, next_y)) continue; // out of bounds (wraps around for -1)
+        if (tile_blocked(tile_at(next_x, next_y), player, unit_stacks)) return grid_stack(tile_at(next_x, next_y));
     }
-    if (unit_stacks[stack_id].player_id != player) {
-        printf("Stack %d already occupied by player %d\n", stack_id, unit_stacks[stack_id].player_id);
-        return -2; // Stack already occupied
-    }
-    unit_stacks[stack_id].units[unit_stacks[stack_id].count] = (struct unit){x, y, unit, unit_id};
-    unit_stacks[stack_id].count ++;
-    return 0; // Unit added successfully
+    return NO_STACK;
 }
+#pragma endregion
 
-i32 add_unit(u32 player, enum units unit, u32 x, u32 y, struct unit_list player_units[PLAYER_COUNT], struct unit_stack unit_stacks[PLAYER_COUNT * MAX_UNITS]) {
-    if (player >= PLAYER_COUNT) {
-        printf("Invalid player index\n");
-        return -1; // Invalid player
+#pragma region WORKERS
+// small pool for the simulation: run_workers calls work on the calling thread and on number_of_threads - 1 others,
+// the job hands out its items through an atomic counter so the split doesn't matter for the result
+#ifndef SIM_THREADS
+#define SIM_THREADS 4
+#endif
+#define MAX_WORKER_THREADS 16
+
+struct worker_thread {
+    struct workers *workers;
+    u32 index;
+};
+
+struct workers {
+    u32 number_of_threads; // the thread calling run_workers counts as one
+    thread threads[MAX_WORKER_THREADS];
+    barrier barrier;
+    struct worker_thread thread_data[MAX_WORKER_THREADS];
+    struct search searches[MAX_WORKER_THREADS]; // search scratch, one per thread
+    void (*work)(struct workers *workers, void *job, u32 index);
+    void *job;
+};
+struct workers workers = {.number_of_threads = 1}; // everything runs on the calling thread until create_workers
+
+void *worker_loop(void *thread_args) {
+    struct worker_thread *context = (struct worker_thread *)thread_args;
+    struct workers *workers = context->workers;
+    for (;;) {
+        barrier_wait(&workers->barrier); // wait until run_workers hands out a job
+        if (!workers->work) return NULL; // destroy_workers
+        workers->work(workers, workers->job, context->index);
+        barrier_wait(&workers->barrier);
     }
-    if (x < 0 || x >= GRID_W || y < 0 || y >= GRID_H) {
-        printf("Invalid position (%d, %d)\n", x, y);
-        return -2; // Invalid position
+    return NULL;
+}
+
+void create_workers(struct workers *workers, u32 number_of_threads) {
+    if (number_of_threads < 1) number_of_threads = 1;
+    if (number_of_threads > MAX_WORKER_THREADS) number_of_threads = MAX_WORKER_THREADS;
+    workers->number_of_threads = number_of_threads;
+    if (number_of_threads == 1) return;
+    barrier_init(&workers->barrier, number_of_threads);
+    for (u32 i = 1; i < number_of_threads; i++) {
+        workers->thread_data[i] = (struct worker_thread){workers, i};
+        thread_create(&workers->threads[i], worker_loop, &workers->thread_data[i]);
     }
-    if (player_units[player].count >= MAX_UNITS) {
-        // printf("Max units reached for player %d\n", player);
-        return -3; // Max units reached
+}
+
+// stops and joins the threads; the search scratch is kept, so the pool can be created again with another size
+void destroy_workers(struct workers *workers) {
+    if (workers->number_of_threads > 1) {
+        workers->work = NULL;
+        barrier_wait(&workers->barrier);
+        for (u32 i = 1; i < workers->number_of_threads; i++) thread_join(workers->threads[i], NULL);
+        barrier_destroy(&workers->barrier);
     }
-    if (units.pix[y * units.w + x] != 0) { // found stack
-        u32 stack_id = (units.pix[y * units.w + x] & 0x00FFFFFF) / 8; // STACK ID
-        assert(unit_colors[unit] != 0 && "Unit is invalid, has color & alpha both set to zero");
-        u32 unit_id = add_unit_to_player(player, unit, x, y, player_units);
-        add_unit_to_stack(player, unit, x, y, unit_stacks, stack_id, unit_id); // Add unit to stack
+    workers->number_of_threads = 1;
+}
+
+// returns once every thread is done with the job
+void run_workers(struct workers *workers, void (*work)(struct workers *workers, void *job, u32 index), void *job) {
+    if (workers->number_of_threads == 1) {
+        work(workers, job, 0);
+        return;
     }
-    assert(unit_colors[unit] != 0 && "Unit is invalid, has color & alpha both set to zero");
-    u32 unit_id = add_unit_to_player(player, unit, x, y, player_units);
-    // find empty slot in stacks
-    for (u32 stack_id = 0; stack_id < PLAYER_COUNT * MAX_UNITS; stack_id ++) {
-        if (unit_stacks[stack_id].used == 0) { // empty stack
-            return add_unit_to_stack(player, unit, x, y, unit_stacks, stack_id, unit_id); // Add unit to stack
+    workers->work = work;
+    workers->job = job;
+    barrier_wait(&workers->barrier); // start the threads
+    work(workers, job, 0); // and help out
+    barrier_wait(&workers->barrier); // wait for the threads to finish
+}
+#pragma endregion
+
+#pragma region INFLUENCE
+// how strongly every player holds each tile: a stack spreads its strength over the tiles an infantry march reaches
+// within INFLUENCE_RANGE movement cost, fading linearly with the cost and stopped by sea and mountains. the layers are
+// plain sums, so a stack that moved or changed is taken out where it was and put in where it is instead of the map
+// being recomputed; add_unit_to_stack and remove_unit_from_stack flag the stacks that changed since the last update
+#define INFLUENCE_RANGE 400 // movement cost at which a stack's influence has faded out
+#define ZONE_FRONT 0x80 // zone flag: a second player has influence on the tile too
+struct influence_source {
+    u32 tile; // NO_TILE if nothing is applied
+    i32 strength; // negative to take a source out again
+    u32 player;
+};
+struct influence {
+    u32 **chunks[MAX_PLAYERS]; // per player per chunk the summed influence on each tile, NULL until the player reached it
+    struct arena arenas[MAX_PLAYERS]; // the layers of different players are updated on different threads
+    struct influence_source *applied; // per stack, what is in the layers for it
+    _Atomic u32 *dirty; // bit per stack, its units changed; set from the regions resolving in parallel
+    u8 **zone; // per chunk the dominant player + 1 on each tile (0 for nobody) | ZONE_FRONT, NULL until anyone reached it
+    u32 *zone_version; // per chunk, bumped whenever its zone is worked out again
+    _Atomic u8 *stale; // per chunk, a layer changed since its zone was worked out
+    struct influence_source *changes; // what update_influence takes out and puts in this time
+    u32 change_count, change_capacity;
+    _Atomic u32 next; // next player to hand out
+};
+struct influence influence;
+
+void init_influence(void) {
+    influence.applied = arena_alloc(&world_arena, sizeof(struct influence_source) * scenario.max_stacks);
+    for (u32 stack_id = 0; stack_id < scenario.max_stacks; stack_id++) influence.applied[stack_id].tile = NO_TILE;
+    influence.dirty = arena_alloc(&world_arena, sizeof(u32) * ((scenario.max_stacks + 31) / 32));
+    for (u32 player = 0; player < scenario.players; player++)
+        influence.chunks[player] = arena_alloc(&world_arena, sizeof(u32 *) * grid.chunk_count);
+    influence.zone = arena_alloc(&world_arena, sizeof(u8 *) * grid.chunk_count);
+    influence.zone_version = arena_alloc(&world_arena, sizeof(u32) * grid.chunk_count);
+    influence.stale = arena_alloc(&world_arena, grid.chunk_count);
+}
+
+static inline void influence_changed(u32 stack_id) { atomic_fetch_or(&influence.dirty[stack_id >> 5], 1u << (stack_id & 31)); }
+
+// adds the source to its player's layer over everything within range, a Dijkstra on the thread's search scratch;
+// the same source with the opposite strength takes exactly as much out again
+void spread_influence(struct search *s, struct influence_source source) {
+    const u16 *costs = terrain_cost[INFANTRY];
+    u32 **layer = influence.chunks[source.player];
+    search_begin(s);
+    search_touch(s, source.tile);
+    search_g(s, source.tile) = 0;
+    heap_push_or_decrease(s, source.tile, 0);
+    while (s->heap_count > 0) {
+        u32 tile = heap_pop(s), g = search_g(s, tile);
+        u32 **chunk = &layer[tile >> CHUNK_BITS];
+        if (!*chunk) *chunk = arena_alloc(&influence.arenas[source.player], sizeof(u32) * CHUNK_TILES);
+        (*chunk)[in_chunk(tile)] += (u32)(source.strength * (i32)(INFLUENCE_RANGE - g) / INFLUENCE_RANGE);
+        atomic_store_explicit(&influence.stale[tile >> CHUNK_BITS], 1, memory_order_relaxed);
+        u32 x = tile_x(tile), y = tile_y(tile);
+        for (u32 dir = UP; dir <= DOWN_RIGHT; dir++) {
+            u32 next_x = x + dir_offsets[dir].x;
+            u32 next_y = y + dir_offsets[dir].y;
+            if (!on_map(next_x, next_y)) continue; // out of bounds (wraps around for -1)
+            u32 next = tile_at(next_x, next_y);
+            u32 cost = costs[grid_terrain(next)];
+            if (cost == COST_IMPASSABLE || g + cost >= INFLUENCE_RANGE) continue;
+            if (!search_touch(s, next) && (search_heap_index(s, next) == HEAP_CLOSED || g + cost >= search_g(s, next))) {
+                continue;
+            }
+            search_g(s, next) = g + cost;
+            heap_push_or_decrease(s, next, g + cost);
         }
     }
-    return -5;
 }
 
-i32 remove_unit_from_stack(u32 player, u32 unit_id, struct unit_stack unit_stacks[PLAYER_COUNT * MAX_UNITS], struct unit_list player_units[PLAYER_COUNT]) {
-    if (unit_id < 0 || unit_id >= player_units[player].count || player < 0 || player >= PLAYER_COUNT || player_units[player].units[unit_id].type == -1) {
-        printf("Invalid unit index %d for player %d\n", unit_id, player);
-        return -1; // Invalid unit
-    }
-    
-    u32 x = player_units[player].units[unit_id].x;
-    u32 y = player_units[player].units[unit_id].y;
-    u32 stack_id = (units.pix[y * units.w + x] & 0x00FFFFFF) / 0x08; // STACK ID
-    // printf("Removing unit %d from stack %d, player %d\n", unit_id, stack_id, player);
-    if (stack_id < 0 || stack_id >= PLAYER_COUNT * MAX_UNITS) {
-        printf("Invalid stack index\n");
-        return -1; // Invalid stack
-    }
-    if (unit_stacks[stack_id].used == 0 || unit_stacks[stack_id].player_id != player) {
-        printf("Stack %d is not used or not owned by player %d (player: %d)\n", stack_id, player, unit_stacks[stack_id].player_id);
-        return -2; // Stack not used or not owned by player
+// one player's changes per work item, so every layer is only written by one thread
+void update_influence_worker(struct workers *workers, void *job_pointer, u32 index) {
+    struct influence *job = job_pointer;
+    for (;;) {
+        u32 player = atomic_fetch_add(&job->next, 1);
+        if (player >= scenario.players) break;
+        for (u32 i = 0; i < job->change_count; i++)
+            if (job->changes[i].player == player) spread_influence(&workers->searches[index], job->changes[i]);
     }
-    if (unit_stacks[stack_id].count == 0) {
-        printf("Stack %d is empty\n", stack_id);
-        return -3; // Stack is empty
+}
+
+// strongest and second strongest player on every tile of the chunk; branch free over whole layers so the loops vectorize
+void update_zone(u32 chunk) {
+    u32 best[CHUNK_TILES] = {0}, second[CHUNK_TILES] = {0}, owner[CHUNK_TILES] = {0};
+    for (u32 player = 0; player < scenario.players; player++) {
+        const u32 *layer = influence.chunks[player][chunk];
+        if (!layer) continue;
+        for (u32 i = 0; i < CHUNK_TILES; i++) {
+            u32 value = layer[i], top = value > best[i];
+            second[i] = top ? best[i] : value > second[i] ? value : second[i];
+            owner[i] = top ? player + 1 : owner[i];
+            best[i] = top ? value : best[i];
+        }
     }
-    for (u32 unit = 0; unit < unit_stacks[stack_id].count; unit++) { // unit is hier plaats in de stack
-        // printf("Checking unit %d in stack %d\n", unit_stacks[stack_id].units[unit].id, stack_id);
-        if (unit_stacks[stack_id].units[unit].id == unit_id) {
-            // printf("Found unit %d in stack %d\n", unit_id, stack_id);
-            // Remove the unit from the stack
-            for (u32 j = unit; j < unit_stacks[stack_id].count - 1; j++) {
-                unit_stacks[stack_id].units[j] = unit_stacks[stack_id].units[j + 1]; // Shift units down
+    if (!influence.zone[chunk]) influence.zone[chunk] = arena_alloc(&world_arena, CHUNK_TILES);
+    for (u32 i = 0; i < CHUNK_TILES; i++) influence.zone[chunk][i] = (u8)(owner[i] | (second[i] > 0 ? ZONE_FRONT : 0));
+    influence.zone_version[chunk]++;
+}
+
+// brings the layers and zones up to date with the stacks flagged since the last call
+void update_influence(struct unit_list player_units[MAX_PLAYERS], struct unit_stack *unit_stacks) {
+    influence.change_count = 0;
+    for (u32 word = 0; word < (scenario.max_stacks + 31) / 32; word++) {
+        u32 bits = atomic_exchange(&influence.dirty[word], 0);
+        for (u32 stack_id = word * 32; bits != 0; stack_id++, bits >>= 1) {
+            if (!(bits & 1)) continue;
+            struct unit_stack *stack = &unit_stacks[stack_id];
+            struct influence_source now = {NO_TILE, 0, 0};
+            if (stack->used) {
+                struct unit *units = player_units[stack->player_id].units;
+                now = (struct influence_source){spatial.tile[stack_id], 0, stack->player_id};
+                for (u32 unit = stack->first_unit; unit != NO_UNIT; unit = units[unit].next_in_stack) now.strength += unit_strength[units[unit].type];
             }
-            unit_stacks[stack_id].units[unit_stacks[stack_id].count - 1] = (struct unit){0, 0, -1, -1}; // Clear last unit
-            break;
+            struct influence_source *was = &influence.applied[stack_id];
+            if (was->tile == now.tile && was->strength == now.strength && was->player == now.player) continue; // came back
+            influence.changes = grow_array(influence.changes, &influence.change_capacity, influence.change_count + 2, sizeof(struct influence_source), "influence changes");
+            if (was->tile != NO_TILE) influence.changes[influence.change_count++] = (struct influence_source){was->tile, -was->strength, was->player};
+            if (now.tile != NO_TILE) influence.changes[influence.change_count++] = now;
+            *was = now;
         }
     }
-    unit_stacks[stack_id].count--; // Decrease stack count
-    if (unit_stacks[stack_id].count == 0) {
-        unit_stacks[stack_id].used = 0; // Mark stack as unused
-        unit_stacks[stack_id].player_id = -1; // Clear player id
-        units.pix[y * units.w + x] = 0; // Clear the tile PROBLEMS
+    if (influence.change_count == 0) return;
+    atomic_store(&influence.next, 0);
+    run_workers(&workers, update_influence_worker, &influence);
+    for (u32 chunk = 0; chunk < grid.chunk_count; chunk++) {
+        if (!influence.stale[chunk]) continue;
+        influence.stale[chunk] = 0;
+        update_zone(chunk);
+    }
+}
+
+// own influence on the tile minus the strongest other player's, positive where the player has the upper hand
+i32 influence_balance(u32 tile, u32 player) {
+    i32 own = 0, other = 0;
+    for (u32 p = 0; p < scenario.players; p++) {
+        const u32 *layer = influence.chunks[p][tile >> CHUNK_BITS];
+        i32 value = layer ? (i32)layer[in_chunk(tile)] : 0;
+        if (p == player) own = value;
+        else if (value > other) other = value;
+    }
+    return own - other;
+}
+
+// copies the zones that changed since the snapshot last took them
+void snapshot_zones(u8 **zone, u32 *zone_version) {
+    for (u32 chunk = 0; chunk < grid.chunk_count; chunk++) {
+        if (zone_version[chunk] == influence.zone_version[chunk]) continue;
+        if (!zone[chunk]) zone[chunk] = arena_alloc(&world_arena, CHUNK_TILES); // only ever called on the simulation thread
+        memcpy(zone[chunk], influence.zone[chunk], CHUNK_TILES);
+        zone_version[chunk] = influence.zone_version[chunk];
+    }
+}
+#pragma endregion
+
+#pragma region AI PLANNER
+// the units of every player are planned together on the workers: planning only reads the shared state and every unit
+// writes nothing but its own path and path cache slot, so the result is the same for any thread count or timing
+#define PLAN_CHUNK 4 // units taken from the queue at once, searches vary a lot in length
+
+struct plan_job {
+    u32 player_count; // players 0 up to here are planned
+    struct unit_list *player_units;
+    struct path **player_paths;
+    struct unit_stack *unit_stacks;
+    struct search *flow_fields; // per player, built before the fan out in flow field mode, only read by the threads
+    u64 deadline_us; // the threads stop taking units once time_us passes this, 0 for no limit
+    u32 live_start[MAX_PLAYERS + 1]; // the live units of all players queued one player after the other
+    _Atomic u32 next; // next queue index to hand out
+};
+
+void plan_unit(struct search *s, struct plan_job *job, u32 player, u32 unit) {
+    struct unit_list *units = &job->player_units[player];
+    struct path *path = &job->player_paths[player][unit];
+    u32 x = units->units[unit].x;
+    u32 y = units->units[unit].y;
+    if (job->flow_fields) {
+        flow_path(&job->flow_fields[player], x, y, path);
+        return;
+    }
+    u16 targets[4];
+    u32 found = spatial_nearest_enemies(x, y, player, 4, 2500, targets, job->unit_stacks);
+    if (found == 0) {
+        // No target found, skip this unit
+        #if !HEADLESS // a headless run would mostly time its printing
+        printf("No target found for player %d unit %d at (%d, %d)\n", player, unit, x, y);
+        #endif
+        path->length = 0;
+        return;
+    }
+    // of the enemies at most twice as far as the nearest, go for the one where the front leans our way the most
+    u32 target = targets[0], nearest_distance2 = distance2(x, y, spatial.tile[targets[0]]);
+    i32 best_balance = influence_balance(spatial.tile[target], player);
+    for (u32 i = 1; i < found && distance2(x, y, spatial.tile[targets[i]]) <= 4 * nearest_distance2; i++) {
+        i32 balance = influence_balance(spatial.tile[targets[i]], player);
+        if (balance > best_balance) best_balance = balance, target = targets[i];
+    }
+    u32 target_x = tile_x(spatial.tile[target]), target_y = tile_y(spatial.tile[target]);
+    // Get path to target, repaired from last turn if possible
+    if (plan_path(s, player, unit_handle(&units->units[unit]), x, y, target_x, target_y, path, job->unit_stacks) != 1) {
+        path->length = 0; // No path found
+    }
+}
+
+void plan_units_worker(struct workers *workers, void *job_pointer, u32 index) {
+    struct plan_job *job = job_pointer;
+    u32 total = job->live_start[job->player_count];
+    for (;;) {
+        if (job->deadline_us && time_us() >= job->deadline_us) break; // the rest waits for the next run
+        u32 begin = atomic_fetch_add(&job->next, PLAN_CHUNK);
+        if (begin >= total) break;
+        u32 end = begin + PLAN_CHUNK < total ? begin + PLAN_CHUNK : total;
+        u32 player = 0;
+        for (u32 queued = begin; queued < end; queued++) {
+            while (queued >= job->live_start[player + 1]) player++;
+            plan_unit(&workers->searches[index], job, player, job->player_units[player].dense[queued - job->live_start[player]]);
+        }
+    }
+}
+
+// queues every live unit of the first job.player_count players
+void queue_plan_units(struct plan_job *job) {
+    job->live_start[0] = 0;
+    for (u32 player = 0; player < job->player_count; player++)
+        job->live_start[player + 1] = job->live_start[player] + job->player_units[player].live;
+    atomic_store(&job->next, 0);
+}
+
+// plans queued units until the queue is empty or the deadline passed; true once every unit is planned. a unit taken
+// from the queue is always finished, so the next run picks up exactly where this one stopped
+bool run_plan_units(struct workers *workers, struct plan_job *job) {
+    run_workers(workers, plan_units_worker, job);
+    return atomic_load(&job->next) >= job->live_start[job->player_count];
+}
+
+// plans every live unit of the first job.player_count players, returns once all paths are written
+void plan_units(struct workers *workers, struct plan_job *job) {
+    queue_plan_units(job);
+    run_plan_units(workers, job);
+}
+
+enum flow_states { FLOW_UNSEEDED, FLOW_EXPANDING, FLOW_DONE };
+struct flow_job {
+    struct search *flow_fields;
+    struct unit_stack *unit_stacks;
+    u32 stack_count; // stacks that were ever used
+    u64 deadline_us; // like plan_job's, a field that isn't done by then is carried on with in the next run
+    u8 state[MAX_PLAYERS]; // enum flow_states per field
+    _Atomic u32 next; // next player to hand out
+};
+
+// one field per player, seeded with the stacks of every other player
+void build_flow_fields_worker(struct workers *workers, void *job_pointer, u32 index) {
+    struct flow_job *job = job_pointer;
+    for (;;) {
+        if (job->deadline_us && time_us() >= job->deadline_us) break;
+        u32 player = atomic_fetch_add(&job->next, 1);
+        if (player >= scenario.players) break;
+        struct search *field = &job->flow_fields[player];
+        if (job->state[player] == FLOW_UNSEEDED) {
+            u32 count = 0;
+            for (u32 stack_id = 0; stack_id < job->stack_count; stack_id++) {
+                if (!job->unit_stacks[stack_id].used || job->unit_stacks[stack_id].player_id == player) continue;
+                field->tiles = grow_array(field->tiles, &field->tiles_capacity, count + 1, sizeof(u32), "flow field seeds");
+                field->tiles[count++] = spatial.tile[stack_id];
+            }
+            seed_flow_field(field, field->tiles, count);
+            job->state[player] = FLOW_EXPANDING;
+        }
+        if (job->state[player] == FLOW_EXPANDING && expand_flow_field(field, 1, job->deadline_us)) job->state[player] = FLOW_DONE; // UNIT_TYPE
+    }
+}
+
+// true once every field is complete, otherwise the players are handed out again for the next run
+bool flow_fields_done(struct flow_job *job) {
+    for (u32 player = 0; player < scenario.players; player++) {
+        if (job->state[player] == FLOW_DONE) continue;
+        atomic_store(&job->next, 0);
+        return false;
+    }
+    return true;
+}
+#pragma endregion
+
+static inline u32 mix_colors(u32 a, u32 b) {
+    return (((a ^ b) & 0xFEFEFEFEU) >> 1U) + (a & b);
+}
+
+#pragma region INDEXED
+// the frame buffer can be a byte per pixel instead of four (--indexed): rgb332 indices into a fixed palette, looked up
+// only while they are upscaled to the display, so drawing, scrolling and reading the buffer back move a quarter of the
+// bytes; the atlases get an index and a mask byte per pixel, and the zone tint becomes a table per player
+u32 indexed_palette[256];
+u8 tint_indices[MAX_PLAYERS][2][256]; // per player what an index becomes inside their zone, [1] on a front
+
+void init_indexed(void) {
+    for (u32 i = 0; i < 256; i++) indexed_palette[i] = 0xFF000000u | index_to_color_rgb332(i);
+    for (u32 player = 0; player < MAX_PLAYERS; player++) {
+        for (u32 i = 0; i < 256; i++) {
+            u32 tinted = mix_colors(indexed_palette[i], player_colors[player]);
+            tint_indices[player][1][i] = (u8)color_to_index_rgb332(tinted);
+            tint_indices[player][0][i] = (u8)color_to_index_rgb332(mix_colors(indexed_palette[i], tinted));
+        }
+    }
+}
+
+void index_atlas(struct tga *atlas) {
+    usize count = (usize)atlas->w * atlas->h;
+    atlas->indices = malloc(count);
+    atlas->opaque = malloc(count);
+    if (!atlas->indices || !atlas->opaque) { fprintf(stderr, "OOM: indexed atlas\n"); exit(1); }
+    for (usize i = 0; i < count; i++) {
+        atlas->indices[i] = (u8)color_to_index_rgb332(atlas->pix[i]);
+        atlas->opaque[i] = atlas->pix[i] & 0xFF000000u ? 0xFF : 0;
+    }
+}
+
+// the colours of a rect of indices on a display the size of the buffer, when there is no upscale to do it on the way
+void look_up_indices(u32 *restrict display, const u8 *restrict indices, u32 stride, u32 x, u32 y, u32 w, u32 h) {
+    for (u32 row = y; row < y + h; row++)
+        for (u32 column = x; column < x + w; column++) display[row * stride + column] = indexed_palette[indices[row * stride + column]];
+}
+
+// the same select as masked_row_scalar a byte at a time, which the compiler vectorizes on its own
+void blit_masked_indices(u8 *restrict buffer, u32 buffer_stride, const u8 *restrict atlas, const u8 *restrict opaque, u32 atlas_stride, u32 width, u32 height) {
+    for (u32 y = 0; y < height; ++y, buffer += buffer_stride, atlas += atlas_stride, opaque += atlas_stride)
+        for (u32 x = 0; x < width; ++x) buffer[x] = (buffer[x] & ~opaque[x]) | (atlas[x] & opaque[x]);
+}
+#pragma endregion
+
+#pragma region BLITTERS
+// sprites are copied where their alpha isn't 0; the SIMD versions select with a compare on the alpha byte and a blend,
+// 8 pixels at a time with AVX2 or 4 with SSE4.1, and are picked once at startup from what the CPU supports. every
+// kernel has a 64 pixel wide version, inlined with the width fixed so the row loop is fully unrolled, and a generic one
+// that finishes a row with the scalar select
+
+typedef void (*blit_rows_fn)(u32 *restrict buffer, u32 buffer_stride, const u32 *restrict atlas, u32 atlas_stride, u32 width, u32 height);
+typedef void (*rle_blit_fn)(u32 *buffer, u32 buffer_stride, const u8 *tokens, const u32 palette[16], u32 width, u32 height);
+
+static inline void masked_row_scalar(u32 *restrict buffer, const u32 *restrict atlas, u32 x, u32 width) {
+    for (; x < width; ++x) {
+        u32 source_pixel = atlas[x];
+        u32 alpha_bits = source_pixel & 0xFF000000u;
+        u32 all_or_nothing_mask = 0u - (alpha_bits != 0u); // -1 ie. all ones if alpha is not 0, otherwise 0
+        buffer[x] = (buffer[x] & ~all_or_nothing_mask) | (source_pixel & all_or_nothing_mask);
+    }
+}
+
+void blit_masked_scalar(u32 *restrict buffer, u32 buffer_stride, const u32 *restrict atlas, u32 atlas_stride, u32 width, u32 height) {
+    for (u32 y = 0; y < height; ++y, buffer += buffer_stride, atlas += atlas_stride) masked_row_scalar(buffer, atlas, 0, width);
+}
+
+#if HAVE_X86_SIMD
+__attribute__((target("sse4.1"), always_inline)) static inline void masked_rows_sse4(u32 *restrict buffer, u32 buffer_stride, const u32 *restrict atlas, u32 atlas_stride, const u32 width, u32 height) {
+    const __m128i alpha = _mm_set1_epi32((i32)0xFF000000u), zero = _mm_setzero_si128();
+    for (u32 y = 0; y < height; ++y, buffer += buffer_stride, atlas += atlas_stride) {
+        u32 x = 0;
+        for (; x + 4 <= width; x += 4) {
+            __m128i source = _mm_loadu_si128((const __m128i *)(atlas + x)), destination = _mm_loadu_si128((const __m128i *)(buffer + x));
+            __m128i transparent = _mm_cmpeq_epi32(_mm_and_si128(source, alpha), zero);
+            _mm_storeu_si128((__m128i *)(buffer + x), _mm_blendv_epi8(source, destination, transparent));
+        }
+        masked_row_scalar(buffer, atlas, x, width);
+    }
+}
+
+__attribute__((target("avx2"), always_inline)) static inline void masked_rows_avx2(u32 *restrict buffer, u32 buffer_stride, const u32 *restrict atlas, u32 atlas_stride, const u32 width, u32 height) {
+    const __m256i alpha = _mm256_set1_epi32((i32)0xFF000000u), zero = _mm256_setzero_si256();
+    for (u32 y = 0; y < height; ++y, buffer += buffer_stride, atlas += atlas_stride) {
+        u32 x = 0;
+        for (; x + 8 <= width; x += 8) {
+            __m256i source = _mm256_loadu_si256((const __m256i *)(atlas + x)), destination = _mm256_loadu_si256((const __m256i *)(buffer + x));
+            __m256i transparent = _mm256_cmpeq_epi32(_mm256_and_si256(source, alpha), zero);
+            _mm256_storeu_si256((__m256i *)(buffer + x), _mm256_blendv_epi8(source, destination, transparent));
+        }
+        masked_row_scalar(buffer, atlas, x, width);
+    }
+}
+
+__attribute__((target("sse4.1"))) void blit_masked_sse4(u32 *restrict buffer, u32 buffer_stride, const u32 *restrict atlas, u32 atlas_stride, u32 width, u32 height) {
+    masked_rows_sse4(buffer, buffer_stride, atlas, atlas_stride, width, height);
+}
+__attribute__((target("sse4.1"))) void blit_masked_sse4_tile(u32 *restrict buffer, u32 buffer_stride, const u32 *restrict atlas, u32 atlas_stride, u32 width, u32 height) {
+    masked_rows_sse4(buffer, buffer_stride, atlas, atlas_stride, TILE_SIZE, height);
+}
+__attribute__((target("avx2"))) void blit_masked_avx2(u32 *restrict buffer, u32 buffer_stride, const u32 *restrict atlas, u32 atlas_stride, u32 width, u32 height) {
+    masked_rows_avx2(buffer, buffer_stride, atlas, atlas_stride, width, height);
+}
+__attribute__((target("avx2"))) void blit_masked_avx2_tile(u32 *restrict buffer, u32 buffer_stride, const u32 *restrict atlas, u32 atlas_stride, u32 width, u32 height) {
+    masked_rows_avx2(buffer, buffer_stride, atlas, atlas_stride, TILE_SIZE, height);
+}
+#endif
+
+struct blitters {
+    const char *name;
+    blit_rows_fn masked; // any width
+    blit_rows_fn masked_tile; // rows exactly TILE_SIZE wide
+    rle_blit_fn rle; // a palette RLE tile, decoded while it is copied (see palette.inc)
+};
+struct blitters blitters = {"scalar", blit_masked_scalar, blit_masked_scalar, rle_blit_scalar};
+
+void pick_blitters(void) {
+    #if HAVE_X86_SIMD
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) blitters = (struct blitters){"avx2", blit_masked_avx2, blit_masked_avx2_tile, rle_blit_ssse3};
+    else if (__builtin_cpu_supports("sse4.1")) blitters = (struct blitters){"sse4.1", blit_masked_sse4, blit_masked_sse4_tile, rle_blit_ssse3};
+    else if (__builtin_cpu_supports("ssse3")) blitters.rle = rle_blit_ssse3;
+    #endif
+}
+
+void blit_masked(struct camera camera, struct tga atlas, u32 buffer_x, u32 buffer_y, u32 atlas_x, u32 atlas_y, u32 width, u32 height) {
+    if (buffer_x + width > camera.buffer_w) { width = camera.buffer_w - buffer_x; }
+    if (buffer_y + height > camera.buffer_h) { height = camera.buffer_h - buffer_y; }
+    if (camera.indices) {
+        usize at = (usize)atlas_y * atlas.w + atlas_x;
+        blit_masked_indices(camera.indices + buffer_y * camera.buffer_w + buffer_x, camera.buffer_w, atlas.indices + at, atlas.opaque + at, atlas.w, width, height);
+        return;
+    }
+
+    u32 *restrict buffer_location = camera.buffer + buffer_y * camera.buffer_w + buffer_x;
+    const u32 *restrict atlas_location = atlas.pix + atlas_y * atlas.w + atlas_x;
+
+    (width == TILE_SIZE ? blitters.masked_tile : blitters.masked)(buffer_location, camera.buffer_w, atlas_location, atlas.w, width, height);
+}
+#pragma endregion
+
+static inline void draw_unit(struct camera camera, struct tga units_atlas, u32 tile_y, u32 tile_x, enum units unit) {
+    const u32 buffer_y = (tile_y - camera.tile_y) * TILE_SIZE;
+    const u32 buffer_x = (tile_x - camera.tile_x) * TILE_SIZE;
+    const u32 atlas_x = (unit % ATLAS_SIZE) * TILE_SIZE;
+    const u32 atlas_y = (unit / ATLAS_SIZE) * TILE_SIZE;
+    
+    blit_masked(camera, units_atlas, buffer_x, buffer_y, atlas_x, atlas_y, TILE_SIZE, TILE_SIZE);
+}
+
+void draw_step(struct camera camera, struct tga directions_atlas, enum directions direction, u32 tile_y, u32 tile_x) {
+    const u32 buffer_y = (tile_y - camera.tile_y) * TILE_SIZE;
+    const u32 buffer_x = (tile_x - camera.tile_x) * TILE_SIZE;
+    const u32 atlas_x = (direction % ATLAS_SIZE) * TILE_SIZE;
+    const u32 atlas_y = (direction / ATLAS_SIZE) * TILE_SIZE;
+    
+    blit_masked(camera, directions_atlas, buffer_x, buffer_y, atlas_x, atlas_y, TILE_SIZE, TILE_SIZE);
+}
+
+// a palette RLE atlas (see palette.inc) mapped the way it is on disk
+struct rle_atlas {
+    u32 count; // tiles
+    const u32 *offsets; // per tile, where its tokens start in the file
+    const u8 *file;
+    usize size;
+};
+
+#pragma region TERRAIN PAGES
+// the terrain only changes with the map, so it is baked into pages of PAGE_TILES by PAGE_TILES tiles the first time the
+// camera sees them, and a run of tiles is drawn with one copy per pixel row; a map-sized layer would take 16 KB per tile,
+// so only the pages around the camera are kept
+#define PAGE_SHIFT 3
+#define PAGE_TILES (1u << PAGE_SHIFT)
+#define PAGE_PIXELS (PAGE_TILES * TILE_SIZE) // width and height of a page
+#define TERRAIN_PAGES 32 // baked pages kept, a view overlaps at most 5 by 4
+#define NO_PAGE 0xFFFF
+struct terrain_pages {
+    u8 *pixels; // TERRAIN_PAGES pages of PAGE_PIXELS * PAGE_PIXELS
+    u32 pixel_bytes; // 4, or 1 when the frame buffer is indexed
+    u16 *slot; // per page of the map the slot it is baked in, NO_PAGE if it isn't
+    u32 key[TERRAIN_PAGES]; // page of the map baked in each slot
+    u32 used[TERRAIN_PAGES]; // draw that last read each slot, the least recent one is baked over
+    u32 columns; // pages per row of the map
+    u32 draws;
+};
+struct terrain_pages terrain_pages;
+#if RLE_TERRAIN // bake the pages from the 4 bit atlas palette/encode.c makes instead of the 32 bit map_atlas
+struct rle_atlas terrain_rle;
+u32 terrain_palette[16]; // starts as rle_palette; pages baked after a change use the new colours
+#endif
+
+void init_terrain_pages(u32 pixel_bytes) {
+    terrain_pages.pixel_bytes = pixel_bytes;
+    terrain_pages.columns = (grid.w + PAGE_TILES - 1) >> PAGE_SHIFT;
+    u32 page_count = terrain_pages.columns * ((grid.h + PAGE_TILES - 1) >> PAGE_SHIFT);
+    terrain_pages.pixels = malloc((usize)pixel_bytes * TERRAIN_PAGES * PAGE_PIXELS * PAGE_PIXELS);
+    terrain_pages.slot = malloc(sizeof(u16) * page_count);
+    if (!terrain_pages.pixels || !terrain_pages.slot) { fprintf(stderr, "OOM: terrain pages\n"); exit(1); }
+    memset(terrain_pages.slot, 0xFF, sizeof(u16) * page_count);
+}
+
+// one tile of terrain into a page, in the page's pixel format
+void bake_tile(struct tga map_atlas, enum tiles tile, u8 *page_tile) {
+    if (terrain_pages.pixel_bytes == 1) {
+        #if RLE_TERRAIN
+        static u32 decoded[TILE_SIZE * TILE_SIZE];
+        blitters.rle(decoded, TILE_SIZE, terrain_rle.file + terrain_rle.offsets[tile], terrain_palette, TILE_SIZE, TILE_SIZE);
+        for (u32 row = 0; row < TILE_SIZE; row++, page_tile += PAGE_PIXELS)
+            for (u32 column = 0; column < TILE_SIZE; column++) page_tile[column] = (u8)color_to_index_rgb332(decoded[row * TILE_SIZE + column]);
+        #else
+        const u8 *atlas_row = map_atlas.indices + (tile / ATLAS_SIZE) * TILE_SIZE * map_atlas.w + (tile % ATLAS_SIZE) * TILE_SIZE;
+        for (u32 row = 0; row < TILE_SIZE; row++, atlas_row += map_atlas.w, page_tile += PAGE_PIXELS) memcpy(page_tile, atlas_row, TILE_SIZE);
+        #endif
+        return;
+    }
+    u32 *page_row = (u32 *)page_tile;
+    #if RLE_TERRAIN
+    blitters.rle(page_row, PAGE_PIXELS, terrain_rle.file + terrain_rle.offsets[tile], terrain_palette, TILE_SIZE, TILE_SIZE);
+    #else
+    const u32 *atlas_row = map_atlas.pix + (tile / ATLAS_SIZE) * TILE_SIZE * map_atlas.w + (tile % ATLAS_SIZE) * TILE_SIZE;
+    for (u32 row = 0; row < TILE_SIZE; row++, atlas_row += map_atlas.w, page_row += PAGE_PIXELS)
+        memcpy(page_row, atlas_row, TILE_SIZE * sizeof(u32));
+    #endif
+}
+
+// the pixels of the page holding the tile, baked from the atlas if it isn't yet
+u8 *terrain_page(struct tga map_atlas, u32 tile_x, u32 tile_y) {
+    u32 key = (tile_y >> PAGE_SHIFT) * terrain_pages.columns + (tile_x >> PAGE_SHIFT);
+    u32 slot = terrain_pages.slot[key];
+    if (slot == NO_PAGE) {
+        slot = 0;
+        for (u32 i = 1; i < TERRAIN_PAGES; i++) if (terrain_pages.used[i] < terrain_pages.used[slot]) slot = i;
+        if (terrain_pages.used[slot]) terrain_pages.slot[terrain_pages.key[slot]] = NO_PAGE; // evicted
+        terrain_pages.key[slot] = key;
+        terrain_pages.slot[key] = slot;
+        u8 *page = terrain_pages.pixels + (usize)slot * PAGE_PIXELS * PAGE_PIXELS * terrain_pages.pixel_bytes;
+        u32 x0 = tile_x & ~(PAGE_TILES - 1), y0 = tile_y & ~(PAGE_TILES - 1);
+        for (u32 y = y0; y < y0 + PAGE_TILES && y < grid.h; y++) {
+            for (u32 x = x0; x < x0 + PAGE_TILES && x < grid.w; x++) {
+                usize at = (usize)(y - y0) * TILE_SIZE * PAGE_PIXELS + (x - x0) * TILE_SIZE;
+                bake_tile(map_atlas, grid_terrain(tile_at(x, y)), page + at * terrain_pages.pixel_bytes);
+            }
+        }
+    }
+    terrain_pages.used[slot] = ++terrain_pages.draws;
+    return terrain_pages.pixels + (usize)slot * PAGE_PIXELS * PAGE_PIXELS * terrain_pages.pixel_bytes;
+}
+
+// the terrain of the visible tiles tile_x to end_x (inclusive) on row tile_y, a windowed copy out of each page it crosses
+void draw_terrain_run(struct camera camera, struct tga map_atlas, u32 tile_x, u32 end_x, u32 tile_y) {
+    const u32 buffer_y = (tile_y - camera.tile_y) * TILE_SIZE;
+    const u32 height = buffer_y + TILE_SIZE > camera.buffer_h ? camera.buffer_h - buffer_y : TILE_SIZE;
+    const u32 bytes = terrain_pages.pixel_bytes;
+    while (tile_x <= end_x) {
+        u32 run_end = (tile_x | (PAGE_TILES - 1)) < end_x ? (tile_x | (PAGE_TILES - 1)) : end_x; // to the edge of the page
+        const u32 buffer_x = (tile_x - camera.tile_x) * TILE_SIZE;
+        u32 width = (run_end - tile_x + 1) * TILE_SIZE;
+        if (buffer_x + width > camera.buffer_w) width = camera.buffer_w - buffer_x;
+        usize at = (usize)(tile_y & (PAGE_TILES - 1)) * TILE_SIZE * PAGE_PIXELS + (tile_x & (PAGE_TILES - 1)) * TILE_SIZE;
+        const u8 *restrict page_row = terrain_page(map_atlas, tile_x, tile_y) + at * bytes;
+        u8 *restrict buffer_row = (camera.indices ? camera.indices : (u8 *)camera.buffer) + ((usize)buffer_y * camera.buffer_w + buffer_x) * bytes;
+        for (u32 y = 0; y < height; y++, page_row += PAGE_PIXELS * bytes, buffer_row += camera.buffer_w * bytes)
+            memcpy(buffer_row, page_row, width * bytes);
+        tile_x = run_end + 1;
+    }
+}
+#pragma endregion
+
+// the tiles of a chunk the camera sees, inclusive
+struct span { u32 x0, y0, x1, y1; };
+static inline struct span chunk_span(struct camera camera, u32 chunk_x, u32 chunk_y) {
+    struct span span = {chunk_x << CHUNK_SHIFT, chunk_y << CHUNK_SHIFT, (chunk_x << CHUNK_SHIFT) + CHUNK_MASK, (chunk_y << CHUNK_SHIFT) + CHUNK_MASK};
+    if (span.x0 < camera.tile_x) span.x0 = camera.tile_x;
+    if (span.y0 < camera.tile_y) span.y0 = camera.tile_y;
+    if (span.x1 > camera.end_x) span.x1 = camera.end_x;
+    if (span.y1 > camera.end_y) span.y1 = camera.end_y;
+    return span;
+}
+
+// tints a tile a player holds in their colour, the contested ones twice as strong
+static inline void tint_tile(struct camera camera, u32 tile_x, u32 tile_y, u8 tile_zone) {
+    if ((tile_zone & ~ZONE_FRONT) == 0) return; // nobody's
+    u32 color = player_colors[(tile_zone & ~ZONE_FRONT) - 1];
+    u32 buffer_x = (tile_x - camera.tile_x) * TILE_SIZE, buffer_y = (tile_y - camera.tile_y) * TILE_SIZE;
+    u32 width = buffer_x + TILE_SIZE > camera.buffer_w ? camera.buffer_w - buffer_x : TILE_SIZE;
+    u32 height = buffer_y + TILE_SIZE > camera.buffer_h ? camera.buffer_h - buffer_y : TILE_SIZE;
+    if (camera.indices) {
+        const u8 *tint = tint_indices[(tile_zone & ~ZONE_FRONT) - 1][tile_zone & ZONE_FRONT ? 1 : 0];
+        u8 *restrict index_row = camera.indices + buffer_y * camera.buffer_w + buffer_x;
+        for (u32 pixel_y = 0; pixel_y < height; ++pixel_y, index_row += camera.buffer_w)
+            for (u32 pixel_x = 0; pixel_x < width; ++pixel_x) index_row[pixel_x] = tint[index_row[pixel_x]];
+        return;
+    }
+    u32 *restrict row = camera.buffer + buffer_y * camera.buffer_w + buffer_x;
+    for (u32 pixel_y = 0; pixel_y < height; ++pixel_y, row += camera.buffer_w) {
+        for (u32 pixel_x = 0; pixel_x < width; ++pixel_x) {
+            u32 tinted = mix_colors(row[pixel_x], color);
+            row[pixel_x] = tile_zone & ZONE_FRONT ? tinted : mix_colors(row[pixel_x], tinted);
+        }
+    }
+}
+
+#pragma region DIRTY TILES
+// the frame buffer is kept between frames and only the visible tiles that look different from what was drawn on them
+// are redrawn, upscaled and handed to the compositor; when none do, no frame is submitted at all
+#define VIEW_ROWS 32 // visible tiles of the largest buffer, MAX_BUFFER_WIDTH / TILE_SIZE by MAX_BUFFER_HEIGHT / TILE_SIZE
+#define VIEW_COLUMNS 32 // so a row of dirty flags is one u32
+#define IDLE_WAIT_MS 8 // how long the render loop sleeps on window events before looking for a new snapshot again
+#define MAX_ARROW_LENGTH 16
+struct arrow {
+    u8 column, row; // visible tile
+    u8 atlas_index;
+};
+struct frame_tiles {
+    u64 drawn[VIEW_ROWS][VIEW_COLUMNS]; // what each visible tile was drawn with: its unit, zone and arrows, hashed
+    u64 look[VIEW_ROWS][VIEW_COLUMNS]; // the same for the snapshot about to be drawn
+    u32 dirty[VIEW_ROWS]; // a bit per column for the tiles to redraw
+    u32 stale[VIEW_ROWS]; // a bit per column for the tiles whose pixels aren't known: scrolled into view or resized
+    bool scrolled; // the pixels moved, so all of the buffer is presented
+    struct arrow *arrows; // the visible arrows, in draw order
+    u32 arrow_count, arrow_capacity;
+    struct world_snapshot *view; // the snapshot looked at last
+};
+
+static inline void add_arrow(struct camera camera, struct frame_tiles *frame, u32 tile_x, u32 tile_y, u32 atlas_index) {
+    u32 column = tile_x - camera.tile_x, row = tile_y - camera.tile_y;
+    frame->arrows = grow_array(frame->arrows, &frame->arrow_capacity, frame->arrow_count + 1, sizeof(struct arrow), "arrows");
+    frame->arrows[frame->arrow_count++] = (struct arrow){column, row, atlas_index};
+    frame->look[row][column] = (frame->look[row][column] ^ (atlas_index + 1)) * 1099511628211ull; // arrows overlap, so their order counts
+}
+
+static inline void trace_unit_path(struct camera camera, struct frame_tiles *frame, u32 tile_x, u32 tile_y, const u8 *path, u32 length) {
+    for (u32 step_index = 0; step_index < length; ++step_index) {
+        enum directions current_direction = path[step_index];
+        u32 row_index = 0;
+
+        if (step_index + 1 < length) {
+            enum directions next_direction = path[step_index + 1];
+
+            int current_dx = dir_offsets[current_direction].x;
+            int current_dy = dir_offsets[current_direction].y;
+            int next_dx = dir_offsets[next_direction].x;
+            int next_dy = dir_offsets[next_direction].y;
+
+            int dot_product = current_dx * next_dx + current_dy * next_dy;
+            int cross_product = current_dx * next_dy - current_dy * next_dx;
+
+            if (dot_product == 1) {
+                if (cross_product > 0) row_index = 1;
+                else if (cross_product < 0) row_index = 2;
+            } else if (dot_product == 0) {
+                if (cross_product > 0) row_index = 3;
+                else if (cross_product < 0) row_index = 4;
+            }
+        }
+
+        pos delta = dir_offsets[current_direction];
+        tile_x += delta.x;
+        tile_y += delta.y;
+        if (!(tile_x < camera.tile_x || tile_y < camera.tile_y || tile_x > camera.end_x || tile_y > camera.end_y)) {
+            add_arrow(camera, frame, tile_x, tile_y, current_direction + row_index * ATLAS_SIZE);
+        }
+    }
+}
+
+// works out how every visible tile should look: its unit and zone from the chunks the camera overlaps (skipping the
+// ones nobody stood in), then the arrows; a unit's steps are committed together, so they come in one run in path order,
+// and units standing further from the camera than their arrows reach are skipped
+void look_at_view(struct camera camera, struct world_snapshot *view, struct frame_tiles *frame) {
+    for (u32 chunk_y = camera.tile_y >> CHUNK_SHIFT; chunk_y <= camera.end_y >> CHUNK_SHIFT; chunk_y++) {
+        for (u32 chunk_x = camera.tile_x >> CHUNK_SHIFT; chunk_x <= camera.end_x >> CHUNK_SHIFT; chunk_x++) {
+            const u8 *tile_unit = view->tile_unit[chunk_y << grid.column_shift | chunk_x];
+            const u8 *zone = camera.show_influence ? view->zone[chunk_y << grid.column_shift | chunk_x] : NULL;
+            struct span span = chunk_span(camera, chunk_x, chunk_y);
+            for (u32 y = span.y0; y <= span.y1; ++y) {
+                for (u32 x = span.x0; x <= span.x1; ++x) {
+                    u32 index = (y & CHUNK_MASK) << CHUNK_SHIFT | (x & CHUNK_MASK);
+                    u64 unit = tile_unit ? tile_unit[index] : NO_UNIT_TYPE, tile_zone = zone ? zone[index] : 0;
+                    frame->look[y - camera.tile_y][x - camera.tile_x] = (14695981039346656037ull ^ (unit | tile_zone << 8)) * 1099511628211ull; // an FNV basis, so an arrow on unit 0 doesn't hash like a bare unit 2
+                }
+            }
+        }
+    }
+
+    frame->arrow_count = 0;
+    u8 path[MAX_ARROW_LENGTH];
+    u32 length = 0, id = NO_TILE, tile_x = 0, tile_y = 0;
+    bool visible = false;
+    for (u32 step = 0; step <= view->step_count; step++) {
+        if (step == view->step_count || view->steps[step].id != id) { // the run of the previous unit ends here
+            if (visible && length > 0) trace_unit_path(camera, frame, tile_x, tile_y, path, length);
+            if (step == view->step_count) break;
+            id = view->steps[step].id;
+            length = 0;
+            struct unit_view unit = view->units[step_player(view->steps[step])][step_unit(view->steps[step])];
+            tile_x = unit.x, tile_y = unit.y;
+            visible = unit.type != NO_UNIT_TYPE &&
+                      tile_x + MAX_ARROW_LENGTH >= camera.tile_x && tile_x <= camera.end_x + MAX_ARROW_LENGTH &&
+                      tile_y + MAX_ARROW_LENGTH >= camera.tile_y && tile_y <= camera.end_y + MAX_ARROW_LENGTH;
+        }
+        if (visible && length < MAX_ARROW_LENGTH) path[length++] = view->steps[step].dir & 7u;
+    }
+}
+
+// carries what is drawn along with the camera: a scroll by whole tiles moves the pixels already in the buffer, so only the
+// strip it exposes goes stale, a resize or overlay toggle makes everything stale; false if the camera didn't change
+bool follow_camera(struct camera *camera, struct frame_tiles *frame) {
+    i32 dx = camera->scroll_x, dy = camera->scroll_y;
+    bool everything = camera->update;
+    camera->scroll_x = camera->scroll_y = 0;
+    camera->update = 0;
+    if (!everything && dx == 0 && dy == 0) return false;
+
+    i32 columns = camera->end_x - camera->tile_x + 1, rows = camera->end_y - camera->tile_y + 1;
+    if (everything || abs(dx) >= columns || abs(dy) >= rows) {
+        for (u32 row = 0; row < VIEW_ROWS; row++) frame->stale[row] = ~0u;
+        return true;
+    }
+    // a tile at column c, row r now shows what was at c + dx, r + dy; rows are walked away from the ones they're read from.
+    // only tiles the buffer holds whole on both ends are carried, one cut off at its edge is redrawn instead
+    u32 kept_columns = columns - abs(dx), kept_rows = rows - abs(dy);
+    u32 whole_columns = camera->buffer_w / TILE_SIZE, whole_rows = camera->buffer_h / TILE_SIZE;
+    if (kept_columns + abs(dx) > whole_columns) kept_columns = whole_columns > (u32)abs(dx) ? whole_columns - abs(dx) : 0;
+    if (kept_rows + abs(dy) > whole_rows) kept_rows = whole_rows > (u32)abs(dy) ? whole_rows - abs(dy) : 0;
+    u32 to_column = dx < 0 ? -dx : 0, from_column = dx > 0 ? dx : 0, to_row = dy < 0 ? -dy : 0;
+    u32 bytes = camera->indices ? 1 : sizeof(u32), stride = camera->buffer_w * bytes;
+    u8 *pixels = camera->indices ? camera->indices : (u8 *)camera->buffer;
+    for (u32 i = 0; i < kept_rows; i++) {
+        u32 row = dy > 0 ? i : kept_rows - 1 - i + (-dy);
+        memmove(&frame->drawn[row][to_column], &frame->drawn[row + dy][from_column], sizeof(u64) * kept_columns);
+        u8 *to = pixels + row * TILE_SIZE * stride + to_column * TILE_SIZE * bytes;
+        u8 *from = pixels + (row + dy) * TILE_SIZE * stride + from_column * TILE_SIZE * bytes;
+        for (u32 y = 0; y < TILE_SIZE; y++) {
+            u32 pixel_y = dy > 0 ? y : TILE_SIZE - 1 - y;
+            memmove(to + pixel_y * stride, from + pixel_y * stride, bytes * kept_columns * TILE_SIZE);
+        }
+    }
+    u32 kept = ((kept_columns < 32 ? 1u << kept_columns : 0u) - 1) << to_column; // the columns that still show what they did
+    for (u32 row = 0; row < VIEW_ROWS; row++) {
+        bool exposed = row < to_row || row >= to_row + kept_rows;
+        frame->stale[row] |= exposed ? ~0u : ~kept;
+    }
+    frame->scrolled = true;
+    return true;
+}
+
+// flags the tiles that look different from what is drawn on them, or whose pixels aren't known; returns how many
+u32 mark_dirty(struct camera camera, struct frame_tiles *frame) {
+    u32 columns = camera.end_x - camera.tile_x + 1, rows = camera.end_y - camera.tile_y + 1, count = 0;
+    for (u32 row = 0; row < rows; row++) {
+        u32 dirty = 0;
+        for (u32 column = 0; column < columns; column++) {
+            if (!(frame->stale[row] >> column & 1u) && frame->look[row][column] == frame->drawn[row][column]) continue;
+            frame->drawn[row][column] = frame->look[row][column];
+            dirty |= 1u << column;
+        }
+        frame->dirty[row] = dirty;
+        count += __builtin_popcount(dirty);
+    }
+    for (u32 row = rows; row < VIEW_ROWS; row++) frame->dirty[row] = 0;
+    memset(frame->stale, 0, sizeof frame->stale);
+    return count;
+}
+
+// terrain per run of dirty tiles, zone tint and unit per dirty tile, then the arrows that fall on one
+void redraw_dirty(struct camera camera, struct tga map_atlas, struct tga units_atlas, struct tga directions_atlas, struct world_snapshot *view, struct frame_tiles *frame) {
+    for (u32 row = 0; row < VIEW_ROWS; row++) {
+        for (u32 dirty = frame->dirty[row]; dirty;) {
+            u32 first = __builtin_ctz(dirty), length = __builtin_ctz(~(dirty >> first)); // run of set bits
+            draw_terrain_run(camera, map_atlas, camera.tile_x + first, camera.tile_x + first + length - 1, camera.tile_y + row);
+            dirty &= length + first < 32 ? ~0u << (first + length) : 0u;
+        }
+        for (u32 dirty = frame->dirty[row]; dirty; dirty &= dirty - 1) {
+            u32 x = camera.tile_x + __builtin_ctz(dirty), y = camera.tile_y + row, tile = tile_at(x, y);
+            const u8 *zone = view->zone[tile >> CHUNK_BITS], *tile_unit = view->tile_unit[tile >> CHUNK_BITS];
+            if (camera.show_influence && zone) tint_tile(camera, x, y, zone[in_chunk(tile)]);
+            if (tile_unit && tile_unit[in_chunk(tile)] != NO_UNIT_TYPE) draw_unit(camera, units_atlas, y, x, tile_unit[in_chunk(tile)]);
+        }
+    }
+    for (u32 i = 0; i < frame->arrow_count; i++) {
+        struct arrow arrow = frame->arrows[i];
+        if (frame->dirty[arrow.row] >> arrow.column & 1u)
+            draw_step(camera, directions_atlas, arrow.atlas_index, camera.tile_y + arrow.row, camera.tile_x + arrow.column);
+    }
+}
+
+#if DEBUG_FPS
+// frame time against the number of tiles redrawn, printed once a second
+#define DIRTY_BUCKETS 6
+static const u32 dirty_bucket_min[DIRTY_BUCKETS] = {0, 1, 5, 17, 65, 257};
+struct frame_stats {
+    u32 frames[DIRTY_BUCKETS];
+    u64 us[DIRTY_BUCKETS];
+    u32 idle; // wake ups without a new snapshot or input
+    u64 since_us;
+};
+
+void count_frame(struct frame_stats *stats, u32 dirty, u64 us) {
+    u32 bucket = DIRTY_BUCKETS - 1;
+    while (dirty < dirty_bucket_min[bucket]) bucket--;
+    stats->frames[bucket]++;
+    stats->us[bucket] += us;
+    if (elapsed_us(stats->since_us) < 1000000) return;
+    printf("frames: %u idle", stats->idle);
+    for (u32 b = 0; b < DIRTY_BUCKETS; b++) {
+        if (stats->frames[b] == 0) continue;
+        if (b == 0) printf(", %u unchanged %.1f us", stats->frames[b], (f64)stats->us[b] / stats->frames[b]);
+        else printf(", %u with %u+ dirty %.1f us", stats->frames[b], dirty_bucket_min[b], (f64)stats->us[b] / stats->frames[b]);
+    }
+    printf("\n");
+    *stats = (struct frame_stats){.since_us = time_us()};
+}
+#endif
+#pragma endregion
+
+u32 add_unit_to_player(u32 player, enum units unit, u32 x, u32 y, struct unit_list player_units[MAX_PLAYERS]) {
+    // checks zouden al gedaan moeten zijn
+    struct unit_list *list = &player_units[player];
+    u32 id = list->free_count > 0 ? list->free_ids[--list->free_count] : list->count++; // reuse a freed slot first
+    list->units[id] = (struct unit){x, y, unit, id, .generation = list->units[id].generation, .prev_in_stack = NO_UNIT, .next_in_stack = NO_UNIT, .dense_index = list->live};
+    journal_change(CHANGE_UNIT, player, id);
+    journal_change(CHANGE_DENSE, player, list->live);
+    list->dense[list->live++] = id;
+    return id; // return id
+}
+
+void remove_unit_from_player(u32 player, u32 unit_id, struct unit_list player_units[MAX_PLAYERS]) {
+    struct unit_list *list = &player_units[player];
+    u32 last = list->dense[--list->live]; // swap the last live unit into the hole
+    list->dense[list->units[unit_id].dense_index] = last;
+    list->units[last].dense_index = list->units[unit_id].dense_index;
+    list->units[unit_id] = (struct unit){0, 0, -1, -1, .generation = list->units[unit_id].generation + 1, .prev_in_stack = NO_UNIT, .next_in_stack = NO_UNIT};
+    list->free_ids[list->free_count++] = unit_id;
+    journal_change(CHANGE_UNIT, player, unit_id);
+    journal_change(CHANGE_DENSE, player, list->units[last].dense_index);
+}
+
+u32 stack_free_head = NO_STACK; // unused stacks, linked through next_free
+u32 stacks_touched = 0; // stacks from here on were never used and aren't in the free list yet
+// while regions resolve in parallel each one takes stacks from and frees them to its own list, filled beforehand
+u32 *region_stack_head; // by region, allocated with the reservations
+bool region_stacks;
+
+static inline u32 *stack_free_list(u32 tile) { return region_stacks ? &region_stack_head[region_of(tile)] : &stack_free_head; }
+
+// stack for a unit entering the empty tile
+u32 alloc_stack(struct unit_stack *unit_stacks, u32 tile) {
+    u32 *head = stack_free_list(tile);
+    if (*head != NO_STACK) {
+        u32 stack_id = *head;
+        *head = unit_stacks[stack_id].next_free;
+        return stack_id;
+    }
+    if (!region_stacks && stacks_touched < scenario.max_stacks) return stacks_touched++;
+    printf("No free unit stacks left\n");
+    return NO_STACK;
+}
+
+void free_stack(struct unit_stack *unit_stacks, u32 stack_id, u32 tile) {
+    u32 *head = stack_free_list(tile);
+    unit_stacks[stack_id].next_free = *head;
+    *head = stack_id;
+}
+
+i32 add_unit_to_stack(u32 player, u32 unit_id, u32 x, u32 y, struct unit_stack *unit_stacks, u32 stack_id, struct unit_list player_units[MAX_PLAYERS]) {
+    if (stack_id >= scenario.max_stacks) {
+        printf("Invalid stack index %d\n", stack_id);
+        return -1; // Invalid stack
+    }
+    struct unit_stack *stack = &unit_stacks[stack_id];
+    struct unit *unit = &player_units[player].units[unit_id];
+    if (stack->used == 0) {
+        // Initialize stack if not used
+        journal_change(CHANGE_TILE, player, tile_at(x, y)); // appending never changes the drawn unit, a new stack does
+        grid_stack(tile_at(x, y)) = stack_id; // add the unit to the map
+        mark_tile_changed(x, y);
+        *stack = (struct unit_stack){.first_unit = unit_id, .last_unit = unit_id, .next_free = NO_STACK, .player_id = player, .count = 1, .used = 1};
+        spatial_insert(stack_id, tile_at(x, y));
+        influence_changed(stack_id);
+        unit->prev_in_stack = NO_UNIT;
+        unit->next_in_stack = NO_UNIT;
+        return 0; // Stack initialized and unit added misschiens andere return value
+    }
+    if (stack->player_id != player) {
+        printf("Stack %d already occupied by player %d\n", stack_id, stack->player_id);
+        return -2; // Stack already occupied
+    }
+    unit->prev_in_stack = stack->last_unit; // append, the first unit stays the one that is drawn
+    unit->next_in_stack = NO_UNIT;
+    player_units[player].units[stack->last_unit].next_in_stack = unit_id;
+    stack->last_unit = unit_id;
+    stack->count ++;
+    influence_changed(stack_id);
+    return 0; // Unit added successfully
+}
+
+i32 add_unit(u32 player, enum units unit, u32 x, u32 y, struct unit_list player_units[MAX_PLAYERS], struct unit_stack *unit_stacks) {
+    if (player >= scenario.players) {
+        printf("Invalid player index\n");
+        return -1; // Invalid player
+    }
+    if (!on_map(x, y)) {
+        printf("Invalid position (%d, %d)\n", x, y);
+        return -2; // Invalid position
+    }
+    if (player_units[player].live >= scenario.max_units) {
+        // printf("Max units reached for player %d\n", player);
+        return -3; // Max units reached
+    }
+    assert(unit_colors[unit] != 0 && "Unit is invalid, has color & alpha both set to zero");
+    u32 stack_id = grid_stack(tile_at(x, y));
+    if (stack_id != NO_STACK) { // found stack
+        if (unit_stacks[stack_id].player_id != player) {
+            printf("Cannot add unit to stack %d of player %d\n", stack_id, unit_stacks[stack_id].player_id);
+            return -4; // Tile held by another player
+        }
+        u32 unit_id = add_unit_to_player(player, unit, x, y, player_units);
+        return add_unit_to_stack(player, unit_id, x, y, unit_stacks, stack_id, player_units); // Add unit to stack
+    }
+    stack_id = alloc_stack(unit_stacks, tile_at(x, y));
+    if (stack_id == NO_STACK) return -5;
+    u32 unit_id = add_unit_to_player(player, unit, x, y, player_units);
+    return add_unit_to_stack(player, unit_id, x, y, unit_stacks, stack_id, player_units); // Add unit to new stack
+}
+
+i32 remove_unit_from_stack(u32 player, u32 unit_id, struct unit_stack *unit_stacks, struct unit_list player_units[MAX_PLAYERS]) {
+    if (unit_id < 0 || unit_id >= player_units[player].count || player < 0 || player >= scenario.players || player_units[player].units[unit_id].type == -1) {
+        printf("Invalid unit index %d for player %d\n", unit_id, player);
+        return -1; // Invalid unit
+    }
+    
+    struct unit *unit = &player_units[player].units[unit_id];
+    u32 x = unit->x;
+    u32 y = unit->y;
+    u32 stack_id = grid_stack(tile_at(x, y));
+    // printf("Removing unit %d from stack %d, player %d\n", unit_id, stack_id, player);
+    if (stack_id < 0 || stack_id >= scenario.max_stacks) {
+        printf("Invalid stack index\n");
+        return -1; // Invalid stack
+    }
+    struct unit_stack *stack = &unit_stacks[stack_id];
+    if (stack->used == 0 || stack->player_id != player) {
+        printf("Stack %d is not used or not owned by player %d (player: %d)\n", stack_id, player, stack->player_id);
+        return -2; // Stack not used or not owned by player
+    }
+    if (stack->count == 0) {
+        printf("Stack %d is empty\n", stack_id);
+        return -3; // Stack is empty
+    }
+    if (unit->prev_in_stack == NO_UNIT) journal_change(CHANGE_TILE, player, tile_at(x, y)); // the drawn unit leaves
+    // unlink from the stack list
+    if (unit->prev_in_stack != NO_UNIT) player_units[player].units[unit->prev_in_stack].next_in_stack = unit->next_in_stack;
+    else stack->first_unit = unit->next_in_stack;
+    if (unit->next_in_stack != NO_UNIT) player_units[player].units[unit->next_in_stack].prev_in_stack = unit->prev_in_stack;
+    else stack->last_unit = unit->prev_in_stack;
+    unit->prev_in_stack = NO_UNIT;
+    unit->next_in_stack = NO_UNIT;
+    stack->count--; // Decrease stack count
+    influence_changed(stack_id);
+    if (stack->count == 0) {
+        stack->used = 0; // Mark stack as unused
+        stack->player_id = -1; // Clear player id
+        free_stack(unit_stacks, stack_id, tile_at(x, y));
+        grid_stack(tile_at(x, y)) = NO_STACK; // Clear the tile
+        mark_tile_changed(x, y);
+        spatial_remove(stack_id);
     }
     return 0;
 }
 
-i32 remove_unit(u32 player, u32 unit, struct unit_list player_units[PLAYER_COUNT], struct unit_stack unit_stacks[PLAYER_COUNT * MAX_UNITS]) {
-    if (player < 0 || player >= PLAYER_COUNT || unit < 0 || unit >= player_units[player].count) {
+i32 remove_unit(u32 player, u32 unit, struct unit_list player_units[MAX_PLAYERS], struct unit_stack *unit_stacks) {
+    if (player < 0 || player >= scenario.players || unit < 0 || unit >= player_units[player].count) {
         printf("Invalid player or unit index\n");
         return -1; // Invalid player or unit
     }
@@ -707,16 +2162,14 @@ i32 remove_unit(u32 player, u32 unit, struct unit_list player_units[PLAYER_COUNT
         printf("Unit %d of player %d is empty\n", unit, player);
         return -2; // Unit is not active
     }
-    u32 x = player_units[player].units[unit].x;
-    u32 y = player_units[player].units[unit].y;
-    player_units[player].units[unit] = (struct unit){0, 0, -1, -1}; // Clear unit data NO REORDERING
-    remove_unit_from_stack(player, unit, unit_stacks, player_units); // Remove from stack
+    remove_unit_from_stack(player, unit, unit_stacks, player_units); // Remove from stack while the unit still knows where it is
+    remove_unit_from_player(player, unit, player_units); // frees the id, other ids don't move
     return 0; // Unit removed successfully
 }
 
 
 
-i32 move_unit(u32 player, u32 unit, u32 to_x, u32 to_y, struct unit_list player_units[PLAYER_COUNT], struct unit_stack unit_stacks[PLAYER_COUNT * MAX_UNITS]) {
+i32 move_unit(u32 player, u32 unit, u32 to_x, u32 to_y, struct unit_list player_units[MAX_PLAYERS], struct unit_stack *unit_stacks) {
     // printf("Moving unit %d of player %d to (%d, %d)\n", unit, player, to_x, to_y);
     if (!player_units[player].units || unit < 0 || unit >= player_units[player].count) {
         printf("Invalid player or unit index\n");
@@ -726,7 +2179,7 @@ i32 move_unit(u32 player, u32 unit, u32 to_x, u32 to_y, struct unit_list player_
         printf("Unit %d of player %d is empty\n", unit, player);
         return -5; // Unit is not active
     }
-    if (to_x < 0 || to_x >= GRID_W || to_y < 0 || to_y >= GRID_H) {
+    if (!on_map(to_x, to_y)) {
         printf("Invalid move to (%d, %d)\n", to_x, to_y);
         return -2; // Invalid move
     }
@@ -738,142 +2191,421 @@ i32 move_unit(u32 player, u32 unit, u32 to_x, u32 to_y, struct unit_list player_
     u32 from_x = player_units[player].units[unit].x;
     u32 from_y = player_units[player].units[unit].y;
     assert(from_x != to_x || from_y != to_y && "unit moved to same location as before, and created inconsistency\n");
-    if (units.pix[to_y * units.w + to_x] != 0) {
-        u32 stack_id = (units.pix[to_y * units.w + to_x] & 0x00FFFFFF) / 0x08; // STACK ID
-        if (unit_stacks[stack_id].player_id != player) {
-            for (u32 defender = 0; defender < player_units[1 - player].count; defender++) {
-                if (player_units[1 - player].units[defender].x == to_x && player_units[1 - player].units[defender].y == to_y) {
-                    return battle(player, 1 - player, unit, defender, player_units, unit_stacks);
-                }
-            }
+    if (grid_stack(tile_at(to_x, to_y)) != NO_STACK) {
+        u32 stack_id = grid_stack(tile_at(to_x, to_y));
+        if (unit_stacks[stack_id].player_id != player) { // the stack on the tile is the defender, the fight is settled with the bucket's others
+            return engage(player, unit, tile_at(to_x, to_y), player_units);
         }
         else {
             remove_unit_from_stack(player, unit, unit_stacks, player_units); // remove unit from stack at old location
-            add_unit_to_stack(player, player_units[player].units[unit].type, to_x, to_y, unit_stacks, stack_id, unit); // Add unit to stack
+            add_unit_to_stack(player, unit, to_x, to_y, unit_stacks, stack_id, player_units); // Add unit to stack
         }
     }
     else {
+        // a unit that leaves others behind needs a stack of its own before it is detached, one that leaves alone frees
+        // its stack first and gets that one back at worst (a region's groups stay in the region, so on the same list)
+        bool leaves_alone = unit_stacks[grid_stack(tile_at(from_x, from_y))].count == 1;
+        u32 stack_id = leaves_alone ? NO_STACK : alloc_stack(unit_stacks, tile_at(to_x, to_y));
+        if (!leaves_alone && stack_id == NO_STACK) return -6; // no stack left, the unit stays where it is
         remove_unit_from_stack(player, unit, unit_stacks, player_units); // remove unit from stack at old location
-        // find empty slot in stacks
-        for (u32 stack_id = 0; stack_id < PLAYER_COUNT * MAX_UNITS; stack_id ++) {
-            if (unit_stacks[stack_id].used == 0) { // empty stack
-                add_unit_to_stack(player, player_units[player].units[unit].type, to_x, to_y, unit_stacks, stack_id, unit); // Add unit to stack
-                break;
-            }
-        }
+        if (leaves_alone) stack_id = alloc_stack(unit_stacks, tile_at(to_x, to_y));
+        assert(stack_id != NO_STACK && "the stack the unit left wasn't handed back");
+        add_unit_to_stack(player, unit, to_x, to_y, unit_stacks, stack_id, player_units); // Add unit to a fresh stack
     }
     player_units[player].units[unit].x = to_x;
     player_units[player].units[unit].y = to_y;
+    journal_change(CHANGE_UNIT, player, unit);
     // change tile ownership to this player
     enum players to_player = get_player(to_x, to_y);
     if (to_player != player) {
-        players.pix[to_y * players.w + to_x] = player_colors[player]; // Update country color
+        grid_owner(tile_at(to_x, to_y)) = player; // Update country
         u32 income = tile_income[get_tile(to_x, to_y)];
         if (income > 0) {
             printf("player %d conquered city from player %d\n", player, to_player);
-            player_cities[to_player] -= income;
+            if (to_player != -1) player_cities[to_player] -= income; // neutral cities have nobody to lose them
             player_cities[player] += income;
         }
     }
     return 0; // Move successful
 }
 
-i32 resolve_turn(struct unit_list player_units[PLAYER_COUNT], struct resolve_bucket (*resolve_order)[BUCKET_COUNT], struct unit_stack unit_stacks[PLAYER_COUNT * MAX_UNITS]) {
-    printf("Resolving turn...\n");
-    u32 blocked_units[PLAYER_COUNT][MAX_UNITS] = {0}; // keep track of blocked units
-    for (u32 bucket = 0; bucket < BUCKET_COUNT; bucket++) {
-        if ((*resolve_order)[bucket].count == 0) continue; // skip empty buckets
-        // Sort the steps in the bucket by cost MAYBE NEEDED
-        // Execute the steps in the bucket
-        for (u32 step = 0; step < (*resolve_order)[bucket].count; step++) {
-            
-            enum players player = (*resolve_order)[bucket].steps[step].id >> 8; // get player from id
-            u32 unit = (*resolve_order)[bucket].steps[step].id % 256; // get unit from id
-            if (blocked_units[player][unit] || player_units[player].units[unit].type == -1) { continue; } // skip blocked and empty units
-            u8 dir = (*resolve_order)[bucket].steps[step].dir; // get direction from path
-            u32 x = player_units[player].units[unit].x + dir_offsets[dir].x; // calculate x position
-            u32 y = player_units[player].units[unit].y + dir_offsets[dir].y; // calculate y position
-            i32 result = move_unit(player, unit, x, y, player_units, unit_stacks); // move unit
-            if (result != 0) {
-                blocked_units[player][unit] = 1; // mark unit as blocked
-            }
+// per tile reservations of the bucket being resolved, stamped so nothing needs clearing between buckets
+struct reservation_chunk {
+    u32 stamp[CHUNK_TILES];
+    u32 step[CHUNK_TILES]; // a step of the bucket leaving or entering the tile
+};
+struct reservations {
+    struct reservation_chunk **chunks; // by chunk index, allocated the first time a step reserves a tile in the chunk
+    u32 *unit_stamp[MAX_PLAYERS];
+    u32 *unit_tile[MAX_PLAYERS]; // where the unit stands after its steps so far in the bucket
+    u8 *blocked_units[MAX_PLAYERS]; // units that stopped for the rest of the turn
+    u32 generation;
+    u32 *region_start; // slices of by_region, one more than there are regions
+    u32 *region_fill;
+    u32 *region_need; // stacks a region may have to create
+};
+struct reservations reservations;
+#define reserved_step(r, tile) ((r)->chunks[(tile) >> CHUNK_BITS]->step[in_chunk(tile)])
+
+void init_reservations(void) {
+    struct reservations *r = &reservations;
+    r->chunks = arena_alloc(&world_arena, sizeof(struct reservation_chunk *) * grid.chunk_count);
+    for (u32 player = 0; player < scenario.players; player++) {
+        r->unit_stamp[player] = arena_alloc(&world_arena, sizeof(u32) * scenario.max_units);
+        r->unit_tile[player] = arena_alloc(&world_arena, sizeof(u32) * scenario.max_units);
+        r->blocked_units[player] = arena_alloc(&world_arena, scenario.max_units);
+    }
+    r->region_start = arena_alloc(&world_arena, sizeof(u32) * (grid.chunk_count + 1));
+    r->region_fill = arena_alloc(&world_arena, sizeof(u32) * grid.chunk_count);
+    r->region_need = arena_alloc(&world_arena, sizeof(u32) * grid.chunk_count);
+    region_stack_head = arena_alloc(&world_arena, sizeof(u32) * grid.chunk_count);
+}
+
+static inline u32 group_of(struct claim *claims, u32 step) {
+    while (claims[step].parent != step) {
+        claims[step].parent = claims[claims[step].parent].parent; // path halving
+        step = claims[step].parent;
+    }
+    return step;
+}
+
+// puts the step in one group with every earlier step of the bucket on the same tile
+static inline void reserve_tile(struct reservations *r, struct claim *claims, u32 tile, u32 step) {
+    struct reservation_chunk **chunk = &r->chunks[tile >> CHUNK_BITS];
+    if (!*chunk) *chunk = arena_alloc(&world_arena, sizeof(struct reservation_chunk));
+    if ((*chunk)->stamp[in_chunk(tile)] != r->generation) {
+        (*chunk)->stamp[in_chunk(tile)] = r->generation;
+        (*chunk)->step[in_chunk(tile)] = step;
+        return;
+    }
+    u32 a = group_of(claims, (*chunk)->step[in_chunk(tile)]), b = group_of(claims, step);
+    if (a < b) claims[b].parent = a;
+    else if (b < a) claims[a].parent = b;
+}
+
+static inline void resolve_step(struct step step, u8 *blocked_units[MAX_PLAYERS], struct unit_list player_units[MAX_PLAYERS], struct unit_stack *unit_stacks) {
+    enum players player = step_player(step);
+    u32 unit = step_unit(step);
+    if (blocked_units[player][unit] || player_units[player].units[unit].type == -1) { return; } // skip blocked and empty units
+    u32 x = player_units[player].units[unit].x + dir_offsets[step.dir].x; // calculate x position
+    u32 y = player_units[player].units[unit].y + dir_offsets[step.dir].y; // calculate y position
+    i32 result = move_unit(player, unit, x, y, player_units, unit_stacks); // move unit
+    if (result != 0) {
+        blocked_units[player][unit] = 1; // mark unit as blocked
+        if (on_map(x, y)) mark_tile_changed(x, y); // whatever stopped it invalidates paths through there
+    }
+}
+
+struct resolve_job {
+    struct step *steps;
+    struct claim *claims;
+    u32 *by_region;
+    u32 *region_start;
+    u8 **blocked_units;
+    struct unit_list *player_units;
+    struct unit_stack *unit_stacks;
+    _Atomic u32 next; // next region to hand out
+};
+
+void resolve_regions_worker(struct workers *workers, void *job_pointer, u32 index) {
+    struct resolve_job *job = job_pointer;
+    for (;;) {
+        u32 region = atomic_fetch_add(&job->next, 1);
+        if (region >= grid.chunk_count) break;
+        for (u32 i = job->region_start[region]; i < job->region_start[region + 1]; i++) {
+            u32 step = job->by_region[i];
+            resolve_step(job->steps[step], job->blocked_units, job->player_units, job->unit_stacks);
+            job->claims[step].done = true;
         }
-        (*resolve_order)[bucket].count = 0; // reset bucket size
-        memset((*resolve_order)[bucket].steps, 0, sizeof(struct step) * BUCKET_SIZE); // clear resolve order
-        (*resolve_order)[bucket].count = 0; // reset count
     }
+}
 
-    return 0;
+#pragma region BATTLES
+// a unit stepping onto an enemy stack stops there and joins the bucket's batch of engagements; after the bucket the
+// batch is settled in three passes: strength sums per attacked tile from the state the bucket left (serial), the dice
+// and outcomes (pure, over flat arrays, on the workers) and the results in commit order (serial); the dice come from a
+// counter-based generator keyed by seed, turn, tile and attacker, so the outcome never depends on threads or timing
+#define BATTLE_CHUNK 1024 // engagements rolled per work item
+enum outcomes { ATTACKER_WINS = 1, DEFENDER_WINS = 2, DRAW = 3 };
+u32 battle_seed = 1; // set by the headless runner, replays need the same one
+u32 turn_number = 0; // resolves so far, part of every dice key
+
+struct battles {
+    u32 count, capacity;
+    u32 *tile; // attacked tile
+    u32 *attacker; // STEP_ID of the attacking unit
+    u32 *attack, *defence; // strength sums of every attacker of the tile and of the stack on it, terrain included
+    u8 *outcome;
+    u64 *by_tile; // row-major tile << 32 | engagement, to sum up the attackers of a tile
+};
+struct battles battles;
+
+i32 engage(u32 player, u32 unit, u32 tile, struct unit_list player_units[MAX_PLAYERS]) {
+    struct battles *b = &battles;
+    if (b->count == b->capacity) {
+        b->capacity = b->capacity ? b->capacity * 2 : 256;
+        b->tile = realloc(b->tile, sizeof(u32) * b->capacity);
+        b->attacker = realloc(b->attacker, sizeof(u32) * b->capacity);
+        b->attack = realloc(b->attack, sizeof(u32) * b->capacity);
+        b->defence = realloc(b->defence, sizeof(u32) * b->capacity);
+        b->outcome = realloc(b->outcome, b->capacity);
+        b->by_tile = realloc(b->by_tile, sizeof(u64) * b->capacity);
+        if (!b->tile || !b->attacker || !b->attack || !b->defence || !b->outcome || !b->by_tile) { fprintf(stderr, "OOM: battles\n"); exit(1); }
+    }
+    b->tile[b->count] = tile;
+    b->attacker[b->count] = STEP_ID(player, unit);
+    b->count++;
+    return DRAW; // stops the unit for the rest of the turn, whatever the dice say
 }
 
-i32 battle(u32 attacker, u32 defender, u32 unit_att, u32 unit_def, struct unit_list player_units[PLAYER_COUNT], struct unit_stack unit_stacks[PLAYER_COUNT * MAX_UNITS]) {
-    if (attacker < 0 || attacker >= PLAYER_COUNT || defender < 0 || defender >= PLAYER_COUNT) {
-        printf("Invalid player index\n");
-        return -1; // Invalid player
+// counter-based: the same key always gives the same 32 bits, no state is shared (splitmix64 finaliser)
+static inline u32 dice(u32 seed, u32 turn, u32 tile, u32 attacker) {
+    u64 z = ((u64)seed << 32 | turn) * 0x9E3779B97F4A7C15ull ^ ((u64)tile << 32 | attacker);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return (u32)((z ^ (z >> 31)) >> 32);
+}
+
+// the attackers win one in two times their share of the total strength, the defenders the same, the rest is a draw
+static inline u8 battle_outcome(u32 attack, u32 defence, u32 roll) {
+    u32 total = attack + defence ? attack + defence : 1;
+    u32 share = (u32)((u64)attack * 65536 / total); // attacker share, 16 bits
+    u32 r = roll >> 16;
+    return r < share / 2 ? ATTACKER_WINS : r >= 65536 - (65536 - share) / 2 ? DEFENDER_WINS : DRAW;
+}
+
+struct roll_job {
+    struct battles *battles;
+    u32 seed, turn;
+    _Atomic u32 next;
+};
+
+void roll_battles_worker(struct workers *workers, void *job_pointer, u32 index) {
+    struct roll_job *job = job_pointer;
+    struct battles *b = job->battles;
+    for (;;) {
+        u32 begin = atomic_fetch_add(&job->next, BATTLE_CHUNK);
+        if (begin >= b->count) break;
+        u32 end = begin + BATTLE_CHUNK < b->count ? begin + BATTLE_CHUNK : b->count;
+        for (u32 i = begin; i < end; i++)
+            b->outcome[i] = battle_outcome(b->attack[i], b->defence[i], dice(job->seed, job->turn, row_major(b->tile[i]), b->attacker[i]));
     }
-    if (unit_att < 0 || unit_att >= player_units[attacker].count || unit_def < 0 || unit_def >= player_units[defender].count) {
-        printf("Invalid unit index\n");
-        return -2; // Invalid unit
+}
+
+// outcomes of every engagement from its strengths, the same for any thread count
+void roll_battles(struct workers *workers, struct battles *b, u32 seed, u32 turn) {
+    struct roll_job job = {b, seed, turn};
+    if (b->count <= BATTLE_CHUNK) roll_battles_worker(workers, &job, 0); // not worth waking the threads
+    else run_workers(workers, roll_battles_worker, &job);
+}
+
+static int compare_u64(const void *a, const void *b) {
+    u64 x = *(const u64 *)a, y = *(const u64 *)b;
+    return (x > y) - (x < y);
+}
+
+// sums the strength of every attacker of a tile and of the stack on it, a stack that left the tile defends nothing
+void sum_strengths(struct battles *b, struct unit_list player_units[MAX_PLAYERS], struct unit_stack *unit_stacks) {
+    for (u32 i = 0; i < b->count; i++) b->by_tile[i] = (u64)row_major(b->tile[i]) << 32 | i;
+    qsort(b->by_tile, b->count, sizeof(u64), compare_u64);
+    for (u32 first = 0, last; first < b->count; first = last) {
+        u32 tile = b->tile[(u32)b->by_tile[first]], attack = 0, defence = 0;
+        for (last = first; last < b->count && b->tile[(u32)b->by_tile[last]] == tile; last++) {
+            u32 attacker = b->attacker[(u32)b->by_tile[last]];
+            attack += unit_strength[player_units[attacker >> 16].units[attacker & 0xFFFF].type];
+        }
+        u32 stack_id = grid_stack(tile);
+        if (stack_id != NO_STACK) {
+            struct unit *units = player_units[unit_stacks[stack_id].player_id].units;
+            for (u32 unit = unit_stacks[stack_id].first_unit; unit != NO_UNIT; unit = units[unit].next_in_stack)
+                defence += unit_strength[units[unit].type] * movement_cost[units[unit].type][grid_terrain(tile)] / 100; // slow ground is good cover
+        }
+        for (u32 i = first; i < last; i++) {
+            b->attack[(u32)b->by_tile[i]] = attack;
+            b->defence[(u32)b->by_tile[i]] = defence;
+        }
     }
-    if (player_units[attacker].units[unit_att].type == -1 || player_units[defender].units[unit_def].type == -1) {
-        printf("empty units\n");
-        return -2; // Unit is not active
+}
+
+// a won fight takes the first unit of the stack and moves the attacker in once the tile is empty, a lost one costs the
+// attacker; every engagement is looked at in commit order and skips what earlier ones already changed
+void apply_battles(struct battles *b, struct unit_list player_units[MAX_PLAYERS], struct unit_stack *unit_stacks) {
+    for (u32 i = 0; i < b->count; i++) {
+        u32 player = b->attacker[i] >> 16, unit = b->attacker[i] & 0xFFFF, tile = b->tile[i];
+        struct unit *attacker = &player_units[player].units[unit];
+        if (attacker->type == -1 || b->outcome[i] == DRAW) continue; // fell in an earlier fight of the batch
+        if (b->outcome[i] == DEFENDER_WINS) {
+            remove_unit(player, unit, player_units, unit_stacks);
+            continue;
+        }
+        u32 stack_id = grid_stack(tile);
+        if (stack_id != NO_STACK && unit_stacks[stack_id].player_id != player)
+            remove_unit(unit_stacks[stack_id].player_id, unit_stacks[stack_id].first_unit, player_units, unit_stacks);
+        if (grid_stack(tile) == NO_STACK && (abs((i32)attacker->x - (i32)tile_x(tile)) <= 1 && abs((i32)attacker->y - (i32)tile_y(tile)) <= 1))
+            move_unit(player, unit, tile_x(tile), tile_y(tile), player_units, unit_stacks);
+        mark_tile_changed(tile_x(tile), tile_y(tile));
+    }
+}
+
+// settles the engagements of the bucket that was just resolved
+void resolve_battles(struct unit_list player_units[MAX_PLAYERS], struct unit_stack *unit_stacks) {
+    if (battles.count == 0) return;
+    sum_strengths(&battles, player_units, unit_stacks);
+    roll_battles(&workers, &battles, battle_seed, turn_number);
+    apply_battles(&battles, player_units, unit_stacks);
+    battles.count = 0;
+}
+#pragma endregion
+
+// steps are resolved bucket by bucket in order of cumulative cost, within a bucket in commit order. steps that share
+// a tile form a group; groups share no tiles, so they can't influence each other and each one only has to keep its
+// own commit order. a group of one player that stays inside one region and has no enemy on any tile it enters can't
+// fight, so it touches nothing outside its region: those are resolved per region on the workers, the rest after them
+// in commit order. every thread count does exactly the same work, and the units end up where the plain commit order
+// puts them
+i32 resolve_turn(struct unit_list player_units[MAX_PLAYERS], struct resolve_order *order, struct unit_stack *unit_stacks) {
+    #if !HEADLESS
+    printf("Resolving turn...\n");
+    #endif
+    turn_number++;
+    struct reservations *r = &reservations;
+    u8 **blocked_units = r->blocked_units; // keep track of blocked units
+    for (u32 player = 0; player < scenario.players; player++) memset(blocked_units[player], 0, scenario.max_units);
+    // radix sort on the bucket, stable so a bucket keeps the commit order
+    u32 bucket_start[scenario.bucket_count + 1];
+    memset(bucket_start, 0, sizeof(bucket_start));
+    for (u32 step = 0; step < order->count; step++) bucket_start[step_bucket(order->steps[step]) + 1]++;
+    for (u32 bucket = 0; bucket < scenario.bucket_count; bucket++) bucket_start[bucket + 1] += bucket_start[bucket];
+    u32 fill[scenario.bucket_count];
+    memcpy(fill, bucket_start, sizeof(fill));
+    for (u32 step = 0; step < order->count; step++) order->sorted[fill[step_bucket(order->steps[step])]++] = order->steps[step];
+
+    for (u32 bucket = 0; bucket < scenario.bucket_count; bucket++) {
+        struct step *steps = order->sorted + bucket_start[bucket];
+        struct claim *claims = order->claims + bucket_start[bucket];
+        u32 count = bucket_start[bucket + 1] - bucket_start[bucket];
+        if (count == 0) continue; // skip empty buckets
+        if (++r->generation == 0) { // stamps wrapped around, clear them once
+            for (u32 chunk = 0; chunk < grid.chunk_count; chunk++)
+                if (r->chunks[chunk]) memset(r->chunks[chunk]->stamp, 0, sizeof(r->chunks[chunk]->stamp));
+            for (u32 player = 0; player < scenario.players; player++) memset(r->unit_stamp[player], 0, sizeof(u32) * scenario.max_units);
+            r->generation = 1;
+        }
+        // reserve the tiles every step leaves and enters, grouping the steps that meet
+        for (u32 step = 0; step < count; step++) {
+            u32 player = step_player(steps[step]), unit = step_unit(steps[step]);
+            struct unit *moving = &player_units[player].units[unit];
+            claims[step] = (struct claim){NO_TILE, NO_TILE, step, NO_REGION, player};
+            if (blocked_units[player][unit] || moving->type == -1) continue; // won't move
+            if (r->unit_stamp[player][unit] != r->generation) {
+                r->unit_stamp[player][unit] = r->generation;
+                r->unit_tile[player][unit] = tile_at(moving->x, moving->y);
+            }
+            u32 from = r->unit_tile[player][unit];
+            u32 to_x = tile_x(from) + dir_offsets[steps[step].dir].x, to_y = tile_y(from) + dir_offsets[steps[step].dir].y;
+            u32 to = on_map(to_x, to_y) ? tile_at(to_x, to_y) : NO_TILE;
+            claims[step].from = from;
+            reserve_tile(r, claims, from, step);
+            if (to == NO_TILE) continue; // move_unit refuses it, serially
+            claims[step].to = to;
+            claims[step].region = region_of(from);
+            reserve_tile(r, claims, to, step);
+            r->unit_tile[player][unit] = to;
+        }
+        // a group stays in its root's region only if every step agrees
+        for (u32 step = 0; step < count; step++) {
+            struct claim *claim = &claims[step];
+            if (claim->from == NO_TILE) continue;
+            struct claim *root = &claims[group_of(claims, step)];
+            if (claim->region != root->region || region_of(claim->to) != root->region || claim->player != root->player ||
+                tile_blocked(claim->to, claim->player, unit_stacks)) root->region = NO_REGION;
+        }
+        memset(r->region_start, 0, sizeof(u32) * (grid.chunk_count + 1));
+        memset(r->region_need, 0, sizeof(u32) * grid.chunk_count);
+        for (u32 step = 0; step < count; step++) {
+            if (claims[step].from == NO_TILE) continue;
+            u32 region = claims[group_of(claims, step)].region;
+            claims[step].region = region; // every step knows its group's region from here on
+            if (region == NO_REGION) continue;
+            r->region_start[region + 1]++;
+            // no unit enters or leaves the tiles of a region's groups from outside, so they never hold more stacks
+            // than units: the region needs at most one stack per unit beyond the first on each tile
+            u32 tiles[2] = {claims[step].from, claims[step].to};
+            for (u32 i = 0; i < 2; i++) {
+                if (reserved_step(r, tiles[i]) != step || grid_stack(tiles[i]) == NO_STACK) continue; // counted by an earlier step or empty
+                r->region_need[region] += unit_stacks[grid_stack(tiles[i])].count - 1;
+            }
+        }
+        // hand every region the stacks it may need, the free stacks always cover it as there are never more stacks
+        // than units; should a region still come up short it is resolved serially
+        bool any_region = false;
+        for (u32 region = 0; region < grid.chunk_count; region++) {
+            region_stack_head[region] = NO_STACK;
+            if (r->region_start[region + 1] == 0) continue;
+            for (u32 i = 0; i < r->region_need[region]; i++) {
+                if (stack_free_head == NO_STACK && stacks_touched == scenario.max_stacks) { r->region_start[region + 1] = 0; break; }
+                u32 stack_id = alloc_stack(unit_stacks, NO_TILE);
+                unit_stacks[stack_id].next_free = region_stack_head[region];
+                region_stack_head[region] = stack_id;
+            }
+            any_region |= r->region_start[region + 1] != 0;
+        }
+        if (any_region) {
+            for (u32 region = 0; region < grid.chunk_count; region++) r->region_start[region + 1] += r->region_start[region];
+            u32 *region_fill = r->region_fill;
+            memcpy(region_fill, r->region_start, sizeof(u32) * grid.chunk_count);
+            for (u32 step = 0; step < count; step++) {
+                u32 region = claims[step].region;
+                if (claims[step].from == NO_TILE || region == NO_REGION || r->region_start[region + 1] == r->region_start[region]) continue;
+                order->by_region[region_fill[region]++] = step;
+            }
+            struct resolve_job job = {steps, claims, order->by_region, r->region_start, blocked_units, player_units, unit_stacks};
+            region_stacks = true;
+            run_workers(&workers, resolve_regions_worker, &job);
+            region_stacks = false;
+        }
+        for (u32 region = 0; region < grid.chunk_count; region++) { // unused and freed stacks go back, in a fixed order
+            while (region_stack_head[region] != NO_STACK) {
+                u32 stack_id = region_stack_head[region];
+                region_stack_head[region] = unit_stacks[stack_id].next_free;
+                free_stack(unit_stacks, stack_id, NO_TILE);
+            }
+        }
+        // the groups that cross regions, fight or meet other players, in commit order
+        for (u32 step = 0; step < count; step++) {
+            if (claims[step].done) continue;
+            resolve_step(steps[step], blocked_units, player_units, unit_stacks);
+        }
+        resolve_battles(player_units, unit_stacks);
     }
-    u32 x_att = player_units[attacker].units[unit_att].x;
-    u32 y_att = player_units[attacker].units[unit_att].y;
-    u32 x_def = player_units[defender].units[unit_def].x;
-    u32 y_def = player_units[defender].units[unit_def].y;
-    if (abs(x_att - x_def) > 1 || abs(y_att - y_def) > 1) {
-        printf("Units not adjacent\n");
-        return -3; // Units not adjacent
-    }
-    return 3; // force draw
-    i32 random = rand() % 20; // Random number between 0 and 5
-    if (random == 20) { // Attacker wins 1/3
-        //printf("Attacker wins!\n");
-        remove_unit(defender, unit_def, player_units, unit_stacks); // Remove defender unit
-        move_unit(attacker, unit_att, x_def, y_def, player_units, unit_stacks); // Move attacker to defender position
-        return 1; // Attacker wins
-    } else if (random < 3) { // Defender wins 1/3
-        //printf("Defender wins!\n"); // Defender wins 2/3
-        remove_unit(attacker, unit_att, player_units, unit_stacks); // Remove attacker unit
-        return 2; // Defender wins
-    } else { // Draw 1/3
-        //printf("Draw!\n");
-        return 3; // Draw
-    }
-    return 0; // something went wrong
-}
-
-i32 commit_turn(enum players player, struct unit_list player_units[PLAYER_COUNT], struct resolve_bucket (*resolve_order)[BUCKET_COUNT], struct path (*player_paths)[PLAYER_COUNT][MAX_UNITS]) {
-    if (player < 0 || player >= PLAYER_COUNT) {
+    order->count = 0; // orders are used up
+
+    return 0;
+}
+
+i32 commit_turn(enum players player, struct unit_list player_units[MAX_PLAYERS], struct resolve_order *resolve_order, struct path **player_paths) {
+    if (player < 0 || player >= scenario.players) {
         printf("Invalid player index\n");
         return -1; // Invalid player
     }
     // Resolve all paths for the player
     for (u32 unit = 0; unit < player_units[player].count; ++unit) {
-        if ((*player_paths)[player][unit].length == 0) {continue;} // skip empty paths
+        if (player_paths[player][unit].length == 0) {continue;} // skip empty paths
         u32 cost = 0; // cost is cummulative
         u32 x = player_units[player].units[unit].x;
         u32 y = player_units[player].units[unit].y;
-        for (u32 step = 0; step < (*player_paths)[player][unit].length; ++step) {
+        for (u32 step = 0; step < player_paths[player][unit].length; ++step) {
             // calculate cost of the step
-            x = x + dir_offsets[(*player_paths)[player][unit].steps[step]].x;
-            y = y + dir_offsets[(*player_paths)[player][unit].steps[step]].y;
+            x = x + dir_offsets[player_paths[player][unit].steps[step]].x;
+            y = y + dir_offsets[player_paths[player][unit].steps[step]].y;
             u32 tile = get_tile(x, y);
             cost += movement_cost[player_units[player].units[unit].type][tile]; // tile cost
-            if (cost > 400) { break; } // max cost
-            u32 bucket = cost / 100; // bucket for the step
-            if ((*resolve_order)[bucket].count >= BUCKET_SIZE) {
-                printf("Bucket %d is full, skipping remaining steps\n", bucket);
-                continue;
-            }
-            (*resolve_order)[bucket].steps[(*resolve_order)[bucket].count] = (struct step){
-                .dir = (*player_paths)[player][unit].steps[step] , // direction of the step
-                .cost = cost, // cost of the step
-                .id = (u16)(unit + (player << 8)) // unit id + player id
-            };
-            (*resolve_order)[bucket].count ++; // increment bucket size
+            if (cost > scenario.move_budget) { break; } // max cost
+            push_step(resolve_order, (struct step){
+                .dir = player_paths[player][unit].steps[step] , // direction of the step
+                .cost = cost, // cost of the step, resolve_turn buckets on it
+                .id = STEP_ID(player, unit)
+            });
         }
     }
     // printf("Player %d committed turn with %d units\n", player, player_unit_count[player]);
@@ -910,69 +2642,31 @@ i32 move_towards(u32 player, u32 unit, u32 target_x, u32 target_y) {
     return result;
 } */
 
-void find_front(u32 player, u32 center_x, u32 center_y, struct unit *front_units, u32 *count, struct unit_list player_units[PLAYER_COUNT]) {
-    if (player < 0 || player >= PLAYER_COUNT) {
-        printf("Invalid player index\n");
-        return; // Invalid player
-    }
-    for (u32 unit = 0; unit < player_units[player].count; unit++) {
-        if (player_units[player].units[unit].type == -1) continue; // skip empty unit slots
-        u32 x = player_units[player].units[unit].x;
-        u32 y = player_units[player].units[unit].y;
-        if (*count >= MAX_UNITS) {
-            printf("Front units array full\n");
-            return; // Front units array full
-        }
-        else {
-            front_units[*count] = player_units[player].units[unit];
-            (*count)++;
-        }
-    }
-    return;
-}
-
 // UNUSED
-i32 find_target(u32 player, u32 unit, struct unit *target, struct unit_list player_units[PLAYER_COUNT]) {
-    if (player < 0 || player >= PLAYER_COUNT || unit < 0 || unit >= player_units[player].count) {
+i32 find_target(u32 player, u32 unit, struct unit *target, struct unit_list player_units[MAX_PLAYERS], struct unit_stack *unit_stacks) {
+    if (player < 0 || player >= scenario.players || unit < 0 || unit >= player_units[player].count) {
         printf("Invalid player or unit index\n");
         return -1; // Invalid player or unit
     }
     u32 x = player_units[player].units[unit].x;
     u32 y = player_units[player].units[unit].y;
-    if ((units.pix[y * units.w + x+1] != 0 && units.pix[y * units.w + x+1] != player_colors[player]) && x+1 < GRID_W) {
-        target->type = 1; target->x = x+1; target->y = y;
-        printf("Target found at (%d, %d) for player %d\n", x, y, player);
-        return 1; // Return target x coordinate
-    }
-    if ((units.pix[y * units.w + x-1] != 0 && units.pix[y * units.w + x-1] != player_colors[player]) && x-1 >= 0) {
-        target->type = 1; target->x = x-1; target->y = y;
-        printf("Target found at (%d, %d) for player %d\n", x, y, player);
-        return 1; // Return target x coordinate
-    }
-    if ((units.pix[(y+1) * units.w + x] != 0 && units.pix[(y+1) * units.w + x] != player_colors[player]) && y+1 < GRID_H) {
-        target->type = 1; target->x = x; target->y = y+1;
-        printf("Target found at (%d, %d) for player %d\n", x, y, player);
-        return 1; // Return target x coordinate
-    }
-    if ((units.pix[(y-1) * units.w + x] != 0 && units.pix[(y-1) * units.w + x] != player_colors[player]) && y-1 >= 0) {
-        target->type = 1; target->x = x; target->y = y-1;
-        printf("Target found at (%d, %d) for player %d\n", x, y, player);
-        return 1; // Return target x coordinate
-    }
-    return 0; // No target found
+    u32 stack_id = spatial_adjacent_enemy(x, y, player, unit_stacks);
+    if (stack_id == NO_STACK) return 0; // No target found
+    target->type = 1; target->x = tile_x(spatial.tile[stack_id]); target->y = tile_y(spatial.tile[stack_id]);
+    printf("Target found at (%d, %d) for player %d\n", x, y, player);
+    return 1;
 }
 
-i32 spawn_unit(enum players player, struct unit_list player_units[PLAYER_COUNT], struct unit_stack unit_stacks[PLAYER_COUNT * MAX_UNITS]) {
+i32 spawn_unit(enum players player, struct unit_list player_units[MAX_PLAYERS], struct unit_stack *unit_stacks) {
     // try to spawn around a unit
-    for (u32 unit_id = 0; unit_id < player_units[player].count; unit_id++) {
-        if (player_units[player].units[unit_id].type == -1) continue; // skip empty unit slots
-        struct unit unit = player_units[player].units[unit_id];
+    for (u32 live = 0; live < player_units[player].live; live++) {
+        struct unit unit = player_units[player].units[player_units[player].dense[live]];
         for (u32 dir = 0; dir < DIRECTIONS_COUNT; dir++) {
             u32 spawn_x = unit.x + dir_offsets[dir].x;
             u32 spawn_y = unit.y + dir_offsets[dir].y;
-            if (spawn_y >= 0 && spawn_x >= 0 && spawn_y < units.w && spawn_x < units.w) {
-                bool has_unit = units.pix[spawn_y * units.w + spawn_x] != 0;
-                bool is_sea = map.pix[spawn_y * map.w + spawn_x] == SEA;
+            if (on_map(spawn_x, spawn_y)) {
+                bool has_unit = grid_stack(tile_at(spawn_x, spawn_y)) != NO_STACK;
+                bool is_sea = grid_terrain(tile_at(spawn_x, spawn_y)) == SEA;
                 if (!has_unit && !is_sea && get_player(spawn_x, spawn_y) == player) {
                     i32 result = add_unit(player, INFANTRY, spawn_x, spawn_y, player_units, unit_stacks);
                     if (result == 0) {
@@ -987,68 +2681,70 @@ i32 spawn_unit(enum players player, struct unit_list player_units[PLAYER_COUNT],
     return -1;
 }
 
-i32 ai_unit_movement(enum players player, struct unit_list player_units[PLAYER_COUNT], struct path (*player_paths)[PLAYER_COUNT][MAX_UNITS], struct resolve_bucket (*resolve_order)[BUCKET_COUNT], struct unit_stack unit_stacks[PLAYER_COUNT * MAX_UNITS]) {
-    // AI logic to move units towards enemy units
-    if (player < 0 || player >= PLAYER_COUNT) {
-        printf("Invalid player index\n");
-        return -1; // Invalid player
-    }
-    // unit movement
-    struct unit front_units[MAX_UNITS];
-    u32 count = 0;
-    find_front(1 - player, 0, 0, front_units, &count, player_units); // Get front units for other player
-    for (u32 unit = 0; unit < player_units[player].count; unit++) {
-        if ((*player_paths)[player][unit].steps == NULL) printf("steps pointer is NULL!\n"); // should not happen
-        memset((*player_paths)[player][unit].steps, 0, sizeof((*player_paths)[player][unit].steps)); // clear array
-        (*player_paths)[player][unit].length = 0;
-        if (player_units[player].units[unit].type == -1) continue; // skip empty unit slots
-        u32 x = player_units[player].units[unit].x;
-        u32 y = player_units[player].units[unit].y;
-        u32 distance = 2500;
-        struct unit target = {0};
-        bool found_target = false;
-        for (u32 enemy = 0; enemy < count; enemy++) {
-            u32 dis = (front_units[enemy].x - x) * (front_units[enemy].x - x) +
-                        (front_units[enemy].y - y) * (front_units[enemy].y - y);
-            if (dis < distance) {
-                distance = dis;
-                target = front_units[enemy];
-                found_target = true;
-            }
-        }
-        if (!found_target) {
-            // No target found, skip this unit
-            printf("No target found for player %d unit %d at (%d, %d)\n", player, unit, x, y);
-        }
-        u8 path[GRID_W + GRID_H];
-        u32 path_length = 0;
-        i32 result = 0;
-        if (found_target) {
-            result = pathing(x, y, target.x, target.y, path, &path_length, 1, player, unit_stacks); // Get path to target UNIT_TYPE
-            if (result == 1) {
-                (*player_paths)[player][unit].length = path_length;
-                for (u32 step = 0; step < path_length; step++) {
-                    (*player_paths)[player][unit].steps[step] = path[path_length - step - 1];
-                    //printf("Step added %d: (%d, %d)\n", step, player_paths[player][unit].steps[step].x, player_paths[player][unit].steps[step].y);
-                }
-            }
-            else {
-                (*player_paths)[player][unit].length = 0; // No path found
-                //printf("No steps: (%d, %d)\n", player_paths[player][unit].steps[0].x, player_paths[player][unit].steps[0].y);
-            }
-        }
-        else {
-            (*player_paths)[player][unit].length = 0; // No path found
-            //printf("No steps: (%d, %d)\n", player_paths[player][unit].steps[0].x, player_paths[player][unit].steps[0].y);
+// the planning of a turn as a small state machine, so the script can spread it over as many ticks as it needs: every
+// stage hands out its work through an atomic counter and stops taking more once the tick's deadline passed. planning
+// only reads the world and nothing else changes it until the turn is committed, so slicing never changes the result
+enum ai_stages { AI_IDLE, AI_FLOW_FIELDS, AI_PLAN, AI_DONE };
+struct ai_turn {
+    enum ai_stages stage;
+    struct plan_job job;
+    struct flow_job flow_job;
+    struct search flow_fields[MAX_PLAYERS]; // flow field mode only
+    struct resolve_order *resolve_order;
+    u32 ticks; // continue_ai_turn calls the turn took so far
+};
+struct ai_turn ai_turn;
+
+void begin_ai_turn(struct ai_turn *ai, struct unit_list player_units[MAX_PLAYERS], struct path **player_paths, struct resolve_order *resolve_order, struct unit_stack *unit_stacks) {
+    for (u32 player = 0; player < scenario.players; player++) {
+        for (u32 unit = 0; unit < player_units[player].count; unit++) {
+            player_paths[player][unit].length = 0; // clear array, the steps stay allocated
         }
     }
-    commit_turn(player, player_units, resolve_order, player_paths); // Commit the turn for the AI player
+    ai->job = (struct plan_job){scenario.players, player_units, player_paths, unit_stacks};
+    ai->flow_job = (struct flow_job){ai->flow_fields, unit_stacks, stacks_touched};
+    ai->resolve_order = resolve_order;
+    ai->ticks = 0;
+    #if AI_FLOW_FIELD
+    ai->stage = AI_FLOW_FIELDS;
+    #else
+    queue_plan_units(&ai->job);
+    ai->stage = AI_PLAN;
+    #endif
+}
+
+// works on the turn until it is planned or the deadline passed (0 for no limit); true once every player's moves are
+// planned and committed in player order
+bool continue_ai_turn(struct ai_turn *ai, u64 deadline_us) {
+    ai->ticks++;
+    if (ai->stage == AI_FLOW_FIELDS) {
+        ai->flow_job.deadline_us = deadline_us;
+        run_workers(&workers, build_flow_fields_worker, &ai->flow_job);
+        if (!flow_fields_done(&ai->flow_job)) return false;
+        ai->job.flow_fields = ai->flow_fields;
+        queue_plan_units(&ai->job);
+        ai->stage = AI_PLAN;
+    }
+    if (ai->stage == AI_PLAN) {
+        ai->job.deadline_us = deadline_us;
+        if (!run_plan_units(&workers, &ai->job)) return false; // read-only on the shared state, the paths are merged in unit id order below
+        for (u32 player = 0; player < scenario.players; player++)
+            commit_turn(player, ai->job.player_units, ai->resolve_order, ai->job.player_paths); // Commit the turn for the AI player
+        ai->stage = AI_DONE;
+    }
+    return ai->stage == AI_DONE;
+}
+
+// plans the units of every player at once and commits them in player order, in one go
+i32 ai_unit_movement(struct unit_list player_units[MAX_PLAYERS], struct path **player_paths, struct resolve_order *resolve_order, struct unit_stack *unit_stacks) {
+    begin_ai_turn(&ai_turn, player_units, player_paths, resolve_order, unit_stacks);
+    continue_ai_turn(&ai_turn, 0);
     return 0; // AI movement done
 }
 
-void player_turn(enum players player, struct unit_list player_units[PLAYER_COUNT], struct path (*player_paths)[PLAYER_COUNT][MAX_UNITS], struct resolve_bucket (*resolve_order)[BUCKET_COUNT], struct unit_stack unit_stacks[PLAYER_COUNT * MAX_UNITS]) {
+void player_turn(enum players player, struct unit_list player_units[MAX_PLAYERS], struct unit_stack *unit_stacks) {
     // verify that the player exists in the player enum
-    if (player < 0 || player >= PLAYER_COUNT) {
+    if (player < 0 || player >= scenario.players) {
         printf("Invalid player index\n");
         return; // Invalid player
     }
@@ -1064,50 +2760,395 @@ void player_turn(enum players player, struct unit_list player_units[PLAYER_COUNT
         if (spawn_unit(player, player_units, unit_stacks) == -1) 
             player_money[player] += UNIT_COST; // refund if cannot be spawned anywhere
     }
-    
-    ai_unit_movement(player, player_units, player_paths, resolve_order, unit_stacks); // BIK
+}
+
+#pragma region ROLLOUTS
+// a copy of (a window of) the world small enough to clone thousands of times a second for lookahead: one block
+// without pointers, everything is found through offsets from its start, so a clone is one memcpy and a block can be
+// moved or handed to another thread as is. sim_turn is resolve_turn without paths, snapshots, journal or printing:
+// every unit walks greedily towards its target tile and the fights use the same strengths and dice as battles
+#define SIM_NO_UNIT 0xFFFF
+#define SIM_DEAD 0xFF
+#define CITY_SCORE 20 // a city weighs as much as two infantry
+struct sim_unit {
+    u32 tile; // row-major in the window
+    u32 target; // tile the unit walks towards
+    u16 next; // next unit on the same tile, SIM_NO_UNIT at the end
+    u8 type; // SIM_DEAD once it lost a fight
+    u8 player;
+};
+struct sim_world {
+    u32 bytes; // size of the whole block
+    u32 x0, y0, w, h; // window of the grid it was cut from
+    u32 unit_count;
+    u32 turn, seed; // dice keys
+    u32 tiles_offset; // u8 per tile: terrain in the low 3 bits, owner + 1 above them (0 for neutral)
+    u32 stacks_offset; // u16 per tile: first unit standing there
+    u32 units_offset;
+};
+#define sim_tiles(world) ((u8 *)(world) + (world)->tiles_offset)
+#define sim_stacks(world) ((u16 *)((u8 *)(world) + (world)->stacks_offset))
+#define sim_units(world) ((struct sim_unit *)((u8 *)(world) + (world)->units_offset))
+static inline u32 sim_terrain(u8 tile) { return tile & 7; }
+static inline bool sim_owned(u8 tile) { return tile >> 3 != 0; }
+static inline u32 sim_owner(u8 tile) { return (tile >> 3) - 1; }
+// window tiles are row-major from the window's corner: map coordinates of one, and the one a map tile id falls on (NO_TILE outside)
+static inline u32 sim_map_x(const struct sim_world *world, u32 tile) { return world->x0 + tile % world->w; }
+static inline u32 sim_map_y(const struct sim_world *world, u32 tile) { return world->y0 + tile / world->w; }
+static inline u32 sim_window_tile(const struct sim_world *world, u32 map_tile) {
+    u32 x = tile_x(map_tile) - world->x0, y = tile_y(map_tile) - world->y0;
+    return x < world->w && y < world->h ? y * world->w + x : NO_TILE;
+}
+
+static inline void sim_remove_from_tile(struct sim_world *world, u32 unit) {
+    struct sim_unit *units = sim_units(world);
+    u16 *link = &sim_stacks(world)[units[unit].tile];
+    while (*link != unit) link = &units[*link].next;
+    *link = units[unit].next;
+}
+
+static inline void sim_put_on_tile(struct sim_world *world, u32 unit, u32 tile) {
+    struct sim_unit *units = sim_units(world);
+    u8 *tiles = sim_tiles(world);
+    units[unit].tile = tile;
+    units[unit].next = sim_stacks(world)[tile];
+    sim_stacks(world)[tile] = unit;
+    tiles[tile] = (tiles[tile] & 7) | (units[unit].player + 1) << 3; // walking in takes the tile
+}
+
+// cuts the window out of the live world; every unit targets the nearest enemy stack inside the window, or holds
+struct sim_world *cut_sim_world(u32 x0, u32 y0, u32 w, u32 h, struct unit_list player_units[MAX_PLAYERS], struct unit_stack *unit_stacks) {
+    u32 unit_count = 0;
+    for (u32 player = 0; player < scenario.players; player++) {
+        for (u32 live = 0; live < player_units[player].live; live++) {
+            struct unit *unit = &player_units[player].units[player_units[player].dense[live]];
+            unit_count += unit->x - x0 < w && unit->y - y0 < h;
+        }
+    }
+    if (unit_count >= SIM_NO_UNIT) { printf("Too many units for a rollout world: %u\n", unit_count); return NULL; }
+    u32 tiles_offset = (sizeof(struct sim_world) + 15) & ~15u;
+    u32 stacks_offset = (tiles_offset + w * h + 15) & ~15u;
+    u32 units_offset = (stacks_offset + sizeof(u16) * w * h + 15) & ~15u;
+    u32 bytes = units_offset + sizeof(struct sim_unit) * unit_count;
+    struct sim_world *world = malloc(bytes);
+    if (!world) { fprintf(stderr, "OOM: rollout world\n"); exit(1); }
+    *world = (struct sim_world){bytes, x0, y0, w, h, 0, 0, 1, tiles_offset, stacks_offset, units_offset};
+    for (u32 y = 0; y < h; y++) {
+        for (u32 x = 0; x < w; x++) {
+            u32 tile = tile_at(x0 + x, y0 + y);
+            sim_tiles(world)[y * w + x] = grid_terrain(tile) | (grid_owner(tile) == NO_OWNER ? 0 : grid_owner(tile) + 1) << 3;
+            sim_stacks(world)[y * w + x] = SIM_NO_UNIT;
+        }
+    }
+    for (u32 player = 0; player < scenario.players; player++) {
+        for (u32 live = 0; live < player_units[player].live; live++) {
+            struct unit *unit = &player_units[player].units[player_units[player].dense[live]];
+            if (unit->x - x0 >= w || unit->y - y0 >= h) continue;
+            u32 id = world->unit_count++, tile = (unit->y - y0) * w + (unit->x - x0);
+            u16 target;
+            u32 target_tile = spatial_nearest_enemies(unit->x, unit->y, player, 1, 2500, &target, unit_stacks) == 1 ? sim_window_tile(world, spatial.tile[target]) : NO_TILE;
+            sim_units(world)[id] = (struct sim_unit){.type = unit->type, .player = player, .target = target_tile != NO_TILE ? target_tile : tile};
+            sim_units(world)[id].tile = tile;
+            sim_units(world)[id].next = sim_stacks(world)[tile];
+            sim_stacks(world)[tile] = id;
+        }
+    }
+    return world;
+}
+
+static inline void clone_sim_world(struct sim_world *to, const struct sim_world *from) {
+    memcpy(to, from, from->bytes);
+}
+
+// per thread scratch for sim_turn, grown to the largest world seen
+struct sim_fight {
+    u32 unit, tile; // attacker and the tile it stepped onto
+};
+struct sim_scratch {
+    u8 *steps; // max_steps per unit: the greedy steps of this turn
+    u16 *buckets; // and the bucket each step falls in
+    u16 *step_count, *taken; // steps per unit and how many are done
+    u32 units_capacity, max_steps; // max_steps: the move budget over the cheapest terrain
+    struct sim_fight *fights; // of the bucket, in unit order
+    u64 *by_tile; // tile << 32 | fight
+    u8 *outcome;
+    u32 fight_count, fights_capacity;
+};
+
+// greedy steps from the unit's tile towards its target within the move budget: the passable neighbour closest to
+// the target (diagonal steps count as one), earlier directions first on ties, until the target or a dead end
+static u32 sim_plan(const struct sim_world *world, const struct sim_unit *unit, u32 max_steps, u8 *steps, u16 *buckets) {
+    const u8 *tiles = sim_tiles(world);
+    i32 x = unit->tile % world->w, y = unit->tile / world->w;
+    i32 target_x = unit->target % world->w, target_y = unit->target / world->w;
+    u32 count = 0, cost = 0;
+    while (count < max_steps && (x != target_x || y != target_y)) {
+        i32 best_distance = abs(target_x - x) > abs(target_y - y) ? abs(target_x - x) : abs(target_y - y);
+        u32 best = DIRECTIONS_COUNT, best_cost = 0;
+        for (u32 dir = UP; dir <= DOWN_RIGHT; dir++) {
+            i32 next_x = x + (i32)dir_offsets[dir].x, next_y = y + (i32)dir_offsets[dir].y;
+            if (next_x < 0 || next_y < 0 || next_x >= (i32)world->w || next_y >= (i32)world->h) continue;
+            i32 next_distance = abs(target_x - next_x) > abs(target_y - next_y) ? abs(target_x - next_x) : abs(target_y - next_y);
+            u32 step_cost = movement_cost[unit->type][sim_terrain(tiles[next_y * world->w + next_x])];
+            if (next_distance >= best_distance || step_cost == (u32)-1) continue;
+            best = dir, best_cost = step_cost, best_distance = next_distance;
+        }
+        if (best == DIRECTIONS_COUNT || cost + best_cost > scenario.move_budget) break;
+        cost += best_cost;
+        steps[count] = best;
+        buckets[count++] = cost / BUCKET_COST < scenario.bucket_count ? cost / BUCKET_COST : scenario.bucket_count - 1;
+        x += (i32)dir_offsets[best].x, y += (i32)dir_offsets[best].y;
+    }
+    return count;
+}
+
+// a target that holds no enemy any more is swapped for the nearest enemy unit (diagonal steps count as one, the
+// lowest unit on ties), the unit holds its tile once there are none; a plain scan, rollout worlds are small
+static u32 sim_retarget(const struct sim_world *world, const struct sim_unit *unit) {
+    const struct sim_unit *units = sim_units(world);
+    u32 at = sim_stacks(world)[unit->target];
+    if (at != SIM_NO_UNIT && units[at].player != unit->player) return unit->target;
+    i32 x = unit->tile % world->w, y = unit->tile / world->w;
+    u32 best = unit->tile, best_distance = 0xFFFFFFFFu;
+    for (u32 other = 0; other < world->unit_count; other++) {
+        if (units[other].type == SIM_DEAD || units[other].player == unit->player) continue;
+        i32 dx = abs((i32)(units[other].tile % world->w) - x), dy = abs((i32)(units[other].tile / world->w) - y);
+        u32 distance = dx > dy ? dx : dy;
+        if (distance < best_distance) best_distance = distance, best = units[other].tile;
+    }
+    return best;
+}
+
+// settles the fights of a bucket like resolve_battles: strength sums per tile, dice, results in unit order
+static void sim_battles(struct sim_world *world, struct sim_scratch *scratch) {
+    struct sim_unit *units = sim_units(world);
+    struct sim_fight *fights = scratch->fights;
+    u8 *tiles = sim_tiles(world);
+    u32 count = scratch->fight_count;
+    for (u32 i = 0; i < count; i++) scratch->by_tile[i] = (u64)fights[i].tile << 32 | i;
+    qsort(scratch->by_tile, count, sizeof(u64), compare_u64);
+    for (u32 first = 0, last; first < count; first = last) {
+        u32 tile = scratch->by_tile[first] >> 32, attack = 0, defence = 0;
+        for (last = first; last < count && scratch->by_tile[last] >> 32 == tile; last++)
+            attack += unit_strength[units[fights[(u32)scratch->by_tile[last]].unit].type];
+        for (u32 unit = sim_stacks(world)[tile]; unit != SIM_NO_UNIT; unit = units[unit].next)
+            defence += unit_strength[units[unit].type] * movement_cost[units[unit].type][sim_terrain(tiles[tile])] / 100;
+        for (u32 i = first; i < last; i++) {
+            u32 fight = (u32)scratch->by_tile[i];
+            scratch->outcome[fight] = battle_outcome(attack, defence, dice(world->seed, world->turn, tile, fights[fight].unit));
+        }
+    }
+    for (u32 i = 0; i < count; i++) {
+        u32 attacker = fights[i].unit, tile = fights[i].tile;
+        if (units[attacker].type == SIM_DEAD || scratch->outcome[i] == DRAW) continue;
+        if (scratch->outcome[i] == DEFENDER_WINS) {
+            sim_remove_from_tile(world, attacker);
+            units[attacker].type = SIM_DEAD;
+            continue;
+        }
+        u32 defender = sim_stacks(world)[tile];
+        if (defender != SIM_NO_UNIT && units[defender].player != units[attacker].player) {
+            sim_remove_from_tile(world, defender);
+            units[defender].type = SIM_DEAD;
+        }
+        if (sim_stacks(world)[tile] == SIM_NO_UNIT) { // the attacker still stands next to it, it stopped when it attacked
+            sim_remove_from_tile(world, attacker);
+            sim_put_on_tile(world, attacker, tile);
+        }
+    }
+    scratch->fight_count = 0;
+}
+
+// one whole turn on the block: every unit picks a target if it lost its own and plans its greedy steps, then the steps are taken bucket by bucket in unit
+// order; a step onto an enemy stops the unit and fights after the bucket, like resolve_turn does
+void sim_turn(struct sim_world *world, struct sim_scratch *scratch) {
+    struct sim_unit *units = sim_units(world);
+    if (!scratch->max_steps) { // every step costs at least the cheapest passable terrain
+        u32 cheapest = (u32)-1;
+        for (u32 type = 0; type < UNIT_COUNT; type++)
+            for (u32 terrain = 0; terrain < TILE_COUNT; terrain++)
+                if (movement_cost[type][terrain] && movement_cost[type][terrain] < cheapest) cheapest = movement_cost[type][terrain];
+        scratch->max_steps = scenario.move_budget / cheapest + 1;
+    }
+    if (scratch->units_capacity < world->unit_count) {
+        scratch->units_capacity = world->unit_count;
+        scratch->steps = realloc(scratch->steps, scratch->max_steps * world->unit_count);
+        scratch->buckets = realloc(scratch->buckets, sizeof(u16) * scratch->max_steps * world->unit_count);
+        scratch->step_count = realloc(scratch->step_count, sizeof(u16) * world->unit_count);
+        scratch->taken = realloc(scratch->taken, sizeof(u16) * world->unit_count);
+        scratch->fights = realloc(scratch->fights, sizeof(struct sim_fight) * world->unit_count); // a unit fights once a turn
+        scratch->by_tile = realloc(scratch->by_tile, sizeof(u64) * world->unit_count);
+        scratch->outcome = realloc(scratch->outcome, world->unit_count);
+        if (!scratch->steps || !scratch->buckets || !scratch->step_count || !scratch->taken || !scratch->fights || !scratch->by_tile || !scratch->outcome) {
+            fprintf(stderr, "OOM: rollout scratch\n"); exit(1);
+        }
+    }
+    world->turn++;
+    for (u32 unit = 0; unit < world->unit_count; unit++) {
+        scratch->taken[unit] = 0;
+        scratch->step_count[unit] = 0;
+        if (units[unit].type == SIM_DEAD) continue;
+        units[unit].target = sim_retarget(world, &units[unit]);
+        scratch->step_count[unit] = sim_plan(world, &units[unit], scratch->max_steps, &scratch->steps[unit * scratch->max_steps], &scratch->buckets[unit * scratch->max_steps]);
+    }
+    for (u32 bucket = 0; bucket < scenario.bucket_count; bucket++) {
+        for (u32 unit = 0; unit < world->unit_count; unit++) {
+            while (scratch->taken[unit] < scratch->step_count[unit] && scratch->buckets[unit * scratch->max_steps + scratch->taken[unit]] == bucket) {
+                if (units[unit].type == SIM_DEAD) { scratch->taken[unit] = scratch->step_count[unit]; break; }
+                u8 dir = scratch->steps[unit * scratch->max_steps + scratch->taken[unit]++];
+                u32 to = units[unit].tile + (i32)dir_offsets[dir].y * (i32)world->w + (i32)dir_offsets[dir].x;
+                u32 defender = sim_stacks(world)[to];
+                if (defender != SIM_NO_UNIT && units[defender].player != units[unit].player) {
+                    scratch->fights[scratch->fight_count++] = (struct sim_fight){unit, to};
+                    scratch->taken[unit] = scratch->step_count[unit]; // stops for the turn
+                    break;
+                }
+                sim_remove_from_tile(world, unit);
+                sim_put_on_tile(world, unit, to);
+            }
+        }
+        if (scratch->fight_count > 0) sim_battles(world, scratch);
+    }
+}
+
+// strength of the player's units and cities minus everyone else's
+i64 sim_score(const struct sim_world *world, u32 player) {
+    const struct sim_unit *units = sim_units(world);
+    const u8 *tiles = sim_tiles(world);
+    i64 score = 0;
+    for (u32 unit = 0; unit < world->unit_count; unit++)
+        if (units[unit].type != SIM_DEAD) score += units[unit].player == player ? unit_strength[units[unit].type] : -(i64)unit_strength[units[unit].type];
+    for (u32 tile = 0; tile < world->w * world->h; tile++)
+        if (sim_terrain(tiles[tile]) == CITY && sim_owned(tiles[tile])) score += sim_owner(tiles[tile]) == player ? CITY_SCORE : -CITY_SCORE;
+    return score;
+}
+
+// candidate order sets for one player, each played out rollouts times for turns turns on a clone of the start; rollout
+// r of every candidate rolls the same dice, so the candidates are compared on equal luck
+struct rollout_job {
+    const struct sim_world *start;
+    u32 player;
+    u32 candidates;
+    const u32 *targets; // candidates x start->unit_count target tiles, only the player's own units are read
+    u32 rollouts, turns;
+    i64 *scores; // candidates x rollouts, score after the last turn
+    _Atomic u32 next;
+};
+struct rollout_thread {
+    struct sim_world *world;
+    u32 capacity;
+    struct sim_scratch scratch;
+};
+struct rollout_thread rollout_threads[MAX_WORKER_THREADS];
+
+void rollouts_worker(struct workers *workers, void *job_pointer, u32 index) {
+    struct rollout_job *job = job_pointer;
+    struct rollout_thread *thread = &rollout_threads[index];
+    if (thread->capacity < job->start->bytes) {
+        thread->capacity = job->start->bytes;
+        thread->world = realloc(thread->world, job->start->bytes);
+        if (!thread->world) { fprintf(stderr, "OOM: rollout world\n"); exit(1); }
+    }
+    for (;;) {
+        u32 item = atomic_fetch_add(&job->next, 1);
+        if (item >= job->candidates * job->rollouts) break;
+        u32 candidate = item / job->rollouts, rollout = item % job->rollouts;
+        struct sim_world *world = thread->world;
+        clone_sim_world(world, job->start);
+        world->seed = dice(job->start->seed, rollout, 0, 0); // the same for every candidate
+        struct sim_unit *units = sim_units(world);
+        for (u32 unit = 0; unit < world->unit_count; unit++)
+            if (units[unit].player == job->player) units[unit].target = job->targets[(usize)candidate * world->unit_count + unit];
+        for (u32 turn = 0; turn < job->turns; turn++) sim_turn(world, &thread->scratch);
+        job->scores[item] = sim_score(world, job->player);
+    }
+}
+
+// fills job.scores, the same for any thread count
+void evaluate_rollouts(struct workers *workers, struct rollout_job *job) {
+    atomic_store(&job->next, 0);
+    run_workers(workers, rollouts_worker, job);
+}
+#pragma endregion
+
+// a turn starts with the economy and then plans for at most AI_TICK_BUDGET_US per tick until it is done; its moves
+// are resolved RESOLVE_TICK ticks after the start, or as soon as the planning is done if it took longer than that.
+// in eager mode every phase starts on the tick the one before it finished
+#define TURN_TICKS 20 // script ticks per turn while the planning keeps up
+#define RESOLVE_TICK 14
+#ifndef AI_TICK_BUDGET_US
+#define AI_TICK_BUDGET_US 8000 // of the 16 ms tick at 1x, divided by the speed
+#endif
+struct autosave;
+extern struct autosave autosave;
+void autosave_world(struct autosave *a, struct unit_list player_units[MAX_PLAYERS], struct unit_stack *unit_stacks, struct resolve_order *resolve_order);
+
+struct turn_progress {
+    u32 tick; // ticks since the turn started
+    bool planned, resolved;
+    u32 turns, most_ticks; // turns finished and the most ticks one of them planned for since the last report
+    u64 worst_tick_us; // since the last report
+};
+
+// one tick of the script, budget_us 0 plans without a limit
+void script_tick(struct thread_args *src, struct turn_progress *turn, u64 budget_us, bool eager) {
+    struct unit_list *player_units = src->player_units;
+    u64 us_scrpt = time_us();
+    if (turn->tick == 0) {
+        for (u32 player = 0; player < scenario.players; player++) player_turn(player, player_units, src->unit_stacks);
+        update_influence(player_units, src->unit_stacks);
+        begin_ai_turn(&ai_turn, player_units, src->player_paths, src->resolve_order, src->unit_stacks); // BIK
+        turn->planned = turn->resolved = false;
+    }
+    if (!turn->planned && continue_ai_turn(&ai_turn, budget_us ? us_scrpt + budget_us : 0)) {
+        turn->planned = true;
+        publish_snapshot(src->snapshots, player_units, src->unit_stacks, src->resolve_order);
+    }
+    if (turn->planned && !turn->resolved && (eager || turn->tick >= RESOLVE_TICK)) {
+        resolve_turn(player_units, src->resolve_order, src->unit_stacks);
+        publish_snapshot(src->snapshots, player_units, src->unit_stacks, src->resolve_order);
+        autosave_world(&autosave, player_units, src->unit_stacks, src->resolve_order);
+        turn->resolved = true;
+    }
+    turn->tick++;
+    if (turn->resolved && (eager || turn->tick >= TURN_TICKS)) {
+        if (ai_turn.ticks > turn->most_ticks) turn->most_ticks = ai_turn.ticks;
+        turn->turns++;
+        turn->tick = 0;
+    }
+    if (elapsed_us(us_scrpt) > turn->worst_tick_us) turn->worst_tick_us = elapsed_us(us_scrpt);
 }
 
 void *script(void *arg) {
     struct thread_args *src = (struct thread_args *)arg;
-    struct unit_list player_units[PLAYER_COUNT];
-    struct path player_paths[PLAYER_COUNT][MAX_UNITS] = {0};
-    struct resolve_bucket resolve_order[BUCKET_COUNT] = {0};
-    memcpy(player_paths, src->player_paths, sizeof(struct path) * PLAYER_COUNT * MAX_UNITS);
-    memcpy(resolve_order, src->resolve_order, sizeof(struct resolve_bucket) * BUCKET_COUNT);
-    memcpy(player_units, src->player_units, sizeof(struct unit_list) * PLAYER_COUNT);
-    for (u32 player = 0; player < PLAYER_COUNT; player ++) {
-        for (u32 unit = 0; unit < MAX_UNITS; unit++) {
-            if (player_paths[player][unit].steps == NULL) {
-                printf("sFKDK\n");
-            }
-        }
-    }
-    u32 scrpt_frame = 0;
-    while (true) {
-        u64 us_scrpt = time_us();
-        if (scrpt_frame % 20 == 1) {
-            player_turn(0, player_units, &(player_paths), &(resolve_order), src->unit_stacks);
-            memcpy(src->resolve_order_ptr, resolve_order, sizeof(struct resolve_bucket) * BUCKET_COUNT);
-            memcpy(src->player_units_ptr, player_units, sizeof(struct unit_list) * PLAYER_COUNT);
+    struct turn_progress turn = {0};
+    u64 report_us = time_us();
+    sim_clock.last_us = time_us();
+    while (!atomic_load(&sim_clock.stop)) {
+        u32 speed = atomic_load(&sim_clock.speed);
+        bool eager = atomic_load(&sim_clock.eager);
+        u64 now_us = time_us();
+        if (speed == SPEED_UNBOUNDED) { // as fast as the cpu goes, the renderer keeps taking the latest snapshot
+            script_tick(src, &turn, 0, eager);
+            sim_clock.owed_us = 0;
+        } else {
+            sim_clock.owed_us += (now_us - sim_clock.last_us) * speed;
+            if (sim_clock.owed_us > MAX_CATCH_UP_TICKS * TICK_US) sim_clock.owed_us = MAX_CATCH_UP_TICKS * TICK_US;
+            for (; sim_clock.owed_us >= TICK_US; sim_clock.owed_us -= TICK_US) script_tick(src, &turn, AI_TICK_BUDGET_US / speed, eager);
+            struct timespec ts = {0, (long)((TICK_US - sim_clock.owed_us) / speed * 1000)}; // until the next tick is due
+            nanosleep(&ts, NULL);
         }
-        if (scrpt_frame % 20 == 2) {
-            player_turn(1, player_units, &(player_paths), &(resolve_order), src->unit_stacks);
-            memcpy(src->resolve_order_ptr, resolve_order, sizeof(struct resolve_bucket) * BUCKET_COUNT);
-            memcpy(src->player_units_ptr, player_units, sizeof(struct unit_list) * PLAYER_COUNT);
+        sim_clock.last_us = now_us;
+        if (elapsed_us(report_us) >= 1000000) {
+            if (speed == SPEED_UNBOUNDED) printf("%u turns/s unbounded", turn.turns);
+            else printf("%u turns/s at %ux", turn.turns, speed);
+            printf("%s, planning took up to %u ticks, worst tick %.1f ms\n", eager ? " eager" : "", turn.most_ticks, turn.worst_tick_us / 1000.0);
+            turn.turns = turn.most_ticks = 0;
+            turn.worst_tick_us = 0;
+            report_us = time_us();
         }
-        if (scrpt_frame % 20 == 15) {
-            resolve_turn(player_units, &(resolve_order), src->unit_stacks);
-            memcpy(src->resolve_order_ptr, resolve_order, sizeof(struct resolve_bucket) * BUCKET_COUNT);
-            memcpy(src->player_units_ptr, player_units, sizeof(struct unit_list) * PLAYER_COUNT);
-        }
-        struct timespec ts = {0, 16 * 1000000};
-        if (elapsed_us(us_scrpt) >= 1000) {
-            printf("%ld ms_scrpt\n", elapsed_us(us_scrpt));
-        }
-        nanosleep(&ts, NULL);
-        scrpt_frame++;
     }
+    return NULL;
 }
 
 #if defined(_WIN32)
@@ -1154,6 +3195,16 @@ static inline struct tga tga_load(const char *path) {
     return (struct tga){ w, h, (u32*)((u8*)buf + off), buf, (size_t)sz };
 }
 static inline void tga_free(struct tga img) { free((void*)img.map); }
+// the whole file in private writable memory, NULL if it can't be read
+static inline u8 *map_file(const char *path, usize *size) {
+    FILE *f = fopen_exedir(path, "rb"); if (!f) return NULL;
+    fseek(f, 0, SEEK_END); long sz = ftell(f); fseek(f, 0, SEEK_SET);
+    u8 *buf = malloc(sz > 0 ? (size_t)sz : 1); if (!buf) { fprintf(stderr,"OOM: %s\n", path); exit(1); }
+    if (fread(buf,1,(size_t)sz,f)!=(size_t)sz) { fclose(f); free(buf); return NULL; }
+    fclose(f);
+    *size = (usize)sz;
+    return buf;
+}
 #else
 #include <sys/stat.h>
 static inline int get_exe_dir(char *out, size_t n) { char buf[4096]; ssize_t k=readlink("/proc/self/exe",buf,sizeof buf-1); if (k<=0) return 0; buf[k]=0; for (char *p=buf+k; p!=buf; --p) if (p[-1]=='/'||p[-1]=='\\') { p[-1]=0; break; } if (!buf[0]) return 0; strncpy(out, buf, n); out[n-1]=0; return 1; }
@@ -1176,8 +3227,589 @@ static inline struct tga tga_load(const char *path) {
     return (struct tga){ w, h, (u32*)((u8*)map + off), map, st.st_size };
 }
 static inline void tga_free(struct tga img) { munmap((void*)img.map, img.map_len); }
+// the whole file in private writable memory (pages are copied on the first write), NULL if it can't be read
+static inline u8 *map_file(const char *path, usize *size) {
+    int fd = open_exedir(path, O_RDONLY | 02000000);
+    if (fd < 0) return NULL;
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0) { close(fd); return NULL; }
+    void *map = mmap(0, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) return NULL;
+    *size = (usize)st.st_size;
+    return map;
+}
+static inline FILE *fopen_exedir(const char *path, const char *mode) { int fd=open_exedir(path,O_RDONLY); return fd>=0 ? fdopen(fd,mode) : NULL; }
+#endif
+
+// maps a .bin from palette/encode.c, checking every tile starts inside the file and decodes to whole rows without
+// leaving it, so the decoders don't have to check anything
+i32 load_rle_atlas(const char *path, struct rle_atlas *atlas) {
+    usize size = 0;
+    const u8 *file = map_file(path, &size);
+    if (!file) { printf("Could not read RLE atlas %s\n", path); return -1; }
+    const u32 *offsets = (const u32 *)file;
+    if (size < sizeof(u32) || size > 0xFFFFFFFFu || offsets[0] % sizeof(u32) || offsets[0] > size) { printf("Bad RLE atlas %s\n", path); return -2; }
+    for (u32 tile = 0; tile < offsets[0] / sizeof(u32); tile++) {
+        if (offsets[tile] >= size) { printf("RLE atlas %s: tile %u starts past the end\n", path, tile); return -3; }
+        if (!rle_tile_bytes(file + offsets[tile], (u32)size - offsets[tile])) { printf("RLE atlas %s: tile %u is damaged\n", path, tile); return -4; }
+    }
+    *atlas = (struct rle_atlas){offsets[0] / sizeof(u32), offsets, file, size};
+    return 0;
+}
+
+// directory holding scenario.txt and the map, units and players TGAs
+const char *data_dir = "data";
+static inline const char *data_file(const char *name) {
+    static char path[1024];
+    snprintf(path, sizeof path, "%s/%s", data_dir, name);
+    return path;
+}
+
+// scenario.txt is optional, every key keeps its default when it is missing
+i32 load_scenario(const char *path) {
+    FILE *f = fopen_exedir(path, "r");
+    if (f) {
+        char line[256], key[64];
+        u32 value;
+        while (fgets(line, sizeof line, f)) {
+            if (line[0] == '#' || sscanf(line, " %63[a-z_] = %u", key, &value) != 2) continue;
+            if (!strcmp(key, "players")) scenario.players = value;
+            else if (!strcmp(key, "max_units")) scenario.max_units = value;
+            else if (!strcmp(key, "move_budget")) scenario.move_budget = value;
+            else printf("Unknown scenario key: %s\n", key);
+        }
+        fclose(f);
+    }
+    if (scenario.players < 1 || scenario.players > MAX_PLAYERS) {
+        printf("Scenario needs 1 to %d players, not %u\n", MAX_PLAYERS, scenario.players);
+        return -1;
+    }
+    scenario.max_stacks = scenario.players * scenario.max_units;
+    if (scenario.max_units == 0 || scenario.max_stacks >= NO_STACK) { // unit and stack ids are u16 with the top value as terminator
+        printf("Scenario allows %u units per player, at most %u units in total fit\n", scenario.max_units, NO_STACK - 1);
+        return -2;
+    }
+    if (scenario.move_budget > 0xFFFF) { // the cumulative cost of a step is a u16
+        printf("Scenario move_budget is %u, at most %u fits\n", scenario.move_budget, 0xFFFF);
+        return -3;
+    }
+    scenario.bucket_count = scenario.move_budget / BUCKET_COST + 1;
+    return 0;
+}
+
+// the map images are only read here, gameplay uses the chunked grid from then on
+void import_grid(struct tga map, struct tga players) {
+    assert(players.w == map.w && players.h == map.h && "Players do not match the map size");
+    u64 start_us = time_us();
+    grid.w = map.w;
+    grid.h = map.h;
+    grid.chunks_w = (grid.w + CHUNK_MASK) >> CHUNK_SHIFT;
+    grid.chunks_h = (grid.h + CHUNK_MASK) >> CHUNK_SHIFT;
+    for (grid.column_shift = 0; (1u << grid.column_shift) < grid.chunks_w; grid.column_shift++);
+    grid.chunk_count = grid.chunks_h << grid.column_shift;
+    assert((u64)grid.chunk_count << CHUNK_BITS < NO_TILE && "Map too large for 32 bit tile ids");
+    grid.chunks = arena_alloc(&world_arena, sizeof(struct chunk *) * grid.chunk_count);
+    for (u32 chunk_y = 0; chunk_y < grid.chunks_h; chunk_y++) {
+        for (u32 chunk_x = 0; chunk_x < grid.chunks_w; chunk_x++) {
+            struct chunk *chunk = arena_alloc(&world_arena, sizeof(struct chunk));
+            memset(chunk->owner, NO_OWNER, sizeof(chunk->owner)); // tiles past the map edge stay like this
+            memset(chunk->stack, 0xFF, sizeof(chunk->stack)); // NO_STACK
+            grid.chunks[chunk_y << grid.column_shift | chunk_x] = chunk;
+        }
+    }
+    terrain_present = 0;
+    for (u32 y = 0; y < grid.h; ++y) {
+        for (u32 x = 0; x < grid.w; ++x) {
+            u32 tile = tile_at(x, y);
+            grid_terrain(tile) = tile_from_color(map.pix[y * map.w + x], x, y);
+            grid_owner(tile) = player_from_color(players.pix[y * players.w + x]);
+            if (grid_terrain(tile) < TILE_COUNT) terrain_present |= 1u << grid_terrain(tile);
+        }
+    }
+    init_spatial(); // no stacks yet
+    u32 chunks = grid.chunks_w * grid.chunks_h;
+    printf("Map %ux%u: %u chunks of %zu bytes (%.1f MB), imported in %.1f ms\n", grid.w, grid.h, chunks,
+           sizeof(struct chunk), (f64)chunks * sizeof(struct chunk) / (1 << 20), elapsed_us(start_us) / 1000.0);
+}
+
+// everything kept per unit and per stack, sized by the scenario; returns the stacks
+struct unit_stack *init_units(struct unit_list player_units[MAX_PLAYERS], struct path *player_paths[MAX_PLAYERS]) {
+    for (u32 player = 0; player < scenario.players; player++) {
+        player_units[player].units = arena_alloc(&world_arena, sizeof(struct unit) * scenario.max_units);
+        player_units[player].dense = arena_alloc(&world_arena, sizeof(u16) * scenario.max_units);
+        player_units[player].free_ids = arena_alloc(&world_arena, sizeof(u16) * scenario.max_units);
+        player_paths[player] = arena_alloc(&world_arena, sizeof(struct path) * scenario.max_units);
+    }
+    init_journal();
+    init_path_cache();
+    init_reservations();
+    init_influence();
+    return arena_alloc(&world_arena, sizeof(struct unit_stack) * scenario.max_stacks);
+}
+
+// a new game from the scenario in data_dir: map, owners and units come from the TGAs
+struct unit_stack *import_world(struct unit_list player_units[MAX_PLAYERS], struct path *player_paths[MAX_PLAYERS]) {
+    if (load_scenario(data_file("scenario.txt")) != 0) return NULL;
+    struct tga map = tga_load(data_file("map.tga"));
+    struct tga units = tga_load(data_file("units.tga"));
+    struct tga players = tga_load(data_file("players.tga"));
+    import_grid(map, players);
+    struct unit_stack *unit_stacks = init_units(player_units, player_paths); // geen count bijgehouden dus geen loop mogelijk
+
+    // find the cities on the map
+    for (u32 y = 0; y < grid.h; ++y) {
+        for (u32 x = 0; x < grid.w; ++x) {
+            u32 income = tile_income[get_tile(x, y)];
+            if (income > 0) {
+                u32 player_id = get_player(x, y);
+                if (player_id != -1) player_cities[player_id] += income;
+            }
+        }
+    }
+    
+    // loop over units in units tga and use the add_unit function to add them to the grid
+    for (u32 y = 0; y < units.h; ++y) {
+        for (u32 x = 0; x < units.w; ++x) {
+            u32 pixel = units.pix[y * units.w + x];
+            if (pixel != 0) { // unit is not empty pixel
+                enum units unit = unit_from_color(pixel, x, y);
+                i32 result = add_unit(get_player(x, y), unit, x, y, player_units, unit_stacks);
+                assert(result == 0 && "Init unit map went wrong\n");
+            }
+        }
+    }
+    tga_free(map);
+    tga_free(units);
+    tga_free(players);
+    return unit_stacks;
+}
+
+#pragma region SAVE
+// a save is the world's memory written out as it is: a header, then sections aligned to SAVE_ALIGN holding the arrays
+// the game works on. loading maps the file and points the grid, units, stacks and spatial index straight into it, the
+// only copies are the few arrays that grow (cached paths and orders); everything derived is rebuilt. the layout is
+// this build's structs, so a save only loads into a build with the same SAVE_VERSION and struct sizes
+#define SAVE_MAGIC 0x5A544146u // "FATZ"
+#define SAVE_VERSION 1
+#define SAVE_ALIGN 64
+#define NO_CHUNK 0xFFFFFFFFu
+enum save_sections {
+    SAVE_CHUNK_TABLE, // u32 per chunk index, its slot in SAVE_CHUNKS or NO_CHUNK for padding
+    SAVE_CHUNKS,
+    SAVE_UNITS, SAVE_DENSE, SAVE_FREE_IDS, // players * max_units each
+    SAVE_STACKS,
+    SAVE_CELLS, SAVE_CELL_NEXT, SAVE_CELL_PREV, SAVE_STACK_TILES, // the spatial index
+    SAVE_PATH_CACHE, // players * max_units records, steps NULL and capacity the length
+    SAVE_PATH_STEPS, // the steps of every cached path one after the other, in record order
+    SAVE_ORDERS, // steps committed for the coming resolve
+    SAVE_SECTION_COUNT
+};
+struct save_section { u64 offset, size; };
+struct save_header {
+    u32 magic, version;
+    u32 header_size; // sizeof(struct save_header), catches layout changes without a version bump
+    u32 unit_size, stack_size, chunk_size;
+    struct scenario scenario;
+    u32 w, h, chunks_w, chunks_h, column_shift, chunk_count, terrain_present;
+    u32 stack_free_head, stacks_touched, turn_number, battle_seed, change_counter;
+    u32 player_money[MAX_PLAYERS], player_cities[MAX_PLAYERS];
+    u32 unit_count[MAX_PLAYERS], live[MAX_PLAYERS], free_count[MAX_PLAYERS]; // unit_list counters
+    u32 order_count;
+    struct save_section sections[SAVE_SECTION_COUNT];
+};
+
+// the file being built in memory
+struct save_image {
+    u8 *data;
+    u32 size, capacity;
+};
+
+static inline void *save_section(struct save_image *image, struct save_header *header, u32 section, usize bytes) {
+    header->sections[section] = (struct save_section){image->size, bytes};
+    image->size += (u32)((bytes + SAVE_ALIGN - 1) & ~(usize)(SAVE_ALIGN - 1));
+    return image->data + header->sections[section].offset;
+}
+
+// grows image to hold a save of the world as it is now
+void reserve_save(struct save_image *image, struct resolve_order *resolve_order) {
+    u32 chunks = grid.chunks_w * grid.chunks_h, units = scenario.players * scenario.max_units, path_steps = 0;
+    for (u32 player = 0; player < scenario.players; player++)
+        for (u32 id = 0; id < scenario.max_units; id++) path_steps += path_cache[player][id].length;
+    usize bytes = sizeof(struct save_header) + (grid.chunk_count * sizeof(u32) + chunks * sizeof(struct chunk) + units * (sizeof(struct unit) + 2 * sizeof(u16) + sizeof(struct path_cache)) +
+                  scenario.max_stacks * (sizeof(struct unit_stack) + 2 * sizeof(u16) + sizeof(u32)) + spatial.cells_w * spatial.cells_h * sizeof(u16) +
+                  path_steps + resolve_order->count * sizeof(struct step)) + (SAVE_SECTION_COUNT + 1) * SAVE_ALIGN;
+    image->data = grow_array(image->data, &image->capacity, (u32)bytes, 1, "save");
+}
+
+// copies the world into image, allocating only if reserve_save wasn't called for this world first
+void save_world(struct save_image *image, struct unit_list player_units[MAX_PLAYERS], struct unit_stack *unit_stacks, struct resolve_order *resolve_order) {
+    u32 chunks = grid.chunks_w * grid.chunks_h, units = scenario.players * scenario.max_units, path_steps = 0;
+    for (u32 player = 0; player < scenario.players; player++)
+        for (u32 id = 0; id < scenario.max_units; id++) path_steps += path_cache[player][id].length;
+    reserve_save(image, resolve_order);
+    image->size = (u32)((sizeof(struct save_header) + SAVE_ALIGN - 1) & ~(usize)(SAVE_ALIGN - 1));
+    struct save_header *header = (struct save_header *)image->data;
+    *header = (struct save_header){SAVE_MAGIC, SAVE_VERSION, sizeof(struct save_header), sizeof(struct unit), sizeof(struct unit_stack), sizeof(struct chunk), scenario,
+                                   grid.w, grid.h, grid.chunks_w, grid.chunks_h, grid.column_shift, grid.chunk_count, terrain_present,
+                                   stack_free_head, stacks_touched, turn_number, battle_seed, change_counter};
+    for (u32 player = 0; player < scenario.players; player++) {
+        header->player_money[player] = player_money[player];
+        header->player_cities[player] = player_cities[player];
+        header->unit_count[player] = player_units[player].count;
+        header->live[player] = player_units[player].live;
+        header->free_count[player] = player_units[player].free_count;
+    }
+    header->order_count = resolve_order->count;
+
+    u32 *table = save_section(image, header, SAVE_CHUNK_TABLE, grid.chunk_count * sizeof(u32));
+    struct chunk *chunk_data = save_section(image, header, SAVE_CHUNKS, chunks * sizeof(struct chunk));
+    for (u32 chunk = 0, slot = 0; chunk < grid.chunk_count; chunk++) {
+        table[chunk] = grid.chunks[chunk] ? slot : NO_CHUNK;
+        if (grid.chunks[chunk]) memcpy(&chunk_data[slot++], grid.chunks[chunk], sizeof(struct chunk));
+    }
+    struct unit *unit_data = save_section(image, header, SAVE_UNITS, units * sizeof(struct unit));
+    u16 *dense = save_section(image, header, SAVE_DENSE, units * sizeof(u16));
+    u16 *free_ids = save_section(image, header, SAVE_FREE_IDS, units * sizeof(u16));
+    struct path_cache *caches = save_section(image, header, SAVE_PATH_CACHE, units * sizeof(struct path_cache));
+    u8 *steps = save_section(image, header, SAVE_PATH_STEPS, path_steps);
+    for (u32 player = 0; player < scenario.players; player++) {
+        u32 first = player * scenario.max_units;
+        memcpy(&unit_data[first], player_units[player].units, sizeof(struct unit) * scenario.max_units);
+        memcpy(&dense[first], player_units[player].dense, sizeof(u16) * scenario.max_units);
+        memcpy(&free_ids[first], player_units[player].free_ids, sizeof(u16) * scenario.max_units);
+        for (u32 id = 0; id < scenario.max_units; id++) {
+            struct path_cache *cache = &caches[first + id];
+            *cache = path_cache[player][id];
+            if (cache->length > 0) memcpy(steps, cache->steps, cache->length);
+            steps += cache->length;
+            cache->steps = NULL;
+            cache->capacity = cache->length;
+        }
+    }
+    memcpy(save_section(image, header, SAVE_STACKS, scenario.max_stacks * sizeof(struct unit_stack)), unit_stacks, scenario.max_stacks * sizeof(struct unit_stack));
+    memcpy(save_section(image, header, SAVE_CELLS, spatial.cells_w * spatial.cells_h * sizeof(u16)), spatial.head, spatial.cells_w * spatial.cells_h * sizeof(u16));
+    memcpy(save_section(image, header, SAVE_CELL_NEXT, scenario.max_stacks * sizeof(u16)), spatial.next, scenario.max_stacks * sizeof(u16));
+    memcpy(save_section(image, header, SAVE_CELL_PREV, scenario.max_stacks * sizeof(u16)), spatial.prev, scenario.max_stacks * sizeof(u16));
+    memcpy(save_section(image, header, SAVE_STACK_TILES, scenario.max_stacks * sizeof(u32)), spatial.tile, scenario.max_stacks * sizeof(u32));
+    if (resolve_order->count > 0) memcpy(save_section(image, header, SAVE_ORDERS, resolve_order->count * sizeof(struct step)), resolve_order->steps, resolve_order->count * sizeof(struct step));
+    else save_section(image, header, SAVE_ORDERS, 0);
+}
+
+// whether a tile id of the save's chunk layout lies on its map
+static inline bool save_tile_on_map(const struct save_header *header, u32 tile) {
+    u32 chunk = tile >> CHUNK_BITS, column = chunk & ((1u << header->column_shift) - 1);
+    u32 x = column << CHUNK_SHIFT | (tile & CHUNK_MASK), y = (chunk >> header->column_shift) << CHUNK_SHIFT | ((tile >> CHUNK_SHIFT) & CHUNK_MASK);
+    return chunk < header->chunk_count && x < header->w && y < header->h;
+}
+
+// every id the world indexes arrays with, once the sections are known to have the right sizes: a damaged or edited
+// save is turned away here instead of reading and writing out of bounds once the turns run
+static i32 check_save_ids(const char *path, const u8 *file) {
+    const struct save_header *header = (const struct save_header *)file;
+    struct scenario s = header->scenario;
+    #define SECTION(section) ((const void *)(file + header->sections[section].offset))
+    #define STACK_ID(id) ((id) < s.max_stacks || (id) == NO_STACK)
+    #define UNIT_ID(id) ((id) < s.max_units || (id) == NO_UNIT)
+    for (u32 player = 0; player < s.players; player++) {
+        const struct unit *units = (const struct unit *)SECTION(SAVE_UNITS) + player * s.max_units;
+        const u16 *dense = (const u16 *)SECTION(SAVE_DENSE) + player * s.max_units, *free_ids = (const u16 *)SECTION(SAVE_FREE_IDS) + player * s.max_units;
+        u32 count = header->unit_count[player];
+        for (u32 i = 0; i < header->live[player]; i++)
+            if (dense[i] >= count) { printf("%s: player %u lists unit %u as live, %u were handed out\n", path, player, dense[i], count); return -8; }
+        for (u32 i = 0; i < header->free_count[player]; i++)
+            if (free_ids[i] >= count) { printf("%s: player %u lists unit %u as free, %u were handed out\n", path, player, free_ids[i], count); return -8; }
+        for (u32 id = 0; id < count; id++) {
+            const struct unit *unit = &units[id];
+            if (unit->type == -1) continue;
+            if (unit->type >= UNIT_COUNT || unit->x >= header->w || unit->y >= header->h || !UNIT_ID(unit->prev_in_stack) || !UNIT_ID(unit->next_in_stack) ||
+                unit->dense_index >= header->live[player]) {
+                printf("%s: unit %u of player %u is damaged\n", path, id, player);
+                return -9;
+            }
+        }
+    }
+    const struct unit_stack *stacks = SECTION(SAVE_STACKS);
+    const u16 *cell_next = SECTION(SAVE_CELL_NEXT), *cell_prev = SECTION(SAVE_CELL_PREV);
+    const u32 *stack_tiles = SECTION(SAVE_STACK_TILES);
+    for (u32 stack_id = 0; stack_id < s.max_stacks; stack_id++) {
+        const struct unit_stack *stack = &stacks[stack_id];
+        bool fits = stack->used ? stack->player_id < s.players && stack->first_unit < s.max_units && stack->last_unit < s.max_units &&
+                                  stack->count <= s.max_units && save_tile_on_map(header, stack_tiles[stack_id])
+                                : STACK_ID(stack->next_free);
+        if (!fits || !STACK_ID(cell_next[stack_id]) || !STACK_ID(cell_prev[stack_id])) { printf("%s: stack %u is damaged\n", path, stack_id); return -10; }
+    }
+    const u16 *cells = SECTION(SAVE_CELLS);
+    for (u32 cell = 0; cell < header->sections[SAVE_CELLS].size / sizeof(u16); cell++)
+        if (!STACK_ID(cells[cell])) { printf("%s: cell %u starts at stack %u\n", path, cell, cells[cell]); return -11; }
+    const struct chunk *chunks = SECTION(SAVE_CHUNKS);
+    for (u32 slot = 0; slot < header->sections[SAVE_CHUNKS].size / sizeof(struct chunk); slot++) {
+        for (u32 tile = 0; tile < CHUNK_TILES; tile++) {
+            if (chunks[slot].terrain[tile] >= TILE_COUNT || !STACK_ID(chunks[slot].stack[tile]) ||
+                (chunks[slot].owner[tile] >= s.players && chunks[slot].owner[tile] != NO_OWNER)) {
+                printf("%s: chunk slot %u tile %u is damaged\n", path, slot, tile);
+                return -12;
+            }
+        }
+    }
+    const struct path_cache *caches = SECTION(SAVE_PATH_CACHE);
+    const u8 *steps = SECTION(SAVE_PATH_STEPS);
+    for (u32 cache = 0; cache < s.players * s.max_units; cache++) {
+        if (caches[cache].length > 0 && (caches[cache].start_x >= header->w || caches[cache].start_y >= header->h)) {
+            printf("%s: cached path %u starts off the map\n", path, cache);
+            return -13;
+        }
+    }
+    for (u64 step = 0; step < header->sections[SAVE_PATH_STEPS].size; step++)
+        if (steps[step] >= DIRECTIONS_COUNT) { printf("%s: cached step %llu goes nowhere\n", path, (unsigned long long)step); return -13; }
+    const struct step *orders = SECTION(SAVE_ORDERS);
+    for (u32 order = 0; order < header->order_count; order++) {
+        if (step_player(orders[order]) >= s.players || step_unit(orders[order]) >= header->unit_count[step_player(orders[order])] || orders[order].dir >= DIRECTIONS_COUNT) {
+            printf("%s: order %u is damaged\n", path, order);
+            return -14;
+        }
+    }
+    #undef UNIT_ID
+    #undef STACK_ID
+    #undef SECTION
+    return 0;
+}
+
+// everything load_world points into the file or indexes with, against what the header's scenario and map size imply
+static i32 check_save(const char *path, const u8 *file, usize size) {
+    const struct save_header *header = (const struct save_header *)file;
+    struct scenario s = header->scenario;
+    if (s.players < 1 || s.players > MAX_PLAYERS || s.max_units == 0 || s.max_stacks != s.players * s.max_units || s.max_stacks >= NO_STACK ||
+        s.move_budget > 0xFFFF || s.bucket_count != s.move_budget / BUCKET_COST + 1) {
+        printf("%s: scenario of %u players, %u units, %u stacks, budget %u doesn't fit\n", path, s.players, s.max_units, s.max_stacks, s.move_budget);
+        return -1;
+    }
+    u32 column_shift = 0, chunks_w = (header->w + CHUNK_MASK) >> CHUNK_SHIFT, chunks_h = (header->h + CHUNK_MASK) >> CHUNK_SHIFT;
+    for (; (1u << column_shift) < chunks_w; column_shift++);
+    if (header->w == 0 || header->h == 0 || header->w > 0xFFFF || header->h > 0xFFFF || header->chunks_w != chunks_w || header->chunks_h != chunks_h ||
+        header->column_shift != column_shift || header->chunk_count != chunks_h << column_shift || (u64)header->chunk_count << CHUNK_BITS >= NO_TILE) {
+        printf("%s: map of %ux%u doesn't match its chunks\n", path, header->w, header->h);
+        return -2;
+    }
+    for (u32 section = 0; section < SAVE_SECTION_COUNT; section++) {
+        if (header->sections[section].offset > size || header->sections[section].size > size - header->sections[section].offset ||
+            header->sections[section].offset % SAVE_ALIGN) {
+            printf("%s is cut off or damaged\n", path);
+            return -3;
+        }
+    }
+    u64 units = s.players * s.max_units, chunks = (u64)chunks_w * chunks_h, cells = (u64)((header->w + CELL_SIZE - 1) >> CELL_SHIFT) * ((header->h + CELL_SIZE - 1) >> CELL_SHIFT);
+    u64 path_steps = 0;
+    if (header->sections[SAVE_PATH_CACHE].size == units * sizeof(struct path_cache)) {
+        const struct path_cache *caches = (const struct path_cache *)(file + header->sections[SAVE_PATH_CACHE].offset);
+        for (u64 cache = 0; cache < units; cache++) path_steps += caches[cache].length;
+    }
+    u64 expected[SAVE_SECTION_COUNT] = {
+        [SAVE_CHUNK_TABLE] = header->chunk_count * sizeof(u32), [SAVE_CHUNKS] = chunks * sizeof(struct chunk),
+        [SAVE_UNITS] = units * sizeof(struct unit), [SAVE_DENSE] = units * sizeof(u16), [SAVE_FREE_IDS] = units * sizeof(u16),
+        [SAVE_STACKS] = s.max_stacks * sizeof(struct unit_stack),
+        [SAVE_CELLS] = cells * sizeof(u16), [SAVE_CELL_NEXT] = s.max_stacks * sizeof(u16), [SAVE_CELL_PREV] = s.max_stacks * sizeof(u16), [SAVE_STACK_TILES] = s.max_stacks * sizeof(u32),
+        [SAVE_PATH_CACHE] = units * sizeof(struct path_cache), [SAVE_PATH_STEPS] = path_steps, [SAVE_ORDERS] = (u64)header->order_count * sizeof(struct step)
+    };
+    for (u32 section = 0; section < SAVE_SECTION_COUNT; section++) {
+        if (header->sections[section].size != expected[section]) {
+            printf("%s: section %u holds %llu bytes, the scenario needs %llu\n", path, section, (unsigned long long)header->sections[section].size, (unsigned long long)expected[section]);
+            return -4;
+        }
+    }
+    const u32 *table = (const u32 *)(file + header->sections[SAVE_CHUNK_TABLE].offset);
+    for (u32 chunk = 0; chunk < header->chunk_count; chunk++) {
+        bool on_grid = (chunk & ((1u << column_shift) - 1)) < chunks_w; // the rest is padding up to the power of two
+        if (table[chunk] == NO_CHUNK ? on_grid : table[chunk] >= chunks) {
+            printf("%s: chunk %u points at slot %u of %llu\n", path, chunk, table[chunk], (unsigned long long)chunks);
+            return -5;
+        }
+    }
+    for (u32 player = 0; player < s.players; player++) {
+        if (header->unit_count[player] > s.max_units || header->live[player] > header->unit_count[player] || header->free_count[player] > s.max_units) {
+            printf("%s: player %u has %u units of %u\n", path, player, header->unit_count[player], s.max_units);
+            return -6;
+        }
+    }
+    if (header->stacks_touched > s.max_stacks || (header->stack_free_head != NO_STACK && header->stack_free_head >= s.max_stacks)) {
+        printf("%s: %u stacks touched of %u\n", path, header->stacks_touched, s.max_stacks);
+        return -7;
+    }
+    return check_save_ids(path, file);
+}
+
+// continues a saved game; NULL if the file is missing, from another build or doesn't fit its own header. the file is
+// mapped first and checked before anything points into it
+struct unit_stack *load_world(const char *path, struct unit_list player_units[MAX_PLAYERS], struct path *player_paths[MAX_PLAYERS], struct resolve_order *resolve_order) {
+    u64 start_us = time_us();
+    usize size = 0;
+    u8 *file = map_file(path, &size);
+    if (!file) { printf("No save at %s\n", path); return NULL; }
+    struct save_header *header = (struct save_header *)file;
+    if (size < sizeof(struct save_header) || header->magic != SAVE_MAGIC || header->version != SAVE_VERSION || header->header_size != sizeof(struct save_header) ||
+        header->unit_size != sizeof(struct unit) || header->stack_size != sizeof(struct unit_stack) || header->chunk_size != sizeof(struct chunk)) {
+        printf("%s is not a version %u save of this build\n", path, SAVE_VERSION);
+        return NULL;
+    }
+    if (check_save(path, file, size) != 0) return NULL;
+    #define SECTION(section) ((void *)(file + header->sections[section].offset))
+    scenario = header->scenario;
+    grid = (struct grid){header->w, header->h, header->chunks_w, header->chunks_h, header->column_shift, header->chunk_count};
+    grid.chunks = arena_alloc(&world_arena, sizeof(struct chunk *) * grid.chunk_count);
+    const u32 *table = SECTION(SAVE_CHUNK_TABLE);
+    struct chunk *chunks = SECTION(SAVE_CHUNKS);
+    for (u32 chunk = 0; chunk < grid.chunk_count; chunk++) grid.chunks[chunk] = table[chunk] == NO_CHUNK ? NULL : &chunks[table[chunk]];
+    terrain_present = header->terrain_present;
+    spatial = (struct spatial){(grid.w + CELL_SIZE - 1) >> CELL_SHIFT, (grid.h + CELL_SIZE - 1) >> CELL_SHIFT,
+                               SECTION(SAVE_CELLS), SECTION(SAVE_CELL_NEXT), SECTION(SAVE_CELL_PREV), SECTION(SAVE_STACK_TILES)};
+    for (u32 player = 0; player < scenario.players; player++) {
+        u32 first = player * scenario.max_units;
+        player_units[player] = (struct unit_list){(struct unit *)SECTION(SAVE_UNITS) + first, (u16 *)SECTION(SAVE_DENSE) + first, (u16 *)SECTION(SAVE_FREE_IDS) + first,
+                                                  header->unit_count[player], header->live[player], header->free_count[player]};
+        player_paths[player] = arena_alloc(&world_arena, sizeof(struct path) * scenario.max_units);
+        player_money[player] = header->player_money[player];
+        player_cities[player] = header->player_cities[player];
+    }
+    stack_free_head = header->stack_free_head;
+    stacks_touched = header->stacks_touched;
+    turn_number = header->turn_number;
+    battle_seed = header->battle_seed;
+    change_counter = header->change_counter;
+    init_journal();
+    init_path_cache();
+    init_reservations();
+    init_influence();
+    // the arrays that grow get their own memory, the rest stays in the file's pages
+    const struct path_cache *caches = SECTION(SAVE_PATH_CACHE);
+    const u8 *steps = SECTION(SAVE_PATH_STEPS);
+    for (u32 player = 0; player < scenario.players; player++) {
+        for (u32 id = 0; id < scenario.max_units; id++) {
+            struct path_cache *cache = &path_cache[player][id];
+            *cache = caches[player * scenario.max_units + id];
+            if (cache->length == 0) continue;
+            cache->steps = malloc(cache->length);
+            if (!cache->steps) { fprintf(stderr, "OOM: path cache\n"); exit(1); }
+            memcpy(cache->steps, steps, cache->length);
+            steps += cache->length;
+        }
+    }
+    resolve_order->count = 0;
+    for (u32 order = 0; order < header->order_count; order++) push_step(resolve_order, ((struct step *)SECTION(SAVE_ORDERS))[order]);
+    struct unit_stack *unit_stacks = SECTION(SAVE_STACKS);
+    for (u32 stack_id = 0; stack_id < stacks_touched; stack_id++) // the influence layers are rebuilt from the stacks
+        if (unit_stacks[stack_id].used) influence_changed(stack_id);
+    #undef SECTION
+    printf("Save %s: %.1f MB, %u chunks, loaded in %.1f ms\n", path, size / 1048576.0, grid.chunks_w * grid.chunks_h, elapsed_us(start_us) / 1000.0);
+    return unit_stacks;
+}
+
+// every AUTOSAVE_TURNS turns the world is saved to a temporary file that then replaces the last autosave, and once more
+// on exit. a forked child makes the copy, it sees the world as it was at the fork while the turns go on, so a turn
+// only waits for the fork; windows has no fork, there the turn waits for the copy and a thread writes it. an autosave
+// that is due while the previous one is still being written is skipped
+#ifndef AUTOSAVE_TURNS
+#define AUTOSAVE_TURNS 10
+#endif
+#if !defined(_WIN32)
+#include <sys/wait.h>
+#endif
+struct autosave {
+    struct save_image image;
+    char path[1024]; // empty: no autosaves
+    #if defined(_WIN32)
+    _Atomic u32 writing; // the image belongs to the writer thread while set
+    #else
+    pid_t writer; // the child writing the last autosave, 0 once it is reaped
+    #endif
+    u32 saved, skipped; // autosaves while running, the one on exit isn't counted
+    u32 saved_turn; // turn_number of the last save
+    u64 stall_us, worst_stall_us; // the turn waiting for the fork (or the copy), summed and the longest
+};
+struct autosave autosave;
+
+// path.tmp renamed over path, so a crash while writing leaves the last save whole; no stdio, the forked child calls it
+static bool write_save_file(const char *path, const struct save_image *image) {
+    char temporary[1040];
+    usize length = strlen(path);
+    memcpy(temporary, path, length);
+    memcpy(temporary + length, ".tmp", 5);
+    #if defined(_WIN32)
+    FILE *f = fopen(temporary, "wb");
+    bool written = f && fwrite(image->data, 1, image->size, f) == image->size;
+    if (f && fclose(f) != 0) written = false;
+    if (written) remove(path); // rename doesn't replace on windows
+    #else
+    int fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return false;
+    u32 done = 0;
+    for (ssize_t n; done < image->size && (n = write(fd, image->data + done, image->size - done)) > 0;) done += (u32)n;
+    bool written = close(fd) == 0 && done == image->size;
+    #endif
+    return written && rename(temporary, path) == 0;
+}
+
+#if defined(_WIN32)
+void *write_autosave(void *arg) {
+    struct autosave *a = (struct autosave *)arg;
+    if (!write_save_file(a->path, &a->image)) printf("Autosave to %s failed\n", a->path);
+    atomic_store(&a->writing, 0);
+    return NULL;
+}
 #endif
 
+// whether the last autosave is still being written, wait blocks until it isn't
+static bool autosave_writing(struct autosave *a, bool wait) {
+    #if defined(_WIN32)
+    struct timespec ts = {0, 1000000};
+    while (wait && atomic_load(&a->writing)) nanosleep(&ts, NULL);
+    return atomic_load(&a->writing);
+    #else
+    int status = 1;
+    if (a->writer == 0 || waitpid(a->writer, &status, wait ? 0 : WNOHANG) == 0) return a->writer != 0;
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) printf("Autosave to %s failed\n", a->path);
+    a->writer = 0;
+    return false;
+    #endif
+}
+
+void autosave_world(struct autosave *a, struct unit_list player_units[MAX_PLAYERS], struct unit_stack *unit_stacks, struct resolve_order *resolve_order) {
+    if (!a->path[0] || turn_number % AUTOSAVE_TURNS) return;
+    if (autosave_writing(a, false)) { a->skipped++; return; }
+    u64 start_us = time_us();
+    #if defined(_WIN32)
+    save_world(&a->image, player_units, unit_stacks, resolve_order);
+    atomic_store(&a->writing, 1);
+    thread writer;
+    if (thread_create(&writer, write_autosave, a) != 0) { atomic_store(&a->writing, 0); return; }
+    thread_detach(writer);
+    #else
+    reserve_save(&a->image, resolve_order); // the child mustn't allocate, another thread may hold the allocator's lock at the fork
+    pid_t child = fork();
+    if (child == 0) {
+        save_world(&a->image, player_units, unit_stacks, resolve_order);
+        _exit(write_save_file(a->path, &a->image) ? 0 : 1);
+    }
+    if (child < 0) { printf("Autosave: fork failed\n"); return; }
+    a->writer = child;
+    #endif
+    u64 stall_us = elapsed_us(start_us);
+    a->stall_us += stall_us;
+    if (stall_us > a->worst_stall_us) a->worst_stall_us = stall_us;
+    a->saved++;
+    a->saved_turn = turn_number;
+}
+
+// waits for the autosave being written and saves the turns since then, before exiting; the simulation has stopped
+void finish_autosave(struct autosave *a, struct unit_list player_units[MAX_PLAYERS], struct unit_stack *unit_stacks, struct resolve_order *resolve_order) {
+    if (!a->path[0]) return;
+    autosave_writing(a, true);
+    if (a->saved > 0 && a->saved_turn == turn_number) return;
+    save_world(&a->image, player_units, unit_stacks, resolve_order);
+    if (!write_save_file(a->path, &a->image)) printf("Autosave to %s failed\n", a->path);
+    a->saved_turn = turn_number;
+}
+#pragma endregion
+
 #define MAX_BUFFER_WIDTH (1920)
 #define MAX_BUFFER_HEIGHT (1200)
 
@@ -1193,117 +3825,632 @@ void resize_window_callback(void *userdata, u32 new_w, u32 new_h) {
     camera->buffer_h = need_2x ? (new_h / 2) : new_h;
     camera->end_x = camera->tile_x + (camera->buffer_w / TILE_SIZE) - 1;
     camera->end_y = camera->tile_y + (camera->buffer_h / TILE_SIZE) - 1;
-    if (camera->end_x >= GRID_W) camera->end_x = GRID_W - 1;
-    if (camera->end_y >= GRID_H) camera->end_y = GRID_H - 1;
+    if (camera->end_x >= grid.w) camera->end_x = grid.w - 1;
+    if (camera->end_y >= grid.h) camera->end_y = grid.h - 1;
+    camera->update = 1;
     printf("Display and buffer: %dx%d and %dx%d\n", camera->display_w, camera->display_h, camera->buffer_w, camera->buffer_h);
 }
 
-i32 main(void) {
-    struct camera camera = {0, 0, 0, 0, NULL, 0, 0, 0, 0, 0, 0, 1};
-    struct ctx *window = create_window(key_input_callback, mouse_input_callback, resize_window_callback, &camera);
-    struct scaler scaler; create_scaler(&scaler, 8);
+#if !HEADLESS
+// a rect of the buffer onto the display: upscaled if it's smaller, and an indexed one looked up in the palette
+void present_rect(struct camera camera, struct scaler *scaler, struct ctx *window, u32 x, u32 y, u32 w, u32 h) {
+    if (camera.indices && camera.need_scaling) {
+        scale_indexed_rect(scaler, camera.indices, camera.buffer_w, camera.buffer_h, indexed_palette, get_buffer(window), camera.display_w, x, y, w, h);
+    } else if (camera.indices) {
+        look_up_indices(get_buffer(window), camera.indices, camera.buffer_w, x, y, w, h);
+    } else if (camera.need_scaling) {
+        scale_rect(scaler, camera.buffer, camera.buffer_w, camera.buffer_h, get_buffer(window), camera.display_w, x, y, w, h);
+    }
+}
 
-    map = tga_load("data/map.tga");
-    units = tga_load("data/units.tga");
-    players = tga_load("data/players.tga");
-    
-    struct tga map_atlas = tga_load("data/map_atlas.tga");
-    struct tga units_atlas = tga_load("data/units_atlas.tga");
-    struct tga directions_atlas = tga_load("data/directions_atlas.tga");
+// upscales and damages the dirty tiles, a rectangle per run of rows with the same dirty columns, or everything after a
+// scroll, and submits them
+void present_dirty(struct camera camera, struct frame_tiles *frame, struct scaler *scaler, struct ctx *window) {
+    u32 scaling = camera.need_scaling ? 2 : 1;
+    if (frame->scrolled) { // all the tiles moved
+        u32 w = (camera.end_x - camera.tile_x + 1) * TILE_SIZE, h = (camera.end_y - camera.tile_y + 1) * TILE_SIZE;
+        if (w > camera.buffer_w) w = camera.buffer_w;
+        if (h > camera.buffer_h) h = camera.buffer_h;
+        present_rect(camera, scaler, window, 0, 0, w, h);
+        damage(window, 0, 0, w * scaling, h * scaling);
+        commit_damage(window);
+        frame->scrolled = false;
+        return;
+    }
+    for (u32 row = 0; row < VIEW_ROWS;) {
+        u32 dirty = frame->dirty[row];
+        if (!dirty) { row++; continue; }
+        u32 first = __builtin_ctz(dirty), last = 31 - __builtin_clz(dirty), end = row + 1;
+        while (end < VIEW_ROWS && frame->dirty[end] && __builtin_ctz(frame->dirty[end]) == first && 31 - __builtin_clz(frame->dirty[end]) == last) end++;
+        u32 x = first * TILE_SIZE, y = row * TILE_SIZE, w = (last + 1 - first) * TILE_SIZE, h = (end - row) * TILE_SIZE;
+        if (x + w > camera.buffer_w) w = camera.buffer_w - x;
+        if (y + h > camera.buffer_h) h = camera.buffer_h - y;
+        present_rect(camera, scaler, window, x, y, w, h);
+        damage(window, x * scaling, y * scaling, w * scaling, h * scaling);
+        row = end;
+    }
+    commit_damage(window); // tell compositor it can read from the buffer
+}
+#endif
 
-    // Player unit movement structs
-    struct unit_list player_units[PLAYER_COUNT] = {0};
-    struct unit_stack unit_stacks[PLAYER_COUNT * MAX_UNITS] = {0}; // beetje big ,, geen count bijgehouden dus geen loop mogelijk
-    
-    struct resolve_bucket resolve_order[BUCKET_COUNT] = {0};
+// what the benches and headless runs check their results with, which every thread count has to agree on: FNV-1a over
+// values or bytes; and the LCG the benches draw their inputs from, the same ones every run
+#define BENCH_SEED 12345
+#define BENCH_HASH_BASIS 14695981039346656037ull
+static inline u64 bench_hash(u64 hash, u64 value) { return (hash ^ value) * 1099511628211ull; }
+static inline u64 bench_hash_bytes(u64 hash, const void *bytes, usize size) {
+    for (usize i = 0; i < size; i++) hash = bench_hash(hash, ((const u8 *)bytes)[i]);
+    return hash;
+}
+static inline u32 bench_rand(u32 *seed) { return *seed = *seed * 1664525u + 1013904223u; }
 
-    struct path player_paths[PLAYER_COUNT][MAX_UNITS] = {0};
+#if HEADLESS
+// the end state of a headless run
+u64 world_hash(struct unit_list player_units[MAX_PLAYERS]) {
+    u64 hash = BENCH_HASH_BASIS;
+    #define HASH(value) (hash = bench_hash(hash, (u64)(value)))
+    for (u32 player = 0; player < scenario.players; player++) {
+        HASH(player_money[player]); HASH(player_cities[player]); HASH(player_units[player].count);
+        for (u32 id = 0; id < player_units[player].count; id++) {
+            struct unit *unit = &player_units[player].units[id];
+            HASH(unit->type);
+            if (unit->type != -1) { HASH(unit->x); HASH(unit->y); HASH(unit->generation); }
+        }
+    }
+    for (u32 y = 0; y < grid.h; y++) // row-major, so the hash doesn't depend on the chunk layout
+        for (u32 x = 0; x < grid.w; x++) HASH(grid_owner(tile_at(x, y)) | (grid_stack(tile_at(x, y)) == NO_STACK) << 8);
+    #undef HASH
+    return hash;
+}
+#endif
 
-    // find the cities on the map
-    for (u32 y = 0; y < map.h; ++y) {
-        for (u32 x = 0; x < map.w; ++x) {
-            u32 income = tile_income[get_tile(x, y)];
-            if (income > 0) {
-                u32 player_id = get_player(x, y);
-                if (player_id != -1) player_cities[player_id] += income;
+#if BENCH_PATHING
+// tcc -DBENCH_PATHING=1 main.c -run -lwayland-client
+// random passable start/target pairs on the loaded map, routed for the unit type the AI uses
+void bench_pathing(struct unit_stack *unit_stacks) {
+    u32 *passable = malloc(sizeof(u32) * grid.w * grid.h), passable_count = 0;
+    for (u32 y = 0; y < grid.h; y++)
+        for (u32 x = 0; x < grid.w; x++)
+            if (terrain_cost[MOTORIZED][get_tile(x, y)] != COST_IMPASSABLE) passable[passable_count++] = tile_at(x, y);
+    u32 seed = BENCH_SEED, queries = 0, found = 0, total_length = 0;
+    u64 start_us = time_us();
+    while (elapsed_us(start_us) < 2000000) {
+        for (u32 i = 0; i < 1000; i++) {
+            u32 from = passable[(bench_rand(&seed) >> 8) % passable_count];
+            u32 to = passable[(bench_rand(&seed) >> 8) % passable_count];
+            u32 length = 0;
+            if (pathing(&workers.searches[0], tile_x(from), tile_y(from), tile_x(to), tile_y(to), &length, MOTORIZED, GERMANY, unit_stacks) == 1) {
+                found++;
+                total_length += length;
             }
+            queries++;
         }
     }
-    
-    // loop over units in units tga and use the add_unit function to add them to the grid
-    for (u32 y = 0; y < units.h; ++y) {
-        for (u32 x = 0; x < units.w; ++x) {
-            u32 pixel = units.pix[y * units.w + x];
-            if (pixel != 0) { // unit is not empty pixel
-                enum units unit = get_unit_load(x, y);
-                units.pix[y * units.w + x] = 0;
-                i32 result = add_unit(get_player(x, y), unit, x, y, player_units, unit_stacks);
-                assert(result == 0 && "Init unit map went wrong\n");
+    u64 us = elapsed_us(start_us);
+    printf("pathing: %u queries in %llu us, %.0f queries/s, %u found, %.1f avg steps\n",
+           queries, (unsigned long long)us, queries * 1e6 / us, found, found ? (f64)total_length / found : 0.0);
+}
+#endif
+
+#if BENCH_AI || BENCH_BATTLES || BENCH_ROLLOUTS
+// runs a round of a bench on 1 to 16 threads, on one pool that is recreated with each size and shut down at the end;
+// a round prints its numbers and returns a hash of what it computed, which every thread count has to agree on
+void bench_thread_counts(u64 (*round)(struct workers *workers, void *bench), void *bench, const char *results) {
+    static struct workers bench_workers;
+    u32 thread_counts[] = {1, 2, 4, 8, 12, 16};
+    u64 reference = 0;
+    for (u32 i = 0; i < sizeof(thread_counts) / sizeof(thread_counts[0]); i++) {
+        create_workers(&bench_workers, thread_counts[i]);
+        printf("%2u threads: ", thread_counts[i]);
+        u64 hash = round(&bench_workers, bench);
+        if (i == 0) reference = hash;
+        printf(hash == reference ? ", same %s\n" : ", %s DIFFER\n", results);
+        destroy_workers(&bench_workers);
+    }
+}
+#endif
+
+#if BENCH_AI
+// cold clears the path caches before planning, warm replans with the paths that gives (nothing moved)
+u64 bench_ai_round(struct workers *workers, void *bench) {
+    struct plan_job *job = bench;
+    const u32 runs = 10;
+    u64 cold_us = 0, warm_us = 0;
+    for (u32 run = 0; run < runs; run++) {
+        for (u32 player = 0; player < scenario.players; player++)
+            for (u32 id = 0; id < scenario.max_units; id++) path_cache[player][id].valid = 0;
+        u64 start_us = time_us();
+        plan_units(workers, job);
+        cold_us += elapsed_us(start_us);
+        start_us = time_us();
+        plan_units(workers, job);
+        warm_us += elapsed_us(start_us);
+    }
+    printf("cold %8.1f us, warm %7.1f us", (f64)cold_us / runs, (f64)warm_us / runs);
+    u64 hash = BENCH_HASH_BASIS;
+    for (u32 player = 0; player < scenario.players; player++) {
+        for (u32 live = 0; live < job->player_units[player].live; live++) {
+            struct path *path = &job->player_paths[player][job->player_units[player].dense[live]];
+            hash = bench_hash_bytes(bench_hash_bytes(hash, &path->length, sizeof path->length), path->steps, path->length);
+        }
+    }
+    return hash;
+}
+
+// tcc -DBENCH_AI=1 main.c -run -lwayland-client (with max_units = 1024 in data/scenario.txt)
+// fills both armies up to max_units on random owned land, then plans player 0 with 1 to 16 threads
+void bench_ai(struct unit_list player_units[MAX_PLAYERS], struct unit_stack *unit_stacks) {
+    u32 seed = BENCH_SEED, total = 0;
+    for (u32 tries = 0; tries < 100000000 && total < scenario.max_stacks; tries++) {
+        u32 at = (bench_rand(&seed) >> 8) % (grid.w * grid.h), x = at % grid.w, y = at / grid.w;
+        if (get_player(x, y) == -1 || terrain_cost[INFANTRY][get_tile(x, y)] == COST_IMPASSABLE) continue;
+        if (player_units[get_player(x, y)].live < scenario.max_units && add_unit(get_player(x, y), INFANTRY, x, y, player_units, unit_stacks) == 0) total++;
+    }
+    struct path *paths[MAX_PLAYERS] = {0};
+    for (u32 player = 0; player < scenario.players; player++) paths[player] = calloc(scenario.max_units, sizeof(struct path));
+    update_influence(player_units, unit_stacks);
+    struct plan_job job = {scenario.players, player_units, paths, unit_stacks};
+    printf("planning %u units of %u players\n", total, scenario.players);
+    bench_thread_counts(bench_ai_round, &job, "paths");
+}
+#endif
+
+#if BENCH_BATTLES
+u64 bench_battles_round(struct workers *workers, void *bench) {
+    struct battles *b = bench;
+    const u32 runs = 20;
+    u64 start_us = time_us();
+    for (u32 run = 0; run < runs; run++) roll_battles(workers, b, 1, run);
+    u64 us = elapsed_us(start_us);
+    u32 wins[4] = {0};
+    for (u32 e = 0; e < b->count; e++) wins[b->outcome[e]]++;
+    printf("%.1f M engagements/s, attacker %u defender %u draw %u", (f64)b->count * runs / us, wins[ATTACKER_WINS], wins[DEFENDER_WINS], wins[DRAW]);
+    return bench_hash_bytes(BENCH_HASH_BASIS, b->outcome, b->count);
+}
+
+// tcc -DBENCH_BATTLES=1 main.c -run -lwayland-client
+// rolls a batch of random engagements on the map over and over, the way resolve_battles does after a bucket
+void bench_battles(void) {
+    const u32 count = 1 << 20;
+    struct battles b = {0};
+    b.capacity = count;
+    b.tile = malloc(sizeof(u32) * count), b.attacker = malloc(sizeof(u32) * count);
+    b.attack = malloc(sizeof(u32) * count), b.defence = malloc(sizeof(u32) * count);
+    b.outcome = malloc(count);
+    u32 seed = BENCH_SEED;
+    for (b.count = 0; b.count < count; b.count++) {
+        u32 at = bench_rand(&seed), attacker = bench_rand(&seed), strength = bench_rand(&seed);
+        b.tile[b.count] = tile_at((at >> 8) % grid.w, (at >> 16) % grid.h);
+        b.attacker[b.count] = STEP_ID((attacker >> 8) % scenario.players, (attacker >> 12) % scenario.max_units);
+        b.attack[b.count] = 10 + (strength >> 8) % 200; b.defence[b.count] = 10 + (strength >> 20) % 200;
+    }
+    bench_thread_counts(bench_battles_round, &b, "outcomes");
+}
+#endif
+
+#if BENCH_BLIT
+// gcc -O2 -DBENCH_BLIT=1 main.c -lwayland-client -lpthread -lm
+// every sprite of the units and directions atlases blitted over a noisy buffer, first checked pixel for pixel against
+// the scalar blitter at every width a clipped sprite can have, then timed full width for each blitter the CPU runs
+void bench_blit(void) {
+    struct tga atlases[] = {tga_load("data/units_atlas.tga"), tga_load("data/directions_atlas.tga")};
+    const char *atlas_names[] = {"units_atlas", "directions_atlas"};
+    struct blitters candidates[] = {
+        {"scalar", blit_masked_scalar, blit_masked_scalar, rle_blit_scalar},
+        #if HAVE_X86_SIMD
+        {"sse4.1", blit_masked_sse4, blit_masked_sse4_tile, rle_blit_ssse3},
+        {"avx2", blit_masked_avx2, blit_masked_avx2_tile, rle_blit_ssse3},
+        #endif
+    };
+    #if HAVE_X86_SIMD
+    __builtin_cpu_init();
+    bool supported[] = {true, __builtin_cpu_supports("sse4.1"), __builtin_cpu_supports("avx2")};
+    #else
+    bool supported[] = {true};
+    #endif
+    const u32 buffer_w = 1920, buffer_h = 1080, columns = buffer_w / TILE_SIZE, rows = buffer_h / TILE_SIZE;
+    u32 *noise = malloc(sizeof(u32) * buffer_w * buffer_h), *reference = malloc(sizeof(u32) * buffer_w * buffer_h), *buffer = malloc(sizeof(u32) * buffer_w * buffer_h);
+    u32 seed = BENCH_SEED;
+    for (u32 i = 0; i < buffer_w * buffer_h; i++) noise[i] = bench_rand(&seed);
+
+    for (u32 c = 0; c < sizeof(candidates) / sizeof(candidates[0]); c++) {
+        if (!supported[c]) { printf("%-7s not supported by this CPU\n", candidates[c].name); continue; }
+        for (u32 a = 0; a < 2; a++) {
+            struct tga atlas = atlases[a];
+            u32 sprites = (atlas.w / TILE_SIZE) * (atlas.h / TILE_SIZE), mismatches = 0;
+            for (u32 width = 1; width <= TILE_SIZE; width++) { // each width blitted at an odd offset, so nothing is aligned
+                memcpy(reference, noise, sizeof(u32) * buffer_w * buffer_h);
+                memcpy(buffer, noise, sizeof(u32) * buffer_w * buffer_h);
+                for (u32 sprite = 0; sprite < sprites; sprite++) {
+                    usize to = (sprite % columns) * TILE_SIZE + (sprite / columns % rows) * TILE_SIZE * buffer_w + width % 3;
+                    const u32 *from = atlas.pix + (sprite / ATLAS_SIZE) * TILE_SIZE * atlas.w + (sprite % ATLAS_SIZE) * TILE_SIZE;
+                    blit_masked_scalar(reference + to, buffer_w, from, atlas.w, width, TILE_SIZE - width % 2);
+                    (width == TILE_SIZE ? candidates[c].masked_tile : candidates[c].masked)(buffer + to, buffer_w, from, atlas.w, width, TILE_SIZE - width % 2);
+                }
+                if (memcmp(reference, buffer, sizeof(u32) * buffer_w * buffer_h)) mismatches++;
+            }
+            const u32 runs = 200;
+            u64 start_us = time_us();
+            for (u32 run = 0; run < runs; run++) {
+                for (u32 tile = 0; tile < columns * rows; tile++) {
+                    u32 sprite = (tile + run) % sprites;
+                    candidates[c].masked_tile(buffer + (tile / columns) * TILE_SIZE * buffer_w + (tile % columns) * TILE_SIZE, buffer_w,
+                                              atlas.pix + (sprite / ATLAS_SIZE) * TILE_SIZE * atlas.w + (sprite % ATLAS_SIZE) * TILE_SIZE, atlas.w, TILE_SIZE, TILE_SIZE);
+                }
+            }
+            u64 us = elapsed_us(start_us);
+            f64 blits = (f64)runs * columns * rows;
+            printf("%-7s %-16s %6.1f ns per 64x64 sprite, %5.1f GB/s read+written, %s\n", candidates[c].name, atlas_names[a], us * 1000.0 / blits,
+                   blits * TILE_SIZE * TILE_SIZE * 3 * sizeof(u32) / (us * 1000.0), mismatches ? "OUTPUT DIFFERS FROM SCALAR" : "same output as scalar");
+        }
+    }
+    pick_blitters();
+    printf("picked: %s\n", blitters.name);
+}
+#endif
+
+#if BENCH_RLE
+// gcc -O2 -DBENCH_RLE=1 main.c -lwayland-client -lpthread -lm
+// palette/map_atlas.bin decoded tile by tile against palette/map_atlas.tga quantized the way encode.c does it, then a
+// screen of terrain tiles timed: copied from the 32 bit map atlas like the terrain pages are baked, and decoded from tokens
+static u32 nearest_rle_color(u32 argb) {
+    u32 best = 0, best_distance = ~0u;
+    for (u32 i = 0; i < 16; i++) {
+        i32 dr = (i32)(argb >> 16 & 0xFF) - (i32)(rle_palette[i] >> 16 & 0xFF), dg = (i32)(argb >> 8 & 0xFF) - (i32)(rle_palette[i] >> 8 & 0xFF);
+        i32 db = (i32)(argb & 0xFF) - (i32)(rle_palette[i] & 0xFF);
+        u32 distance = (u32)(dr * dr + dg * dg + db * db);
+        if (distance < best_distance) best_distance = distance, best = i;
+    }
+    return rle_palette[best];
+}
+
+void bench_rle(void) {
+    struct rle_atlas rle;
+    if (load_rle_atlas("../palette/map_atlas.bin", &rle) < 0) return;
+    struct tga source = tga_load("../palette/map_atlas.tga"); // what the .bin was encoded from
+    struct tga atlas = tga_load("data/map_atlas.tga");
+    pick_blitters();
+    rle_blit_fn decoders[] = {rle_blit_scalar, blitters.rle};
+    const char *decoder_names[] = {"scalar", blitters.rle == rle_blit_scalar ? "scalar" : "ssse3"};
+    printf("map atlas: %.1f KB as 32 bit TGA, %.1f KB as 4 bit RLE (%u tiles, %.0f token bytes per tile against %u)\n",
+           atlas.w * atlas.h * 4 / 1024.0, rle.size / 1024.0, rle.count, (f64)(rle.size - rle.count * sizeof(u32)) / rle.count, TILE_SIZE * TILE_SIZE * 4);
+
+    u32 tile_pixels[TILE_SIZE * TILE_SIZE], expected[TILE_SIZE * TILE_SIZE];
+    for (u32 d = 0; d < 2; d++) {
+        u32 mismatches = 0;
+        for (u32 tile = 0; tile < rle.count; tile++) {
+            for (u32 y = 0; y < TILE_SIZE; y++)
+                for (u32 x = 0; x < TILE_SIZE; x++)
+                    expected[y * TILE_SIZE + x] = nearest_rle_color(source.pix[((tile / ATLAS_SIZE) * TILE_SIZE + y) * source.w + (tile % ATLAS_SIZE) * TILE_SIZE + x]);
+            memset(tile_pixels, 0, sizeof tile_pixels);
+            decoders[d](tile_pixels, TILE_SIZE, rle.file + rle.offsets[tile], rle_palette, TILE_SIZE, TILE_SIZE);
+            bool same = !memcmp(tile_pixels, expected, sizeof tile_pixels);
+            memset(tile_pixels, 0, sizeof tile_pixels);
+            decoders[d](tile_pixels, TILE_SIZE, rle.file + rle.offsets[tile], rle_palette, 37, 50); // clipped
+            for (u32 y = 0; y < TILE_SIZE; y++)
+                for (u32 x = 0; x < TILE_SIZE; x++)
+                    same &= tile_pixels[y * TILE_SIZE + x] == (x < 37 && y < 50 ? expected[y * TILE_SIZE + x] : 0);
+            mismatches += !same;
+        }
+        printf("%-6s decoder: %u of %u tiles differ from the quantized TGA\n", decoder_names[d], mismatches, rle.count);
+    }
+
+    u32 player_palettes[MAX_PLAYERS][16]; // red swapped for each player's colour
+    for (u32 player = 0; player < MAX_PLAYERS; player++) {
+        memcpy(player_palettes[player], rle_palette, sizeof rle_palette);
+        player_palettes[player][8] = 0xFF000000u | player_colors[player];
+    }
+    const u32 buffer_w = 1920, buffer_h = 1080, columns = buffer_w / TILE_SIZE, rows = buffer_h / TILE_SIZE, runs = 200;
+    u32 *buffer = malloc(sizeof(u32) * buffer_w * buffer_h);
+    u32 tiles = atlas.w / TILE_SIZE * (atlas.h / TILE_SIZE) < rle.count ? atlas.w / TILE_SIZE * (atlas.h / TILE_SIZE) : rle.count;
+    for (u32 method = 0; method < 4; method++) {
+        u64 start_us = time_us(), source_bytes = 0;
+        for (u32 run = 0; run < runs; run++) {
+            for (u32 i = 0; i < columns * rows; i++) {
+                u32 tile = (i * 7 + run) % tiles;
+                u32 *to = buffer + (i / columns) * TILE_SIZE * buffer_w + (i % columns) * TILE_SIZE;
+                if (method == 0) {
+                    const u32 *atlas_row = atlas.pix + (tile / ATLAS_SIZE) * TILE_SIZE * atlas.w + (tile % ATLAS_SIZE) * TILE_SIZE;
+                    for (u32 row = 0; row < TILE_SIZE; row++, atlas_row += atlas.w, to += buffer_w) memcpy(to, atlas_row, TILE_SIZE * sizeof(u32));
+                    source_bytes += TILE_SIZE * TILE_SIZE * sizeof(u32);
+                } else {
+                    const u32 *palette = method == 3 ? player_palettes[i % MAX_PLAYERS] : rle_palette;
+                    decoders[method == 1 ? 0 : 1](to, buffer_w, rle.file + rle.offsets[tile], palette, TILE_SIZE, TILE_SIZE);
+                    source_bytes += (tile + 1 < rle.count ? rle.offsets[tile + 1] : rle.size) - rle.offsets[tile];
+                }
             }
         }
+        u64 us = elapsed_us(start_us);
+        const char *names[] = {"copy from TGA", "rle scalar", "rle ssse3", "rle ssse3, palette per player"};
+        if (method == 2 || method == 3) names[method] = blitters.rle == rle_blit_scalar ? "rle (no ssse3)" : names[method];
+        printf("%-30s %6.1f ns per tile, %6.1f KB read per tile, %5.2f ms per %ux%u screen of tiles\n", names[method], us * 1000.0 / ((f64)runs * columns * rows),
+               source_bytes / 1024.0 / ((f64)runs * columns * rows), us / 1000.0 / runs, columns * TILE_SIZE, rows * TILE_SIZE);
     }
+}
+#endif
+
+#if BENCH_INDEXED
+// gcc -O2 -DBENCH_INDEXED=1 main.c -lwayland-client -lpthread -lm
+// a screen of terrain copied out of a page the way a full redraw does it and put on the display, with a 32 bit and an
+// indexed frame buffer: at 1080p the 32 bit buffer is the display and the indexed one is looked up into it, at 4K both
+// are upscaled; the indexed upscale is checked against upscaling the colours of its indices
+void bench_indexed(void) {
+    struct tga atlas = tga_load("data/map_atlas.tga"); // PAGE_PIXELS wide, a baked page would look the same
+    if (atlas.w != PAGE_PIXELS || atlas.h < PAGE_PIXELS) { printf("map atlas is %ux%u, expected %ux%u\n", atlas.w, atlas.h, PAGE_PIXELS, PAGE_PIXELS); return; }
+    init_indexed();
+    index_atlas(&atlas);
+    struct scaler scaler; create_scaler(&scaler, 8);
+    void (*fastest)(const struct data *, u32, u32) = scaler.scale_indices;
+    const u32 buffer_w = 1920, buffer_h = 1080, runs = 50;
+    u32 *buffer = malloc(sizeof(u32) * buffer_w * buffer_h), *colors = malloc(sizeof(u32) * buffer_w * buffer_h);
+    u32 *display = malloc(sizeof(u32) * 4 * buffer_w * buffer_h), *expected = malloc(sizeof(u32) * 4 * buffer_w * buffer_h);
+    u8 *indices = malloc(buffer_w * buffer_h);
+    if (!buffer || !colors || !display || !expected || !indices) { fprintf(stderr, "OOM: bench indexed\n"); exit(1); }
+
+    for (u32 method = 0; method < 5; method++) {
+        bool indexed = method != 0 && method != 2, upscaled = method >= 2;
+        u32 bytes = indexed ? 1 : sizeof(u32), display_w = upscaled ? buffer_w * 2 : buffer_w, display_h = upscaled ? buffer_h * 2 : buffer_h;
+        u8 *pixels = indexed ? indices : (u8 *)buffer;
+        const u8 *page = indexed ? atlas.indices : (const u8 *)atlas.pix;
+        scaler.scale_indices = method == 3 ? scale_indices_scalar : fastest;
+        u64 draw_us = 0, present_us = 0;
+        for (u32 run = 0; run < runs; run++) {
+            u64 start_us = time_us();
+            for (u32 y = 0; y < buffer_h; y++)
+                for (u32 x = 0; x < buffer_w; x += PAGE_PIXELS) {
+                    u32 width = x + PAGE_PIXELS > buffer_w ? buffer_w - x : PAGE_PIXELS;
+                    memcpy(pixels + ((usize)y * buffer_w + x) * bytes, page + (usize)((y + run) % PAGE_PIXELS) * PAGE_PIXELS * bytes, width * bytes);
+                }
+            draw_us += elapsed_us(start_us);
+            start_us = time_us();
+            if (indexed && upscaled) scale_indexed_rect(&scaler, indices, buffer_w, buffer_h, indexed_palette, display, display_w, 0, 0, buffer_w, buffer_h);
+            else if (indexed) look_up_indices(display, indices, buffer_w, 0, 0, buffer_w, buffer_h);
+            else if (upscaled) scale_rect(&scaler, buffer, buffer_w, buffer_h, display, display_w, 0, 0, buffer_w, buffer_h);
+            present_us += elapsed_us(start_us);
+        }
+        const char *result = "";
+        if (indexed) {
+            for (usize i = 0; i < (usize)buffer_w * buffer_h; i++) colors[i] = indexed_palette[indices[i]];
+            if (upscaled) scale_rect(&scaler, colors, buffer_w, buffer_h, expected, display_w, 0, 0, buffer_w, buffer_h);
+            else memcpy(expected, colors, sizeof(u32) * buffer_w * buffer_h);
+            result = memcmp(display, expected, sizeof(u32) * display_w * display_h) ? ", DIFFERS from its colours" : ", same as its colours";
+        }
+        // copied out of the page into the buffer, then read back to write the display unless it is the display
+        f64 moved = (f64)buffer_w * buffer_h * bytes * 2 + (indexed || upscaled ? (f64)buffer_w * buffer_h * bytes + (f64)display_w * display_h * sizeof(u32) : 0);
+        const char *names[] = {"32 bit", "indexed", "32 bit, upscaled", "indexed scalar, upscaled", fastest == scale_indices_scalar ? "indexed (no ssse3), upscaled" : "indexed ssse3, upscaled"};
+        printf("%4ux%-4u %-28s draw %5.2f ms, present %5.2f ms, frame %5.2f ms, %5.1f MB moved%s\n", display_w, display_h, names[method], draw_us / 1000.0 / runs,
+               present_us / 1000.0 / runs, (draw_us + present_us) / 1000.0 / runs, moved / 1048576.0, result);
+    }
+}
+#endif
 
-    u32 frame = 0;
+#if BENCH_ROLLOUTS
+u64 bench_rollouts_round(struct workers *workers, void *bench) {
+    struct rollout_job *job = bench;
     u64 start_us = time_us();
-    
+    evaluate_rollouts(workers, job);
+    u64 us = elapsed_us(start_us);
+    u32 best = 0;
+    i64 best_total = 0;
+    for (u32 c = 0; c < job->candidates; c++) {
+        i64 total = 0;
+        for (u32 r = 0; r < job->rollouts; r++) total += job->scores[c * job->rollouts + r];
+        if (c == 0 || total > best_total) best_total = total, best = c;
+    }
+    printf("%.0f simulated turns/s, best candidate %u (mean score %.1f)", (f64)job->candidates * job->rollouts * job->turns * 1e6 / us, best, (f64)best_total / job->rollouts);
+    return bench_hash_bytes(BENCH_HASH_BASIS, job->scores, sizeof(i64) * job->candidates * job->rollouts);
+}
+
+// tcc -DBENCH_ROLLOUTS=1 main.c -run -lwayland-client
+// the whole map as a rollout world; candidate c sends every unit of player 0 to its c-th nearest enemy stack
+void bench_rollouts(struct unit_list player_units[MAX_PLAYERS], struct unit_stack *unit_stacks) {
+    struct sim_world *start = cut_sim_world(0, 0, grid.w, grid.h, player_units, unit_stacks);
+    const u32 candidates = 8, rollouts = 64, turns = 10;
+    u32 *targets = malloc(sizeof(u32) * candidates * start->unit_count);
+    for (u32 unit = 0; unit < start->unit_count; unit++) {
+        struct sim_unit *sim_unit = &sim_units(start)[unit];
+        u16 nearest[8];
+        u32 found = sim_unit->player == 0 ? spatial_nearest_enemies(sim_map_x(start, sim_unit->tile), sim_map_y(start, sim_unit->tile), 0, candidates, 2500, nearest, unit_stacks) : 0;
+        for (u32 c = 0; c < candidates; c++) {
+            u32 target = found ? sim_window_tile(start, spatial.tile[nearest[c % found]]) : NO_TILE;
+            targets[c * start->unit_count + unit] = target != NO_TILE ? target : sim_unit->target;
+        }
+    }
+    struct sim_world *copy = malloc(start->bytes);
+    u64 start_us = time_us();
+    for (u32 i = 0; i < 100000; i++) { clone_sim_world(copy, start); copy->seed += i; }
+    printf("rollout world: %u bytes, %u units, clone %.0f ns\n", start->bytes, start->unit_count, elapsed_us(start_us) * 1000.0 / 100000);
+    struct rollout_job job = {start, 0, candidates, targets, rollouts, turns, malloc(sizeof(i64) * candidates * rollouts)};
+    bench_thread_counts(bench_rollouts_round, &job, "scores");
+}
+#endif
+
+#if HEADLESS
+// tcc -DHEADLESS=1 main.c -run [turns] [data directory] [seed] [save to continue] [autosave path]
+// (scenario/generate.c writes data directories of any size and layout)
+// plays whole turns back to back the way script does, without sleeping or a window, and prints the throughput, the
+// time per phase and a hash of the final state; a scenario, seed and build give the same hash for any SIM_THREADS
+enum phases { PHASE_ECONOMY, PHASE_INFLUENCE, PHASE_PLAN, PHASE_RESOLVE, PHASE_PUBLISH, PHASE_SAVE, PHASE_COUNT };
+const char *phase_names[PHASE_COUNT] = {"economy", "influence", "plan", "resolve", "publish", "save"};
+
+void run_headless(u32 turns, u32 seed, struct unit_list player_units[MAX_PLAYERS], struct path **player_paths, struct resolve_order *resolve_order, struct unit_stack *unit_stacks) {
+    battle_seed = seed;
+    create_workers(&workers, SIM_THREADS);
+    static struct snapshots snapshots; // published like the script thread does, nobody reads them
+    init_snapshots(&snapshots, player_units, unit_stacks, resolve_order);
+    u64 phase_us[PHASE_COUNT] = {0}, steps = 0;
+    u64 start_us = time_us();
+    for (u32 turn = 0; turn < turns; turn++) {
+        u64 phase_start = time_us();
+        for (u32 player = 0; player < scenario.players; player++) player_turn(player, player_units, unit_stacks);
+        phase_us[PHASE_ECONOMY] += elapsed_us(phase_start); phase_start = time_us();
+        update_influence(player_units, unit_stacks);
+        phase_us[PHASE_INFLUENCE] += elapsed_us(phase_start); phase_start = time_us();
+        ai_unit_movement(player_units, player_paths, resolve_order, unit_stacks);
+        phase_us[PHASE_PLAN] += elapsed_us(phase_start); phase_start = time_us();
+        steps += resolve_order->count;
+        resolve_turn(player_units, resolve_order, unit_stacks);
+        phase_us[PHASE_RESOLVE] += elapsed_us(phase_start); phase_start = time_us();
+        publish_snapshot(&snapshots, player_units, unit_stacks, resolve_order);
+        phase_us[PHASE_PUBLISH] += elapsed_us(phase_start); phase_start = time_us();
+        autosave_world(&autosave, player_units, unit_stacks, resolve_order);
+        phase_us[PHASE_SAVE] += elapsed_us(phase_start);
+    }
+    u64 us = elapsed_us(start_us);
+    finish_autosave(&autosave, player_units, unit_stacks, resolve_order); // the last write isn't part of the timings
+    u32 live = 0;
+    for (u32 player = 0; player < scenario.players; player++) live += player_units[player].live;
+    printf("headless: %u turns in %.1f ms, %.2f turns/s, %u threads, %u players, %u units left, %llu steps\n",
+           turns, us / 1000.0, turns ? turns * 1e6 / us : 0.0, workers.number_of_threads, scenario.players, live, (unsigned long long)steps);
+    for (u32 phase = 0; phase < PHASE_COUNT; phase++)
+        printf("  %-8s %10.1f ms total, %8.1f us per turn, %5.1f%%\n", phase_names[phase], phase_us[phase] / 1000.0,
+               turns ? (f64)phase_us[phase] / turns : 0.0, us ? phase_us[phase] * 100.0 / us : 0.0);
+    if (autosave.path[0])
+        printf("autosave: %.1f MB, every %u turns and on exit, %u saved, %u skipped while writing, stall %.1f us on average, %.1f us at most\n",
+               autosave.image.capacity / 1048576.0, AUTOSAVE_TURNS, autosave.saved, autosave.skipped,
+               autosave.saved ? (f64)autosave.stall_us / autosave.saved : 0.0, (f64)autosave.worst_stall_us);
+    printf("hash: %016llx\n", (unsigned long long)world_hash(player_units));
+}
+#endif
+
+i32 main(i32 argc, char **argv) {
+    #if HEADLESS
+    u32 turns = argc > 1 ? (u32)atoi(argv[1]) : 100;
+    if (argc > 2) data_dir = argv[2];
+    u32 seed = argc > 3 ? (u32)atoi(argv[3]) : 1;
+    #else
+    struct camera camera = {0, 0, 0, 0, NULL, 0, 0, 0, 0, 0, 0, 1};
+    bool indexed = argc > 1 && !strcmp(argv[argc - 1], "--indexed"); // draw to a byte per pixel, see INDEXED
+    if (indexed) argc--;
+    #endif
+
+    const char *save_path = argc > 1 ? argv[1] : NULL; // a save to continue instead of the scenario in data_dir
+    #if HEADLESS
+    save_path = argc > 4 && argv[4][0] ? argv[4] : NULL; // "" to start from the scenario and still autosave
+    #endif
+
+    u64 load_us = time_us();
+    // Player unit movement structs
+    struct unit_list player_units[MAX_PLAYERS] = {0};
+    struct path *player_paths[MAX_PLAYERS] = {0};
+    static struct resolve_order resolve_order;
+    struct unit_stack *unit_stacks = save_path ? load_world(save_path, player_units, player_paths, &resolve_order) : import_world(player_units, player_paths);
+    if (!unit_stacks) exit(1);
+    build_cost_tables();
+    printf("World loaded in %.1f ms, %.1f MB\n", elapsed_us(load_us) / 1000.0, (f64)world_arena.total / (1 << 20));
+    #if HEADLESS
+    if (argc > 5) snprintf(autosave.path, sizeof autosave.path, "%s", argv[5]); // only autosaves when asked to
+    #else
+    snprintf(autosave.path, sizeof autosave.path, "%s", data_file("autosave.bin"));
+    #endif
+
+    #if BENCH_PATHING
+    bench_pathing(unit_stacks);
+    exit(0);
+    #endif
+    #if BENCH_AI
+    bench_ai(player_units, unit_stacks);
+    exit(0);
+    #endif
+    #if BENCH_BATTLES
+    bench_battles();
+    exit(0);
+    #endif
+    #if BENCH_ROLLOUTS
+    bench_rollouts(player_units, unit_stacks);
+    exit(0);
+    #endif
+    #if BENCH_BLIT
+    bench_blit();
+    exit(0);
+    #endif
+    #if BENCH_RLE
+    bench_rle();
+    exit(0);
+    #endif
+    #if BENCH_INDEXED
+    bench_indexed();
+    exit(0);
+    #endif
+
+    #if HEADLESS
+    run_headless(turns, seed, player_units, player_paths, &resolve_order, unit_stacks);
+    exit(0);
+    #else
+    pick_blitters();
+    #if RLE_TERRAIN
+    if (load_rle_atlas("../palette/map_atlas.bin", &terrain_rle) < 0) exit(1);
+    if (terrain_rle.count < TILE_COUNT) { printf("RLE atlas has %u tiles, the map uses %u\n", terrain_rle.count, TILE_COUNT); exit(1); }
+    memcpy(terrain_palette, rle_palette, sizeof terrain_palette);
+    #endif
+    struct tga map_atlas = tga_load("data/map_atlas.tga");
+    struct tga units_atlas = tga_load("data/units_atlas.tga");
+    struct tga directions_atlas = tga_load("data/directions_atlas.tga");
+    if (indexed) {
+        init_indexed();
+        index_atlas(&map_atlas);
+        index_atlas(&units_atlas);
+        index_atlas(&directions_atlas);
+    }
+
+    struct ctx *window = create_window(key_input_callback, mouse_input_callback, resize_window_callback, &camera);
+    struct scaler scaler; create_scaler(&scaler, 8);
+    create_workers(&workers, SIM_THREADS);
+
     thread tid;
-    struct thread_args args = { .player_units = {0} 
-                                , .resolve_order = {0}
-                                , .player_paths = {0}
-                                , .player_units_ptr = player_units
-                                , .resolve_order_ptr = resolve_order
-                                , .player_paths_ptr = &player_paths
+    static struct snapshots snapshots;
+    init_snapshots(&snapshots, player_units, unit_stacks, &resolve_order);
+    struct thread_args args = { .player_units = player_units
+                                , .resolve_order = &resolve_order
+                                , .player_paths = player_paths
                                 , .unit_stacks = unit_stacks
+                                , .snapshots = &snapshots
                                 };
-    
+    thread_create(&tid, script, &args);
+    printf("Script thread started\n");
 
-    while(poll_events(window)) {// poll for events
+    static struct frame_tiles frame_tiles;
+    init_terrain_pages(indexed ? 1 : sizeof(u32));
+    #if DEBUG_FPS
+    struct frame_stats frame_stats = {.since_us = time_us()};
+    #endif
+
+    // wait for events, or only until it's time to look for a new snapshot once the last frame is shown
+    while(wait_events(window, window->vsync_ready ? IDLE_WAIT_MS : -1)) {
         if (!window->vsync_ready) continue; // wait for next event until vsync is not done
 
         u64 frame_us = time_us();
-        
-        if (frame == 0) {
-            memcpy(args.player_units, player_units, sizeof(struct unit_list) * PLAYER_COUNT);
-            memcpy(args.resolve_order, resolve_order, sizeof(struct resolve_bucket) * BUCKET_COUNT);
-            memcpy(args.player_paths, player_paths, sizeof(struct path) * PLAYER_COUNT * MAX_UNITS);
-            thread_create(&tid, script, &args);
-            printf("Script thread started\n");
-        }
-        u64 us_thread = elapsed_us(frame_us);
+        struct world_snapshot *view = acquire_snapshot(&snapshots);
 
         static u32 scalingbuffer[MAX_BUFFER_HEIGHT][MAX_BUFFER_WIDTH];
+        static u8 indexbuffer[MAX_BUFFER_HEIGHT][MAX_BUFFER_WIDTH];
         camera.buffer = camera.need_scaling ? (u32 *)scalingbuffer : get_buffer(window);
-        u64 us_get_buffer = elapsed_us(frame_us);
-        
-        if (process_input(&camera)) _exit(0); 
-        u64 us_process_inputs = elapsed_us(frame_us);
-
-        draw_terrain(camera, map_atlas);
-        u64 us_draw_terrain = elapsed_us(frame_us);
-        draw_units(camera, units_atlas, player_units, unit_stacks);
-        u64 us_draw_units = elapsed_us(frame_us);
-        draw_steps(camera, directions_atlas, player_units, resolve_order);
-        u64 us_draw_steps = elapsed_us(frame_us);
+        camera.indices = indexed ? (u8 *)indexbuffer : NULL;
         
-        if (camera.need_scaling) {
-            scale(&scaler, camera.buffer, camera.buffer_w, camera.buffer_h, get_buffer(window), camera.display_w);
+        if (process_input(&camera)) break;
+
+        bool moved = follow_camera(&camera, &frame_tiles);
+        if (!moved && view == frame_tiles.view) { // nothing new since the last look, nothing to do
+            #if DEBUG_FPS
+            frame_stats.idle++;
+            #endif
+            continue;
+        }
+        frame_tiles.view = view;
+        look_at_view(camera, view, &frame_tiles);
+        u32 dirty = mark_dirty(camera, &frame_tiles);
+        if (dirty > 0 || frame_tiles.scrolled) {
+            redraw_dirty(camera, map_atlas, units_atlas, directions_atlas, view, &frame_tiles);
+            present_dirty(camera, &frame_tiles, &scaler, window);
         }
-        u64 us_scale_buffer = elapsed_us(frame_us);
-        commit(window); // tell compositor it can read from the buffer
-        frame ++;
 
         #if DEBUG_FPS
-        printf("total: %ld us\n", elapsed_us(frame_us));
-        printf("get thread: %ld us\n", us_thread);
-        printf("process inputs: %ld us\n", us_process_inputs);
-        printf("get buffer: %ld us\n", us_get_buffer);
-        printf("draw terrain: %ld us\n", us_draw_terrain);
-        printf("draw units: %ld us\n", us_draw_units);
-        printf("draw steps: %ld us\n", us_draw_steps);
-        printf("scale buffer: %ld us\n", us_scale_buffer);
-        u64 us_per_frame = elapsed_us(start_us) / frame;
-        printf("TIME: %ld, FRAME: %d, US PER FRAME: %ld\n", elapsed_us(start_us), frame, us_per_frame);
+        count_frame(&frame_stats, dirty, elapsed_us(frame_us));
         #endif
     }
+    atomic_store(&sim_clock.stop, 1);
+    thread_join(tid, NULL);
+    finish_autosave(&autosave, player_units, unit_stacks, &resolve_order);
     _exit(0);
+    #endif
 }
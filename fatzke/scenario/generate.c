@@ -0,0 +1,305 @@
+// tcc generate.c -run <output directory> [key=value ...]
+// writes map.tga, players.tga, units.tga and scenario.txt in the formats main.c loads, point a HEADLESS build at the
+// directory (or copy the files over data/) to run it; the same keys and seed always give the same files
+// keys (defaults in brackets):
+//   w, h [256]               map size in tiles, up to 65535
+//   players [2]              1 to 16
+//   units [100]              units per player
+//   seed [1]
+//   layout [blobs]           blobs:      noise terrain, territories around random capitals
+//                            coast:      one long winding strip of land with sea on both sides
+//                            chokepoint: a mountain wall down the middle with a few narrow gaps, players on both sides
+//                            front:      every player owns a band of columns, units packed along the borders
+//   sea, mountains, cropland, plains, forest [10, 5, 25, 40, 20]
+//                            terrain mix in percent of the tiles, sea lowest and mountains highest on the noise
+//   cities [5]               cities per 1000 land tiles
+//   gaps [3]                 openings in the chokepoint wall
+//   motorized, armor [20, 10] percent of the units, the rest is infantry
+//   move_budget [400]        written to scenario.txt
+#include "../../header/header.inc"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <stdbool.h>
+
+// same values as the tables in main.c
+enum tiles { SEA, CITY, MOUNTAINS, CROPLAND, PLAINS, FOREST, TILE_COUNT };
+u32 tile_colors[TILE_COUNT] = {
+    [SEA] = 0xFF90ccd4,
+    [CITY] = 0xFFff1a1a,
+    [MOUNTAINS] = 0xFF674616,
+    [CROPLAND] = 0xFFc79720,
+    [PLAINS] = 0xFF307118,
+    [FOREST] = 0xFF21480e
+};
+enum units { INFANTRY, MOTORIZED, ARMOR, UNIT_COUNT };
+u32 unit_colors[UNIT_COUNT] = {
+    [INFANTRY] = 0xFF000000,
+    [MOTORIZED] = 0xFF383838,
+    [ARMOR] = 0xFF6f6f6f,
+};
+#define MAX_PLAYERS 16
+u32 player_colors[MAX_PLAYERS] = {
+    0xFF6a3e0d, 0xFF6a0d33, 0xFF8a1c1c, 0xFF1c3a8a, 0xFF2e7a3a, 0xFFb0a040, 0xFF3a6a9a, 0xFFa05a7a,
+    0xFFb07a1c, 0xFF5a7a2e, 0xFFd0d0e0, 0xFF7a3a9a, 0xFF40a0b0, 0xFF9a4a3a, 0xFFc0903a, 0xFF2a4a6a
+};
+#define NO_OWNER 0xFF
+
+enum layouts { BLOBS, COAST, CHOKEPOINT, FRONT, LAYOUT_COUNT };
+const char *layout_names[LAYOUT_COUNT] = {"blobs", "coast", "chokepoint", "front"};
+
+struct settings {
+    u32 w, h, players, units, seed, layout;
+    u32 mix[TILE_COUNT]; // percent per terrain, CITY comes from cities instead
+    u32 cities; // per 1000 land tiles
+    u32 gaps;
+    u32 motorized, armor;
+    u32 move_budget;
+};
+
+static u32 hash32(u32 x) {
+    x ^= x >> 16; x *= 0x7feb352d;
+    x ^= x >> 15; x *= 0x846ca68b;
+    x ^= x >> 16;
+    return x;
+}
+u32 rng_state;
+static u32 rng(void) { return rng_state = hash32(rng_state + 0x9e3779b9); }
+
+// value noise at (x, y) with cells of scale tiles, 0 to 1
+static f32 value_noise(u32 seed, f32 x, f32 y, f32 scale) {
+    x /= scale, y /= scale;
+    u32 x0 = (u32)x, y0 = (u32)y;
+    f32 fx = x - x0, fy = y - y0;
+    fx = fx * fx * (3 - 2 * fx), fy = fy * fy * (3 - 2 * fy);
+    #define CORNER(cx, cy) ((hash32(seed ^ hash32((cx) * 0x8da6b343u ^ (cy) * 0xd8163841u)) >> 8) / (f32)(1 << 24))
+    f32 top = CORNER(x0, y0) + (CORNER(x0 + 1, y0) - CORNER(x0, y0)) * fx;
+    f32 bottom = CORNER(x0, y0 + 1) + (CORNER(x0 + 1, y0 + 1) - CORNER(x0, y0 + 1)) * fx;
+    #undef CORNER
+    return top + (bottom - top) * fy;
+}
+
+static f32 elevation(struct settings *s, u32 x, u32 y) {
+    f32 e = 0, weight = 0, scale = (s->w < s->h ? s->w : s->h) / 4.0f + 8;
+    for (u32 octave = 0; octave < 5; octave++, scale /= 2) {
+        f32 amplitude = 1.0f / (1 << octave);
+        e += value_noise(s->seed + octave, x, y, scale < 2 ? 2 : scale) * amplitude;
+        weight += amplitude;
+    }
+    return e / weight;
+}
+
+// terrain from the elevation with thresholds at the quantiles of the mix, so the percentages hold on any map
+static void generate_terrain(struct settings *s, u8 *terrain) {
+    usize tiles = (usize)s->w * s->h;
+    f32 *height = malloc(sizeof(f32) * tiles);
+    if (!height) { fprintf(stderr, "OOM: elevation\n"); exit(1); }
+    for (u32 y = 0; y < s->h; y++) {
+        for (u32 x = 0; x < s->w; x++) {
+            f32 e = elevation(s, x, y);
+            if (s->layout == COAST) { // land only close to a winding line from left to right
+                f32 line = s->h / 2.0f + s->h / 4.0f * sinf(x * 6.2831853f * 3 / s->w) + (value_noise(s->seed ^ 0xc0a57, x, 0, 16) - 0.5f) * s->h / 8;
+                f32 band = s->h / 16.0f + 2, distance = fabsf((f32)y - line) / band;
+                e = distance < 1 ? 0.5f + e * 0.5f - distance * 0.25f : e * 0.25f;
+            }
+            height[(usize)y * s->w + x] = e;
+        }
+    }
+    const u32 BINS = 4096;
+    usize *histogram = calloc(BINS, sizeof(usize));
+    for (usize i = 0; i < tiles; i++) histogram[(u32)(height[i] * (BINS - 1))]++;
+    // low to high: sea, cropland, plains, forest, mountains
+    u32 order[] = {SEA, CROPLAND, PLAINS, FOREST, MOUNTAINS}, percent_total = 0;
+    for (u32 i = 0; i < 5; i++) percent_total += s->mix[order[i]];
+    u32 upper_bin[5], bin = 0;
+    usize below = 0, wanted = 0;
+    for (u32 i = 0; i < 5; i++) {
+        wanted += tiles * s->mix[order[i]] / (percent_total ? percent_total : 1);
+        while (bin < BINS && below + histogram[bin] <= wanted) below += histogram[bin++];
+        upper_bin[i] = i == 4 ? BINS : bin;
+    }
+    for (usize i = 0; i < tiles; i++) {
+        u32 b = (u32)(height[i] * (BINS - 1)), kind = 0;
+        while (kind < 4 && b >= upper_bin[kind]) kind++;
+        terrain[i] = order[kind];
+    }
+    free(histogram);
+    free(height);
+    if (s->layout == CHOKEPOINT) { // a wall of mountains three tiles wide with evenly spread gaps of one or two tiles
+        for (u32 y = 0; y < s->h; y++)
+            for (u32 x = s->w / 2 - 1; x <= s->w / 2 + 1 && x < s->w; x++) terrain[(usize)y * s->w + x] = MOUNTAINS;
+        for (u32 gap = 0; gap < s->gaps; gap++) {
+            u32 gap_y = (u32)((u64)s->h * (2 * gap + 1) / (2 * s->gaps)), width = 1 + rng() % 2;
+            for (u32 y = gap_y; y < gap_y + width && y < s->h; y++)
+                for (u32 x = s->w / 2 - 2; x <= s->w / 2 + 2 && x < s->w; x++) terrain[(usize)y * s->w + x] = PLAINS;
+        }
+    }
+    usize land = 0;
+    for (usize i = 0; i < tiles; i++) land += terrain[i] != SEA && terrain[i] != MOUNTAINS;
+    for (usize city = 0; city < land * s->cities / 1000; city++) {
+        for (u32 tries = 0; tries < 100; tries++) {
+            usize i = ((usize)rng() << 16 ^ rng()) % tiles;
+            if (terrain[i] == SEA || terrain[i] == MOUNTAINS || terrain[i] == CITY) continue;
+            terrain[i] = CITY;
+            break;
+        }
+    }
+}
+
+// owner per tile: nearest capital for blobs and coast, within its own half for chokepoint, bands of columns for front
+static void generate_owners(struct settings *s, const u8 *terrain, u8 *owner) {
+    f32 capital_x[MAX_PLAYERS], capital_y[MAX_PLAYERS];
+    u32 columns = 1;
+    while (columns * columns < s->players) columns++;
+    u32 rows = (s->players + columns - 1) / columns;
+    for (u32 player = 0; player < s->players; player++) { // jittered grid so territories come out roughly even
+        u32 column = player % columns, row = player / columns;
+        if (s->layout == CHOKEPOINT) column = player % 2, row = player / 2, columns = 2, rows = (s->players + 1) / 2;
+        capital_x[player] = (column + 0.25f + 0.5f * (rng() % 1000) / 1000.0f) * s->w / columns;
+        capital_y[player] = (row + 0.25f + 0.5f * (rng() % 1000) / 1000.0f) * s->h / rows;
+        if (s->layout == COAST) capital_x[player] = (player + 0.5f) * s->w / s->players, capital_y[player] = s->h / 2.0f; // along the strip
+    }
+    for (u32 y = 0; y < s->h; y++) {
+        for (u32 x = 0; x < s->w; x++) {
+            usize i = (usize)y * s->w + x;
+            if (terrain[i] == SEA) { owner[i] = NO_OWNER; continue; }
+            if (s->layout == FRONT) { owner[i] = (u32)((u64)x * s->players / s->w); continue; }
+            u32 best = 0;
+            f32 best_distance = 1e30f;
+            for (u32 player = 0; player < s->players; player++) {
+                if (s->layout == CHOKEPOINT && s->players > 1 && (player % 2) != (x >= s->w / 2)) continue;
+                f32 dx = x - capital_x[player], dy = s->layout == COAST ? 0 : y - capital_y[player];
+                if (dx * dx + dy * dy < best_distance) best_distance = dx * dx + dy * dy, best = player;
+            }
+            owner[i] = best;
+        }
+    }
+}
+
+struct candidate { u32 key, tile; };
+static int by_key(const void *a, const void *b) {
+    const struct candidate *x = a, *y = b;
+    return x->key != y->key ? (x->key < y->key ? -1 : 1) : (x->tile < y->tile ? -1 : x->tile > y->tile);
+}
+
+// distance in columns to the nearest tile of another player on the same row, the front lines are vertical
+static u32 border_distance(struct settings *s, const u8 *owner, u32 x, u32 y) {
+    u8 own = owner[(usize)y * s->w + x];
+    for (u32 d = 1; d < s->w; d++) {
+        if (x >= d && owner[(usize)y * s->w + x - d] != own && owner[(usize)y * s->w + x - d] != NO_OWNER) return d;
+        if (x + d < s->w && owner[(usize)y * s->w + x + d] != own && owner[(usize)y * s->w + x + d] != NO_OWNER) return d;
+    }
+    return s->w;
+}
+
+// units on passable owned tiles: at random for blobs and coast, closest to the borders first for chokepoint and front
+static u32 generate_units(struct settings *s, const u8 *terrain, const u8 *owner, u32 *units) {
+    usize tiles = (usize)s->w * s->h;
+    struct candidate *candidates = malloc(sizeof(struct candidate) * tiles);
+    u32 *counts = calloc(s->players, sizeof(u32)), placed = 0;
+    if (!candidates || !counts) { fprintf(stderr, "OOM: units\n"); exit(1); }
+    bool packed = s->layout == CHOKEPOINT || s->layout == FRONT;
+    for (u32 player = 0; player < s->players; player++) {
+        u32 count = 0;
+        for (usize i = 0; i < tiles; i++) {
+            if (owner[i] != player || terrain[i] == SEA || terrain[i] == MOUNTAINS) continue;
+            u32 x = i % s->w, y = i / s->w;
+            u32 key = packed ? border_distance(s, owner, x, y) << 16 | (hash32(s->seed ^ (u32)i) & 0xFFFF) : hash32(s->seed ^ (u32)i);
+            candidates[count++] = (struct candidate){key, (u32)i};
+        }
+        qsort(candidates, count, sizeof(struct candidate), by_key);
+        for (u32 i = 0; i < count && counts[player] < s->units; i++, counts[player]++) {
+            u32 roll = rng() % 100;
+            units[candidates[i].tile] = unit_colors[roll < s->armor ? ARMOR : roll < s->armor + s->motorized ? MOTORIZED : INFANTRY];
+        }
+        if (counts[player] < s->units) printf("player %u only has room for %u of %u units\n", player, counts[player], s->units);
+        placed += counts[player];
+    }
+    free(candidates);
+    free(counts);
+    return placed;
+}
+
+static void write_tga(const char *dir, const char *name, u32 w, u32 h, const u32 *pixels) {
+    char path[1024];
+    snprintf(path, sizeof path, "%s/%s", dir, name);
+    FILE *f = fopen(path, "wb");
+    if (!f) { fprintf(stderr, "Can't write %s\n", path); exit(1); }
+    u8 header[18] = {0};
+    header[2] = 2; // uncompressed true colour
+    header[12] = w, header[13] = w >> 8, header[14] = h, header[15] = h >> 8;
+    header[16] = 32;
+    header[17] = 0x28; // top-left origin, 8 alpha bits
+    if (fwrite(header, 1, 18, f) != 18 || fwrite(pixels, 4, (usize)w * h, f) != (usize)w * h) { fprintf(stderr, "Write failed: %s\n", path); exit(1); }
+    fclose(f);
+}
+
+i32 parse_setting(struct settings *s, const char *argument) {
+    char key[64], text[64];
+    if (sscanf(argument, "%63[a-z_]=%63s", key, text) != 2) return -1;
+    u32 value = (u32)strtoul(text, NULL, 10);
+    if (!strcmp(key, "layout")) {
+        for (s->layout = 0; s->layout < LAYOUT_COUNT && strcmp(text, layout_names[s->layout]); s->layout++);
+        return s->layout < LAYOUT_COUNT ? 0 : -2;
+    }
+    if (!strcmp(key, "w")) s->w = value;
+    else if (!strcmp(key, "h")) s->h = value;
+    else if (!strcmp(key, "players")) s->players = value;
+    else if (!strcmp(key, "units")) s->units = value;
+    else if (!strcmp(key, "seed")) s->seed = value;
+    else if (!strcmp(key, "sea")) s->mix[SEA] = value;
+    else if (!strcmp(key, "mountains")) s->mix[MOUNTAINS] = value;
+    else if (!strcmp(key, "cropland")) s->mix[CROPLAND] = value;
+    else if (!strcmp(key, "plains")) s->mix[PLAINS] = value;
+    else if (!strcmp(key, "forest")) s->mix[FOREST] = value;
+    else if (!strcmp(key, "cities")) s->cities = value;
+    else if (!strcmp(key, "gaps")) s->gaps = value;
+    else if (!strcmp(key, "motorized")) s->motorized = value;
+    else if (!strcmp(key, "armor")) s->armor = value;
+    else if (!strcmp(key, "move_budget")) s->move_budget = value;
+    else return -2;
+    return 0;
+}
+
+i32 main(i32 argc, char **argv) {
+    struct settings s = {.w = 256, .h = 256, .players = 2, .units = 100, .seed = 1, .layout = BLOBS,
+                         .mix = {[SEA] = 10, [MOUNTAINS] = 5, [CROPLAND] = 25, [PLAINS] = 40, [FOREST] = 20},
+                         .cities = 5, .gaps = 3, .motorized = 20, .armor = 10, .move_budget = 400};
+    if (argc < 2) {
+        fprintf(stderr, "usage: %s <output directory> [key=value ...], see the top of generate.c for the keys\n", argv[0]);
+        return 1;
+    }
+    for (i32 i = 2; i < argc; i++) {
+        if (parse_setting(&s, argv[i]) != 0) { fprintf(stderr, "Bad setting: %s\n", argv[i]); return 1; }
+    }
+    if (s.w < 8 || s.h < 8 || s.w > 0xFFFF || s.h > 0xFFFF) { fprintf(stderr, "Map size has to be 8 to 65535 per side\n"); return 1; }
+    if (s.players < 1 || s.players > MAX_PLAYERS) { fprintf(stderr, "Need 1 to %d players\n", MAX_PLAYERS); return 1; }
+    if ((u64)s.players * s.units >= 0xFFFF) { fprintf(stderr, "At most %u units fit in total\n", 0xFFFF - 1); return 1; }
+    if (s.move_budget > 0xFFFF) { fprintf(stderr, "move_budget can be at most %u\n", 0xFFFF); return 1; }
+    rng_state = s.seed;
+
+    usize tiles = (usize)s.w * s.h;
+    u8 *terrain = malloc(tiles), *owner = malloc(tiles);
+    u32 *pixels = malloc(sizeof(u32) * tiles), *units = calloc(tiles, sizeof(u32));
+    if (!terrain || !owner || !pixels || !units) { fprintf(stderr, "OOM: map\n"); return 1; }
+    generate_terrain(&s, terrain);
+    generate_owners(&s, terrain, owner);
+    u32 placed = generate_units(&s, terrain, owner, units);
+
+    for (usize i = 0; i < tiles; i++) pixels[i] = tile_colors[terrain[i]];
+    write_tga(argv[1], "map.tga", s.w, s.h, pixels);
+    for (usize i = 0; i < tiles; i++) pixels[i] = owner[i] == NO_OWNER ? 0 : player_colors[owner[i]];
+    write_tga(argv[1], "players.tga", s.w, s.h, pixels);
+    write_tga(argv[1], "units.tga", s.w, s.h, units);
+
+    char path[1024];
+    snprintf(path, sizeof path, "%s/scenario.txt", argv[1]);
+    FILE *f = fopen(path, "w");
+    if (!f) { fprintf(stderr, "Can't write %s\n", path); return 1; }
+    fprintf(f, "# generated: w=%u h=%u layout=%s seed=%u\n", s.w, s.h, layout_names[s.layout], s.seed);
+    fprintf(f, "players = %u\nmax_units = %u\nmove_budget = %u\n", s.players, s.units > 128 ? s.units : 128, s.move_budget);
+    fclose(f);
+    printf("%ux%u %s map with %u players and %u units written to %s\n", s.w, s.h, layout_names[s.layout], s.players, placed, argv[1]);
+    return 0;
+}